@@ -0,0 +1,363 @@
+// Copyright (c) 2017-2022, Mudita Sp. z.o.o. All rights reserved.
+// For licensing, see https://github.com/mudita/MuditaOS/LICENSE.md
+
+/*
+ * Synthetic benchmarks of the microtar core. Every measurement goes to
+ * stdout as one JSON document, progress and errors go to stderr.
+ *
+ *   ltar_bench [--dir DIR] [--max-entries N] [--max-size BYTES]
+ *              [--payload BYTES] [--threads N] [--queue-depth N]
+ *
+ * Header workloads (encode, decode, list, find, find_toc) run on archives
+ * of 10, 100, ... up to --max-entries empty files. Payload workloads
+ * (create, extract) run on file sizes from 0 B up to --max-size, with as
+ * many files as fit in --payload bytes. --queue-depth extracts through
+ * io_uring where the kernel has it.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include "microtar.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define PATTERN_SIZE (1024 * 1024)
+#define DECODE_BATCH 1024
+
+typedef struct {
+    const char *dir;
+    unsigned long max_entries;
+    uint64_t max_size;
+    uint64_t payload;
+    unsigned threads;
+    unsigned queue_depth;
+} options_t;
+
+typedef struct {
+    double start;
+    long long syscr;
+    long long syscw;
+} probe_t;
+
+static char pattern[PATTERN_SIZE];
+static int first_result = 1;
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void read_syscalls(long long *syscr, long long *syscw) {
+    /* Linux only, reported as -1 elsewhere */
+    char line[128];
+    FILE *f = fopen("/proc/self/io", "r");
+    *syscr = -1;
+    *syscw = -1;
+    if (!f) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "syscr: %lld", syscr);
+        sscanf(line, "syscw: %lld", syscw);
+    }
+    fclose(f);
+}
+
+
+static void reset_peak_rss(void) {
+    /* Restarts VmHWM so each run reports its own peak */
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+
+static long peak_rss_kb(void) {
+    char line[128];
+    long kb = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %ld", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if (kb < 0) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        kb = ru.ru_maxrss;
+    }
+    return kb;
+}
+
+
+static void probe_start(probe_t *p) {
+    reset_peak_rss();
+    read_syscalls(&p->syscr, &p->syscw);
+    p->start = now();
+}
+
+
+static void probe_report(const probe_t *p, const char *name, unsigned long entries, uint64_t size,
+                         uint64_t bytes, int err) {
+    double seconds = now() - p->start;
+    long long syscr, syscw;
+    read_syscalls(&syscr, &syscw);
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    printf("%s\n    {\"name\": \"%s\", \"entries\": %lu, \"size\": %llu, \"bytes\": %llu, "
+           "\"seconds\": %.6f, \"mb_per_s\": %.2f, \"entries_per_s\": %.0f, "
+           "\"read_syscalls\": %lld, \"write_syscalls\": %lld, \"peak_rss_kb\": %ld, \"error\": %d}",
+           first_result ? "" : ",", name, entries, (unsigned long long) size, (unsigned long long) bytes,
+           seconds, bytes / seconds / (1024 * 1024), entries / seconds,
+           syscr < 0 ? -1 : syscr - p->syscr, syscw < 0 ? -1 : syscw - p->syscw, peak_rss_kb(), err);
+    first_result = 0;
+    fflush(stdout);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", name, mtar_strerror(err));
+    }
+}
+
+
+static void entry_name(char *out, unsigned long i) {
+    sprintf(out, "e%08lu", i);
+}
+
+
+static int write_entries(mtar_t *tar, unsigned long entries, uint64_t size) {
+    int err = MTAR_ESUCCESS;
+    unsigned long i;
+    char name[32];
+    for (i = 0; i < entries && !err; i++) {
+        uint64_t left = size;
+        entry_name(name, i);
+        err = mtar_write_file_header(tar, name, size);
+        while (!err && left > 0) {
+            unsigned chunk = left > PATTERN_SIZE ? PATTERN_SIZE : (unsigned) left;
+            err = mtar_write_data(tar, pattern, chunk);
+            left -= chunk;
+        }
+    }
+    return err ? err : mtar_finalize(tar);
+}
+
+
+static int make_archive(const char *path, unsigned long entries, uint64_t size, unsigned flags) {
+    int err, close_err;
+    mtar_t tar;
+    err = mtar_open(&tar, path, "w");
+    if (err) {
+        return err;
+    }
+    tar.flags |= flags;
+    err = write_entries(&tar, entries, size);
+    close_err = mtar_close(&tar);
+    return err ? err : close_err;
+}
+
+
+static void bench_headers(const options_t *o, unsigned long entries) {
+    int err, close_err;
+    probe_t p;
+    mtar_t tar;
+    mtar_cursor_t c;
+    mtar_header_t h;
+    const void *data = NULL;
+    size_t size = 0;
+    char path[4096], name[32];
+
+    /* encode: headers into a memory archive */
+    probe_start(&p);
+    err = mtar_open_mem(&tar, NULL, 0, "w");
+    if (err) {
+        probe_report(&p, "encode", entries, 0, 0, err);
+        return;
+    }
+    err = write_entries(&tar, entries, 0);
+    if (!err) {
+        err = mtar_mem_data(&tar, &data, &size);
+    }
+    probe_report(&p, "encode", entries, 0, size, err);
+
+    /* decode: the same headers straight out of memory */
+    if (!err) {
+        mtar_header_t *batch = malloc(DECODE_BATCH * sizeof(*batch));
+        uint64_t *offsets = malloc(DECODE_BATCH * sizeof(*offsets));
+        size_t pos = 0;
+        unsigned count;
+        unsigned long total = 0;
+        probe_start(&p);
+        err = batch && offsets ? MTAR_ESUCCESS : MTAR_EFAILURE;
+        while (!err && total < entries) {
+            err = mtar_decode_headers((const char *) data + pos, size - pos, batch, offsets,
+                                      DECODE_BATCH, &count);
+            if (count == 0) {
+                break;
+            }
+            total += count;
+            pos += offsets[count - 1] + 512 + (batch[count - 1].size + 511) / 512 * 512;
+        }
+        probe_report(&p, "decode", total, 0, pos, err == MTAR_ENULLRECORD ? 0 : err);
+        free(batch);
+        free(offsets);
+    }
+    mtar_close(&tar);
+
+    /* list, find and find_toc: the same archive on disk */
+    snprintf(path, sizeof(path), "%s/headers.tar", o->dir);
+    err = make_archive(path, entries, 0, 0);
+    if (err) {
+        fprintf(stderr, "headers.tar: %s\n", mtar_strerror(err));
+        return;
+    }
+
+    probe_start(&p);
+    err = mtar_open(&tar, path, "r");
+    if (!err) {
+        mtar_cursor_init(&c, &tar);
+        while ((err = mtar_cursor_next(&c)) == MTAR_ESUCCESS) {
+            /* Headers only, the cursor steps over the data */
+        }
+        close_err = mtar_close(&tar);
+        err = err == MTAR_ENULLRECORD ? close_err : err;
+    }
+    probe_report(&p, "list", entries, 0, (uint64_t) entries * 512, err);
+
+    /* The last entry is the worst case of a linear scan */
+    entry_name(name, entries - 1);
+    probe_start(&p);
+    err = mtar_open(&tar, path, "r");
+    if (!err) {
+        err = mtar_find(&tar, name, &h);
+        mtar_close(&tar);
+    }
+    probe_report(&p, "find", entries, 0, (uint64_t) entries * 512, err);
+
+    err = make_archive(path, entries, 0, MTAR_FTOC);
+    probe_start(&p);
+    if (!err) {
+        err = mtar_open(&tar, path, "r");
+    }
+    if (!err) {
+        err = mtar_find(&tar, name, &h);
+        mtar_close(&tar);
+    }
+    probe_report(&p, "find_toc", entries, 0, 0, err);
+    unlink(path);
+}
+
+
+static void bench_payload(const options_t *o, uint64_t size) {
+    int err;
+    probe_t p;
+    unsigned long i, entries;
+    mtar_extract_opts_t extract_opts;
+    char path[4096], dest[4096], name[32];
+
+    entries = size ? (unsigned long) (o->payload / size) : 1000;
+    if (entries < 1) {
+        entries = 1;
+    }
+    if (entries > 1000) {
+        entries = 1000;
+    }
+    snprintf(path, sizeof(path), "%s/payload.tar", o->dir);
+    snprintf(dest, sizeof(dest), "%s/extract", o->dir);
+
+    probe_start(&p);
+    err = make_archive(path, entries, size, 0);
+    probe_report(&p, "create", entries, size, entries * size, err);
+    if (err) {
+        unlink(path);
+        return;
+    }
+
+    mkdir(dest, 0755);
+    memset(&extract_opts, 0, sizeof(extract_opts));
+    extract_opts.threads = o->threads;
+    extract_opts.queue_depth = o->queue_depth;
+    probe_start(&p);
+    err = mtar_extract(path, dest, &extract_opts);
+    probe_report(&p, "extract", entries, size, entries * size, err);
+
+    for (i = 0; i < entries; i++) {
+        char file[4200];
+        entry_name(name, i);
+        snprintf(file, sizeof(file), "%s/%s", dest, name);
+        unlink(file);
+    }
+    rmdir(dest);
+    unlink(path);
+}
+
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t n = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': return n << 30;
+        case 'M': case 'm': return n << 20;
+        case 'K': case 'k': return n << 10;
+        default: return n;
+    }
+}
+
+
+int main(int argc, char **argv) {
+    int i;
+    unsigned long entries;
+    uint64_t size;
+    options_t o = {".", 100000, 64ULL << 20, 256ULL << 20, 1, 0};
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--dir")) {
+            o.dir = argv[i + 1];
+        } else if (!strcmp(argv[i], "--max-entries")) {
+            o.max_entries = strtoul(argv[i + 1], NULL, 10);
+        } else if (!strcmp(argv[i], "--max-size")) {
+            o.max_size = parse_size(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--payload")) {
+            o.payload = parse_size(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--threads")) {
+            o.threads = (unsigned) strtoul(argv[i + 1], NULL, 10);
+        } else if (!strcmp(argv[i], "--queue-depth")) {
+            o.queue_depth = (unsigned) strtoul(argv[i + 1], NULL, 10);
+        } else {
+            break;
+        }
+    }
+    if (i < argc || o.threads == 0) {
+        fprintf(stderr, "usage: %s [--dir DIR] [--max-entries N] [--max-size BYTES[K|M|G]] "
+                        "[--payload BYTES[K|M|G]] [--threads N] [--queue-depth N]\n", argv[0]);
+        return 2;
+    }
+    for (i = 0; i < PATTERN_SIZE; i++) {
+        pattern[i] = (char) (i * 31 + (i >> 9));
+    }
+
+    printf("{\n  \"version\": \"%s\",\n  \"results\": [", MTAR_VERSION);
+    for (entries = 10; entries <= o.max_entries; entries *= 10) {
+        bench_headers(&o, entries);
+    }
+    bench_payload(&o, 0);
+    for (size = 4096; size <= o.max_size; size *= 16) {
+        bench_payload(&o, size);
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,107 @@
+--- Benchmarks of the ltar.lua paths on a synthetic tree.
+-- Prints one JSON document, run from a scratch directory with ltar and lfs on the path:
+--   lua bench.lua [files] [file size in bytes]
+
+local tar = require("ltar")
+local lfs = require("lfs")
+
+local files = tonumber(arg[1]) or 1000
+local file_size = tonumber(arg[2]) or 4096
+
+local function read_proc(path, pattern)
+    local f = io.open(path, "r")
+    if not f then
+        return -1
+    end
+    local value = f:read("*a"):match(pattern)
+    f:close()
+    return tonumber(value) or -1
+end
+
+local function probe()
+    local f = io.open("/proc/self/clear_refs", "w")
+    if f then
+        f:write("5")
+        f:close()
+    end
+    return {
+        clock = os.clock(),
+        syscr = read_proc("/proc/self/io", "syscr: (%d+)"),
+        syscw = read_proc("/proc/self/io", "syscw: (%d+)"),
+    }
+end
+
+local results = {}
+
+local function report(p, name, entries, bytes)
+    local seconds = math.max(os.clock() - p.clock, 1e-9)
+    local syscr = read_proc("/proc/self/io", "syscr: (%d+)")
+    local syscw = read_proc("/proc/self/io", "syscw: (%d+)")
+    results[#results + 1] = string.format(
+            '    {"name": "%s", "entries": %d, "bytes": %d, "cpu_seconds": %.6f, "mb_per_s": %.2f, ' ..
+                    '"entries_per_s": %.0f, "read_syscalls": %d, "write_syscalls": %d, "peak_rss_kb": %d}',
+            name, entries, bytes, seconds, bytes / seconds / (1024 * 1024), entries / seconds,
+            syscr < 0 and -1 or syscr - p.syscr, syscw < 0 and -1 or syscw - p.syscw,
+            read_proc("/proc/self/status", "VmHWM:%s*(%d+)"))
+end
+
+local function remove_tree(dir)
+    for file in lfs.dir(dir) do
+        local path = dir .. "/" .. file
+        if file ~= "." and file ~= ".." then
+            if lfs.attributes(path, "mode") == "directory" then
+                remove_tree(path)
+            else
+                os.remove(path)
+            end
+        end
+    end
+    lfs.rmdir(dir)
+end
+
+-- Source tree: files spread over directories of 100
+local payload = string.rep("x", file_size)
+lfs.mkdir("bench_src")
+for i = 0, files - 1 do
+    local dir = string.format("bench_src/d%04d", math.floor(i / 100))
+    lfs.mkdir(dir)
+    local f = assert(io.open(string.format("%s/f%06d", dir, i), "wb"))
+    f:write(payload)
+    f:close()
+end
+local total = files * file_size
+local last = string.format("d%04d/f%06d", math.floor((files - 1) / 100), files - 1)
+
+local p = probe()
+tar.create_from_path("bench_src", "bench.tar")
+report(p, "create_from_path", files, total)
+
+p = probe()
+tar.create_from_path("bench_src", "bench_toc.tar", { toc = true })
+report(p, "create_from_path_toc", files, total)
+
+p = probe()
+local listed = 0
+for _ in tar.iter_by_path("bench.tar") do
+    listed = listed + 1
+end
+report(p, "iter_by_path", listed, 0)
+
+p = probe()
+assert(tar.find("bench.tar", last) == payload)
+report(p, "find", files, file_size)
+
+p = probe()
+assert(tar.find("bench_toc.tar", last) == payload)
+report(p, "find_toc", files, file_size)
+
+p = probe()
+tar.unpack("bench.tar", "bench_out")
+report(p, "unpack", files, total)
+
+remove_tree("bench_out")
+remove_tree("bench_src")
+os.remove("bench.tar")
+os.remove("bench_toc.tar")
+
+print('{\n  "version": "' .. _VERSION .. '",\n  "results": [\n' .. table.concat(results, ",\n") .. '\n  ]\n}')
@@ -3,16 +3,23 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "lualib.h"
 
 #include "lmicrotar.h"
 #include "microtar.h"
 
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define LMICROTAR_VERSION "1.0.0"
 #define LMICROTAR_LIBNAME "lmicrotar"
 
+#define DEFAULT_FRAME_SIZE (1024 * 1024)
+
+/* The core moves at most an unsigned at a time, larger data goes in pieces */
+#define DATA_CHUNK_SIZE (1u << 30)
+
 #if LUA_VERSION_NUM >= 503      /* Lua 5.3+ */
 
 #ifndef luaL_optlong
@@ -21,6 +28,16 @@
 
 #endif
 
+#if LUA_VERSION_NUM < 502      /* Lua 5.1 */
+
+#define lua_rawlen lua_objlen
+
+#endif
+
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"
+#endif
+
 #if LUA_VERSION_NUM >= 502
 #define new_lib(L, l) (luaL_newlib(L, l))
 #else
@@ -48,6 +65,7 @@ static const struct {
         SC(TBLK)
         SC(TDIR)
         SC(TFIFO)
+        SC(TDELETED)
 
         /// Return codes
         SC(ESUCCESS)
@@ -59,6 +77,8 @@ static const struct {
         SC(EBADCHKSUM)
         SC(ENULLRECORD)
         SC(ENOTFOUND)
+        SC(EUNSUPPORTED)
+        SC(EBADNAME)
 
         /* terminator */
         {NULL, 0}
@@ -67,6 +87,13 @@ static const struct {
 typedef struct {
     lua_State *L;
     mtar_t mtar;
+    mtar_index_t index;
+    mtar_cursor_t cursor;
+    bool indexed;
+    bool iterating;
+    int stream_ref;
+    bool writable;
+    bool in_memory;
     bool initialized;
 } mtar_ctx;
 
@@ -74,6 +101,13 @@ static mtar_ctx *new_mtar_ctx(lua_State *L) {
     mtar_ctx *ctx = (mtar_ctx *) lua_newuserdata(L, sizeof(*ctx));
     ctx->L = L;
     memset(&ctx->mtar, 0, sizeof(ctx->mtar));
+    memset(&ctx->index, 0, sizeof(ctx->index));
+    ctx->indexed = false;
+    ctx->iterating = false;
+    ctx->stream_ref = LUA_NOREF;
+    ctx->writable = false;
+    ctx->in_memory = false;
+    ctx->initialized = false;
 
     luaL_getmetatable(L, microtar_meta);
     lua_setmetatable(L, -2);        /* set metatable */
@@ -81,9 +115,20 @@ static mtar_ctx *new_mtar_ctx(lua_State *L) {
     return ctx;
 }
 
+static void drop_mtar_index(mtar_ctx *ctx) {
+    if (ctx->indexed) {
+        mtar_index_free(&ctx->index);
+        ctx->indexed = false;
+    }
+}
+
 static int free_mtar_ctx(lua_State *L, mtar_ctx *ctx) {
+    drop_mtar_index(ctx);
     int ret = mtar_close(&ctx->mtar);
     memset(&ctx->mtar, 0, sizeof(ctx->mtar));
+    /* Let go of the Lua file a stream handle was reading or writing */
+    luaL_unref(L, LUA_REGISTRYINDEX, ctx->stream_ref);
+    ctx->stream_ref = LUA_NOREF;
     return ret;
 }
 
@@ -99,7 +144,61 @@ static mtar_ctx *check_mtar_ctx(lua_State *L, int index) {
 
 static void path_remove_cwd(char *from) {
     if (strlen(from) >= 2 && strncmp(from, "./", 2) == 0) {
-        memcpy(from, from + 2, strlen(from) + 1);
+        memmove(from, from + 2, strlen(from) - 1);
+    }
+}
+
+static void push_header(lua_State *L, const mtar_header_t *head) {
+    lua_newtable(L);
+
+    lua_pushliteral(L, "mode");
+    lua_pushnumber(L, head->mode);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "owner");
+    lua_pushnumber(L, head->owner);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "size");
+    lua_pushinteger(L, (lua_Integer) head->size);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "mtime");
+    lua_pushnumber(L, head->mtime);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "type");
+    lua_pushnumber(L, head->type);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "name");
+    lua_pushstring(L, head->name);
+    lua_settable(L, -3);
+
+    lua_pushliteral(L, "linkname");
+    lua_pushstring(L, head->linkname);
+    lua_settable(L, -3);
+
+    if (head->sparse) {
+        lua_pushliteral(L, "realsize");
+        lua_pushinteger(L, (lua_Integer) head->realsize);
+        lua_settable(L, -3);
+    }
+
+    if (head->digests & MTAR_FCRC32C) {
+        lua_pushliteral(L, "crc32c");
+        lua_pushnumber(L, head->crc32c);
+        lua_settable(L, -3);
+    }
+
+    if (head->digests & MTAR_FSHA256) {
+        char hex[65];
+        for (int i = 0; i < 32; i++) {
+            snprintf(hex + 2 * i, 3, "%02x", head->sha256[i]);
+        }
+        lua_pushliteral(L, "sha256");
+        lua_pushstring(L, hex);
+        lua_settable(L, -3);
     }
 }
 
@@ -110,12 +209,123 @@ static void set_info(lua_State *L) {
     lua_setfield(L, -2, "_VERSION");
 }
 
+static unsigned opt_threads(lua_State *L, int index) {
+    unsigned threads = 1;
+    if (lua_isnoneornil(L, index)) {
+        return threads;
+    }
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_getfield(L, index, "threads");
+    if (!lua_isnil(L, -1)) {
+        lua_Integer n = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, n > 0, index, "threads must be positive");
+        threads = (unsigned) n;
+    }
+    lua_pop(L, 1);
+    return threads;
+}
+
+static unsigned opt_queue_depth(lua_State *L, int index) {
+    /* queue_depth = transfers kept in flight through io_uring, 0 for none */
+    unsigned depth = 0;
+    if (lua_isnoneornil(L, index)) {
+        return depth;
+    }
+    lua_getfield(L, index, "queue_depth");
+    if (!lua_isnil(L, -1)) {
+        lua_Integer n = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, n >= 0, index, "queue_depth must not be negative");
+        depth = (unsigned) n;
+    }
+    lua_pop(L, 1);
+    return depth;
+}
+
+static const char *const compress_names[] = {"none", "gzip", "zstd", NULL};
+
+static void opt_compress(lua_State *L, int index, mtar_compress_opts_t *opts) {
+    memset(opts, 0, sizeof(*opts));
+    if (lua_isnoneornil(L, index)) {
+        return;
+    }
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_getfield(L, index, "compress");
+    opts->compress = (unsigned) luaL_checkoption(L, -1, "none", compress_names);
+    lua_getfield(L, index, "level");
+    opts->level = (int) luaL_optinteger(L, -1, 0);
+    /* Seekable archives: frame size in bytes, or true for the default */
+    lua_getfield(L, index, "seekable");
+    if (lua_isnumber(L, -1)) {
+        lua_Integer n = lua_tointeger(L, -1);
+        luaL_argcheck(L, n > 0, index, "seekable frame size must be positive");
+        opts->frame_size = (unsigned) n;
+    } else if (lua_toboolean(L, -1)) {
+        opts->frame_size = DEFAULT_FRAME_SIZE;
+    }
+    lua_pop(L, 3);
+    opts->threads = opt_threads(L, index);
+}
+
+static unsigned opt_flags(lua_State *L, int index) {
+    /* checksum = "crc32c", "sha256" or "both", toc, dedup, sparse and pax = true */
+    static const char *const names[] = {"none", "crc32c", "sha256", "both", NULL};
+    static const unsigned flags[] = {0, MTAR_FCRC32C, MTAR_FSHA256, MTAR_FCRC32C | MTAR_FSHA256};
+    unsigned result;
+    if (lua_isnoneornil(L, index)) {
+        return 0;
+    }
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_getfield(L, index, "checksum");
+    result = flags[luaL_checkoption(L, -1, "none", names)];
+    lua_getfield(L, index, "toc");
+    if (lua_toboolean(L, -1)) {
+        result |= MTAR_FTOC;
+    }
+    lua_getfield(L, index, "dedup");
+    if (lua_toboolean(L, -1)) {
+        result |= MTAR_FDEDUP;
+    }
+    lua_getfield(L, index, "sparse");
+    if (lua_toboolean(L, -1)) {
+        result |= MTAR_FSPARSE;
+    }
+    lua_getfield(L, index, "pax");
+    if (lua_toboolean(L, -1)) {
+        result |= MTAR_FPAX;
+    }
+    lua_pop(L, 5);
+    return result;
+}
+
+static bool opt_stats(lua_State *L, int index) {
+    bool result;
+    if (lua_isnoneornil(L, index)) {
+        return false;
+    }
+    lua_getfield(L, index, "stats");
+    result = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return result;
+}
+
 static int _open(lua_State *L) {
     const char *filename = luaL_checkstring(L, 1);
     const char *mode = luaL_optlstring(L, 2, "r", NULL);
+    mtar_compress_opts_t opts;
+    opt_compress(L, 3, &opts);
+    unsigned flags = opt_flags(L, 3);
     mtar_ctx *ctx = new_mtar_ctx(L);
-    int ret = mtar_open(&ctx->mtar, filename, mode);
+    /* Compressed archives are recognised on read whatever the options */
+    int ret = mtar_open_compressed(&ctx->mtar, filename, mode, &opts);
     if (ret == MTAR_ESUCCESS) {
+        /* Writers record these digests and the table of contents, readers
+         * check the digests as data is read */
+        ctx->mtar.flags |= flags;
+        /* Count from here on; without memory for it, stats() tries again */
+        if (opt_stats(L, 3)) {
+            mtar_stats_enable(&ctx->mtar, NULL, NULL);
+        }
+        ctx->writable = *mode != 'r';
         ctx->initialized = true;
         return 1;
     }
@@ -126,6 +336,211 @@ static int _open(lua_State *L) {
     return 3;
 }
 
+static int _compression(lua_State *L) {
+    const char *filename = luaL_checkstring(L, 1);
+    int ret = mtar_detect_compression(filename);
+    if (ret < 0) {
+        lua_pushnil(L);
+        lua_pushinteger(L, ret);
+        lua_pushstring(L, mtar_strerror(ret));
+        return 3;
+    }
+    if (ret == MTAR_COMPRESS_NONE) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushstring(L, compress_names[ret]);
+    return 1;
+}
+
+static int _open_mmap(lua_State *L) {
+    const char *filename = luaL_checkstring(L, 1);
+    mtar_ctx *ctx = new_mtar_ctx(L);
+    int ret = mtar_open_mmap(&ctx->mtar, filename);
+    if (ret == MTAR_ESUCCESS) {
+        ctx->initialized = true;
+        return 1;
+    }
+
+    lua_pushnil(L);
+    lua_pushinteger(L, ret);
+    lua_pushstring(L, mtar_strerror(ret));
+    return 3;
+}
+
+static int _open_stream(lua_State *L) {
+    /* Both the 5.1 FILE** and the 5.2+ luaL_Stream start with the FILE* */
+    FILE **file = (FILE **) luaL_checkudata(L, 1, LUA_FILEHANDLE);
+    const char *mode = luaL_optlstring(L, 2, "r", NULL);
+    luaL_argcheck(L, *file != NULL, 1, "attempt to use a closed file");
+    mtar_ctx *ctx = new_mtar_ctx(L);
+    int ret = mtar_open_stream(&ctx->mtar, *file, mode);
+    if (ret == MTAR_ESUCCESS) {
+        lua_pushvalue(L, 1);
+        ctx->stream_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        ctx->writable = *mode != 'r';
+        ctx->initialized = true;
+        return 1;
+    }
+
+    lua_pushnil(L);
+    lua_pushinteger(L, ret);
+    lua_pushstring(L, mtar_strerror(ret));
+    return 3;
+}
+
+static int _open_string(lua_State *L) {
+    size_t size = 0;
+    const char *data = luaL_optlstring(L, 1, NULL, &size);
+    const char *mode = luaL_optlstring(L, 2, data ? "r" : "w", NULL);
+    mtar_ctx *ctx = new_mtar_ctx(L);
+    int ret = mtar_open_mem(&ctx->mtar, data, size, mode);
+    if (ret == MTAR_ESUCCESS) {
+        /* Readers work on the string itself, so keep it alive */
+        if (*mode == 'r') {
+            lua_pushvalue(L, 1);
+            ctx->stream_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+        ctx->writable = *mode != 'r';
+        ctx->in_memory = true;
+        ctx->initialized = true;
+        return 1;
+    }
+
+    lua_pushnil(L);
+    lua_pushinteger(L, ret);
+    lua_pushstring(L, mtar_strerror(ret));
+    return 3;
+}
+
+static void opt_walk(lua_State *L, int index, mtar_walk_opts_t *opts) {
+    memset(opts, 0, sizeof(*opts));
+    if (lua_isnoneornil(L, index)) {
+        return;
+    }
+    luaL_checktype(L, index, LUA_TTABLE);
+    /* The pattern string stays referenced by the options table */
+    lua_getfield(L, index, "glob");
+    opts->glob = lua_isnil(L, -1) ? NULL : luaL_checkstring(L, -1);
+    lua_getfield(L, index, "sorted");
+    opts->sorted = lua_toboolean(L, -1);
+    lua_getfield(L, index, "keep_root");
+    opts->keep_root = lua_toboolean(L, -1);
+    lua_pop(L, 3);
+}
+
+static void opt_backup(lua_State *L, int index, mtar_backup_opts_t *opts) {
+    memset(opts, 0, sizeof(*opts));
+    if (lua_isnoneornil(L, index)) {
+        return;
+    }
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_getfield(L, index, "sorted");
+    opts->sorted = lua_toboolean(L, -1);
+    lua_getfield(L, index, "keep_root");
+    opts->keep_root = lua_toboolean(L, -1);
+    lua_getfield(L, index, "hash");
+    opts->hash = lua_toboolean(L, -1);
+    lua_pop(L, 3);
+}
+
+static int push_walk_entry(const mtar_walk_entry_t *e, void *arg) {
+    lua_State *L = arg;
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, e->name);
+    lua_setfield(L, -2, "name");
+    lua_pushstring(L, e->path);
+    lua_setfield(L, -2, "path");
+    lua_pushinteger(L, (lua_Integer) e->size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, e->type);
+    lua_setfield(L, -2, "type");
+    lua_rawseti(L, -2, (int) lua_rawlen(L, -2) + 1);
+    return MTAR_ESUCCESS;
+}
+
+static int _walk(lua_State *L) {
+    const char *root = luaL_checkstring(L, 1);
+    mtar_walk_opts_t opts;
+    opt_walk(L, 2, &opts);
+    lua_newtable(L);
+    int result = mtar_walk(root, &opts, push_walk_entry, L);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    return 1;
+}
+
+static int _extract(lua_State *L) {
+    const char *filename = luaL_checkstring(L, 1);
+    const char *dest = luaL_checkstring(L, 2);
+    mtar_extract_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = opt_threads(L, 3);
+    opts.queue_depth = opt_queue_depth(L, 3);
+    int result = mtar_extract(filename, dest, &opts);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
+
+static int _create(lua_State *L) {
+    const char *filename = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    mtar_create_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = opt_threads(L, 3);
+    opts.queue_depth = opt_queue_depth(L, 3);
+
+    size_t count = lua_rawlen(L, 2);
+    mtar_create_entry_t *entries = calloc(count ? count : 1, sizeof(*entries));
+    if (entries == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Allocation failed");
+        return 2;
+    }
+    /* Strings stay referenced by the entries table for the whole call */
+    for (size_t i = 0; i < count; i++) {
+        mtar_create_entry_t *e = &entries[i];
+        lua_rawgeti(L, 2, (lua_Integer) i + 1);
+        if (!lua_istable(L, -1)) {
+            free(entries);
+            return luaL_argerror(L, 2, "entries must be tables");
+        }
+        lua_getfield(L, -1, "name");
+        e->name = lua_tostring(L, -1);
+        lua_getfield(L, -2, "path");
+        e->path = lua_tostring(L, -1);
+        lua_getfield(L, -3, "size");
+        e->size = (uint64_t) lua_tointeger(L, -1);
+        lua_getfield(L, -4, "type");
+        e->type = lua_isnil(L, -1) ? MTAR_TREG : (unsigned) lua_tointeger(L, -1);
+        lua_pop(L, 5);
+        if (e->name == NULL || (e->type != MTAR_TDIR && e->path == NULL)) {
+            free(entries);
+            return luaL_argerror(L, 2, "entries need a name, and files a path");
+        }
+    }
+    int result = mtar_create(filename, entries, count, &opts);
+    free(entries);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
+
 static int _close(lua_State *L) {
     mtar_ctx *ctx = check_mtar_ctx(L, 1);
     if (!ctx->initialized) {
@@ -133,8 +548,21 @@ static int _close(lua_State *L) {
         return 1;
     }
     ctx->initialized = false;
-    int ret = mtar_finalize(&ctx->mtar);
+    /* Read-only handles have no trailer to write */
+    int ret = ctx->writable ? mtar_finalize(&ctx->mtar) : MTAR_ESUCCESS;
+    if (ret == MTAR_ESUCCESS && ctx->writable && ctx->in_memory) {
+        /* Memory writers hand the finished archive back as a string */
+        const void *data;
+        size_t size;
+        ret = mtar_mem_data(&ctx->mtar, &data, &size);
+        if (ret == MTAR_ESUCCESS) {
+            lua_pushlstring(L, data, size);
+            free_mtar_ctx(L, ctx);
+            return 1;
+        }
+    }
     if (ret != MTAR_ESUCCESS) {
+        free_mtar_ctx(L, ctx);
         lua_pushnil(L);
         lua_pushinteger(L, ret);
         lua_pushstring(L, mtar_strerror(ret));
@@ -146,9 +574,11 @@ static int _close(lua_State *L) {
 
 static int _write_file_header(lua_State *L) {
     mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    drop_mtar_index(ctx);
     const char *name = luaL_checkstring(L, 2);
-    const int size = luaL_checkinteger(L, 3);
-    int result = mtar_write_file_header(&ctx->mtar, name, size);
+    const lua_Integer size = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, size >= 0, 3, "size must not be negative");
+    int result = mtar_write_file_header(&ctx->mtar, name, (uint64_t) size);
     if (result != MTAR_ESUCCESS) {
         lua_pushnil(L);
         lua_pushinteger(L, result);
@@ -161,6 +591,7 @@ static int _write_file_header(lua_State *L) {
 
 static int _write_dir_header(lua_State *L) {
     mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    drop_mtar_index(ctx);
     const char *name = luaL_checkstring(L, 2);
     int result = mtar_write_dir_header(&ctx->mtar, name);
     if (result != MTAR_ESUCCESS) {
@@ -175,9 +606,18 @@ static int _write_dir_header(lua_State *L) {
 
 static int _write_data(lua_State *L) {
     mtar_ctx *ctx = check_mtar_ctx(L, 1);
-    const char *data = luaL_checkstring(L, 2);
-    const int size = luaL_checkinteger(L, 3);
-    int result = mtar_write_data(&ctx->mtar, data, size);
+    drop_mtar_index(ctx);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    lua_Integer size = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, size >= 0 && (uint64_t) size <= len, 3, "size out of range");
+    int result = MTAR_ESUCCESS;
+    while (size > 0 && result == MTAR_ESUCCESS) {
+        unsigned chunk = (uint64_t) size < DATA_CHUNK_SIZE ? (unsigned) size : DATA_CHUNK_SIZE;
+        result = mtar_write_data(&ctx->mtar, data, chunk);
+        data += chunk;
+        size -= chunk;
+    }
     if (result != MTAR_ESUCCESS) {
         lua_pushnil(L);
         lua_pushinteger(L, result);
@@ -188,9 +628,12 @@ static int _write_data(lua_State *L) {
     return 1;
 }
 
-static int _next(lua_State *L) {
+static int _add_file(lua_State *L) {
     mtar_ctx *ctx = check_mtar_ctx(L, 1);
-    int result = mtar_next(&ctx->mtar);
+    drop_mtar_index(ctx);
+    const char *path = luaL_checkstring(L, 2);
+    const char *name = luaL_optlstring(L, 3, path, NULL);
+    int result = mtar_write_file(&ctx->mtar, path, name);
     if (result != MTAR_ESUCCESS) {
         lua_pushnil(L);
         lua_pushinteger(L, result);
@@ -201,41 +644,117 @@ static int _next(lua_State *L) {
     return 1;
 }
 
-static int _find(lua_State *L) {
+static int _add_tree(lua_State *L) {
     mtar_ctx *ctx = check_mtar_ctx(L, 1);
-    const char *name = luaL_checkstring(L, 2);
-    mtar_header_t head;
-    int result = mtar_find(&ctx->mtar, name, &head);
-    if (result == MTAR_ESUCCESS) {
-        lua_newtable(L);
+    drop_mtar_index(ctx);
+    const char *root = luaL_checkstring(L, 2);
+    mtar_walk_opts_t opts;
+    opt_walk(L, 3, &opts);
+    int result = mtar_write_tree(&ctx->mtar, root, &opts);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
 
-        lua_pushliteral(L, "mode");
-        lua_pushnumber(L, head.mode);
-        lua_settable(L, -3);
+static int _backup(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    drop_mtar_index(ctx);
+    const char *root = luaL_checkstring(L, 2);
+    mtar_backup_opts_t opts;
+    opt_backup(L, 3, &opts);
+    int result = ctx->writable ? mtar_backup(&ctx->mtar, root, &opts) : MTAR_EUNSUPPORTED;
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
 
-        lua_pushliteral(L, "owner");
-        lua_pushnumber(L, head.owner);
-        lua_settable(L, -3);
+static int _commit(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    /* The archive is complete on disk, further entries keep extending it */
+    int result = ctx->writable ? mtar_commit(&ctx->mtar) : MTAR_EUNSUPPORTED;
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
 
-        lua_pushliteral(L, "size");
-        lua_pushnumber(L, head.size);
-        lua_settable(L, -3);
+static int _set_buffer(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    const int size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0, 2, "buffer size must not be negative");
+    int result = mtar_set_buffer(&ctx->mtar, size);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
 
-        lua_pushliteral(L, "mtime");
-        lua_pushnumber(L, head.mtime);
-        lua_settable(L, -3);
+static int _next(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    ctx->iterating = false;
+    int result = mtar_next(&ctx->mtar);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
 
-        lua_pushliteral(L, "type");
-        lua_pushnumber(L, head.type);
-        lua_settable(L, -3);
+static int locate_name(mtar_ctx *ctx, const char *name, mtar_header_t *head) {
+    /* A table of contents is kept current by the core, appends included */
+    if (ctx->mtar.toc) {
+        return mtar_find(&ctx->mtar, name, head);
+    }
+    /* Otherwise scan the archive once and answer all further lookups from the index */
+    if (!ctx->indexed) {
+        ctx->indexed = mtar_index_build(&ctx->mtar, &ctx->index) == MTAR_ESUCCESS;
+    }
+    if (ctx->indexed) {
+        return mtar_index_find(&ctx->mtar, &ctx->index, name, head);
+    }
+    return mtar_find(&ctx->mtar, name, head);
+}
 
-        lua_pushliteral(L, "name");
-        lua_pushstring(L, head.name);
-        lua_settable(L, -3);
+static int locate_entry(mtar_ctx *ctx, const char *name, mtar_header_t *head) {
+    char cwd_name[sizeof(head->name) + 2];
+    int result = locate_name(ctx, name, head);
+    /* Names are handed out without a leading "./", look them up under it too */
+    if (result == MTAR_ENOTFOUND && strncmp(name, "./", 2) != 0 && strlen(name) < sizeof(head->name)) {
+        snprintf(cwd_name, sizeof(cwd_name), "./%s", name);
+        result = locate_name(ctx, cwd_name, head);
+    }
+    return result;
+}
 
-        lua_pushliteral(L, "linkname");
-        lua_pushstring(L, head.linkname);
-        lua_settable(L, -3);
+static int _find(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    ctx->iterating = false;
+    const char *name = luaL_checkstring(L, 2);
+    mtar_header_t head;
+    int result = locate_entry(ctx, name, &head);
+    if (result == MTAR_ESUCCESS) {
+        push_header(L, &head);
         return 1;
     } else {
         lua_pushnil(L);
@@ -245,41 +764,48 @@ static int _find(lua_State *L) {
     }
 }
 
+static int _extract_entry(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    ctx->iterating = false;
+    const char *name = luaL_checkstring(L, 2);
+    const char *path = luaL_checkstring(L, 3);
+    int result = locate_entry(ctx, name, NULL);
+    if (result == MTAR_ESUCCESS) {
+        result = mtar_extract_file(&ctx->mtar, path);
+    }
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
+
+static int _extract_data(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    /* The entry the iterator is on, holes and all */
+    int result = ctx->iterating ? mtar_cursor_extract(&ctx->cursor, path) : MTAR_EFAILURE;
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_pushinteger(L, result);
+    return 1;
+}
+
 static int _read_header(lua_State *L) {
     mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    ctx->iterating = false;
     mtar_header_t head;
     int result = mtar_read_header(&ctx->mtar, &head);
     if (result == MTAR_ESUCCESS) {
-        lua_newtable(L);
-
-        lua_pushliteral(L, "mode");
-        lua_pushnumber(L, head.mode);
-        lua_settable(L, -3);
-
-        lua_pushliteral(L, "owner");
-        lua_pushnumber(L, head.owner);
-        lua_settable(L, -3);
-
-        lua_pushliteral(L, "size");
-        lua_pushnumber(L, head.size);
-        lua_settable(L, -3);
-
-        lua_pushliteral(L, "mtime");
-        lua_pushnumber(L, head.mtime);
-        lua_settable(L, -3);
-
-        lua_pushliteral(L, "type");
-        lua_pushnumber(L, head.type);
-        lua_settable(L, -3);
-
-        lua_pushliteral(L, "name");
         path_remove_cwd(head.name);
-        lua_pushstring(L, head.name);
-        lua_settable(L, -3);
-
-        lua_pushliteral(L, "linkname");
-        lua_pushstring(L, head.linkname);
-        lua_settable(L, -3);
+        push_header(L, &head);
         return 1;
     } else {
         lua_pushnil(L);
@@ -289,16 +815,53 @@ static int _read_header(lua_State *L) {
     }
 }
 
+static int read_chunk(mtar_ctx *ctx, char *data, const void **view, unsigned size) {
+    if (view) {
+        return ctx->iterating ? mtar_cursor_read_view(&ctx->cursor, view, size)
+                              : mtar_read_data_view(&ctx->mtar, view, size);
+    }
+    return ctx->iterating ? mtar_cursor_read(&ctx->cursor, data, size)
+                          : mtar_read_data(&ctx->mtar, data, size);
+}
+
 static int _read_data(lua_State *L) {
     mtar_ctx *ctx = check_mtar_ctx(L, 1);
-    const int size = luaL_checkinteger(L, 2);
-    char *data = calloc(1, size);
+    lua_Integer size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0 && (uint64_t) size <= SIZE_MAX, 2, "size out of range");
+    const void *view;
+    int result;
+    if (ctx->mtar.view && (uint64_t) size <= DATA_CHUNK_SIZE) {
+        /* Memory backed archive, copy straight from the mapping */
+        result = size ? read_chunk(ctx, NULL, &view, (unsigned) size) : MTAR_ESUCCESS;
+        if (result != MTAR_ESUCCESS) {
+            lua_pushnil(L);
+            lua_pushinteger(L, result);
+            lua_pushstring(L, mtar_strerror(result));
+            return 3;
+        }
+        lua_pushlstring(L, size ? view : "", (size_t) size);
+        return 1;
+    }
+    char *data = malloc(size ? (size_t) size : 1);
     if (data == NULL) {
         lua_pushnil(L);
         lua_pushfstring(L, "Allocation failed");
         return 2;
     }
-    int result = mtar_read_data(&ctx->mtar, data, size);
+    size_t done = 0;
+    result = MTAR_ESUCCESS;
+    while (done < (size_t) size && result == MTAR_ESUCCESS) {
+        unsigned chunk = (size_t) size - done < DATA_CHUNK_SIZE ? (unsigned) ((size_t) size - done) : DATA_CHUNK_SIZE;
+        if (ctx->mtar.view) {
+            result = read_chunk(ctx, NULL, &view, chunk);
+            if (result == MTAR_ESUCCESS) {
+                memcpy(data + done, view, chunk);
+            }
+        } else {
+            result = read_chunk(ctx, data + done, NULL, chunk);
+        }
+        done += chunk;
+    }
     if (result != MTAR_ESUCCESS) {
         lua_pushnil(L);
         lua_pushinteger(L, result);
@@ -306,11 +869,281 @@ static int _read_data(lua_State *L) {
         free(data);
         return 3;
     }
-    lua_pushlstring(L, data, size);
+    lua_pushlstring(L, data, (size_t) size);
     free(data);
     return 1;
 }
 
+static int _entries_next(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, lua_upvalueindex(1));
+    if (!ctx->iterating) {
+        lua_pushnil(L);
+        return 1;
+    }
+    int result = mtar_cursor_next(&ctx->cursor);
+    if (result != MTAR_ESUCCESS) {
+        ctx->iterating = false;
+        lua_pushnil(L);
+        if (result == MTAR_ENULLRECORD) {
+            return 1;
+        }
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    path_remove_cwd(ctx->cursor.header.name);
+    push_header(L, &ctx->cursor.header);
+    return 1;
+}
+
+static int _entries(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    /* Streams can only be iterated once, from wherever they are now */
+    int result = (ctx->mtar.flags & MTAR_FSTREAM) ? MTAR_ESUCCESS : mtar_rewind(&ctx->mtar);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    /* Each step reads one header; read_data serves the current entry */
+    mtar_cursor_init(&ctx->cursor, &ctx->mtar);
+    ctx->iterating = true;
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, _entries_next, 1);
+    return 1;
+}
+
+enum {
+    LIST_NAME,
+    LIST_SIZE,
+    LIST_MTIME,
+    LIST_TYPE,
+    LIST_MODE,
+    LIST_LINKNAME,
+    LIST_FIELDS
+};
+
+static const char *const list_fields[] = {"name", "size", "mtime", "type", "mode", "linkname", NULL};
+
+static void push_list_field(lua_State *L, int field, const mtar_header_t *head) {
+    switch (field) {
+        case LIST_NAME:
+            lua_pushstring(L, head->name);
+            break;
+        case LIST_SIZE:
+            lua_pushinteger(L, (lua_Integer) head->size);
+            break;
+        case LIST_MTIME:
+            lua_pushinteger(L, head->mtime);
+            break;
+        case LIST_TYPE:
+            lua_pushinteger(L, head->type);
+            break;
+        case LIST_MODE:
+            lua_pushinteger(L, head->mode);
+            break;
+        default:
+            lua_pushstring(L, head->linkname);
+            break;
+    }
+}
+
+static int _list(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    int fields[LIST_FIELDS], count = 0, result, i, n = 0;
+    const char *prefix = NULL;
+    size_t prefix_len = 0;
+    mtar_cursor_t cursor;
+
+    /* fields = {"name", "size", ...}, all of them by default; filter = name prefix */
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "fields");
+        if (!lua_isnil(L, -1)) {
+            luaL_checktype(L, -1, LUA_TTABLE);
+            for (i = 1; i <= (int) lua_rawlen(L, -1) && count < LIST_FIELDS; i++) {
+                lua_rawgeti(L, -1, i);
+                fields[count++] = luaL_checkoption(L, -1, NULL, list_fields);
+                lua_pop(L, 1);
+            }
+        }
+        lua_getfield(L, 2, "filter");
+        prefix = lua_isnil(L, -1) ? NULL : luaL_checklstring(L, -1, &prefix_len);
+    }
+    if (count == 0) {
+        for (count = 0; count < LIST_FIELDS; count++) {
+            fields[count] = count;
+        }
+    }
+
+    ctx->iterating = false;
+    result = (ctx->mtar.flags & MTAR_FSTREAM) ? MTAR_ESUCCESS : mtar_rewind(&ctx->mtar);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+
+    /* One table per field, filled side by side; the headers never become
+     * tables of their own */
+    lua_createtable(L, 0, count);
+    int base = lua_gettop(L);
+    for (i = 0; i < count; i++) {
+        lua_createtable(L, 64, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, base, list_fields[fields[i]]);
+    }
+    mtar_cursor_init(&cursor, &ctx->mtar);
+    while ((result = mtar_cursor_next(&cursor)) == MTAR_ESUCCESS) {
+        path_remove_cwd(cursor.header.name);
+        if (prefix && strncmp(cursor.header.name, prefix, prefix_len) != 0) {
+            continue;
+        }
+        n++;
+        for (i = 0; i < count; i++) {
+            push_list_field(L, fields[i], &cursor.header);
+            lua_rawseti(L, base + 1 + i, n);
+        }
+    }
+    if (result != MTAR_ENULLRECORD) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    if (!(ctx->mtar.flags & MTAR_FSTREAM)) {
+        mtar_rewind(&ctx->mtar);
+    }
+    lua_settop(L, base);
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+typedef struct {
+    lua_State *L;
+    int n;
+    bool skip_cwd;
+} match_ctx;
+
+static int push_match(mtar_t *tar, const mtar_index_entry_t *e, const char *name, void *arg) {
+    match_ctx *m = arg;
+    mtar_header_t head;
+    int result;
+    /* Names under "./" are left to the lookup that spells it out */
+    if (m->skip_cwd && strncmp(name, "./", 2) == 0) {
+        return MTAR_ESUCCESS;
+    }
+    result = mtar_seek(tar, e->offset);
+    if (result == MTAR_ESUCCESS) {
+        result = mtar_read_header(tar, &head);
+    }
+    if (result != MTAR_ESUCCESS) {
+        return result;
+    }
+    path_remove_cwd(head.name);
+    push_header(m->L, &head);
+    lua_rawseti(m->L, -2, ++m->n);
+    return MTAR_ESUCCESS;
+}
+
+static int find_match(mtar_ctx *ctx, mtar_index_t *idx, const char *what, int glob, match_ctx *m) {
+    return glob ? mtar_find_glob(&ctx->mtar, idx, what, push_match, m)
+                : mtar_find_prefix(&ctx->mtar, idx, what, push_match, m);
+}
+
+static int find_matching(lua_State *L, int glob) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    const char *what = luaL_checkstring(L, 2);
+    mtar_index_t *idx = NULL;
+    match_ctx m = {L, 0, strncmp(what, "./", 2) != 0};
+    int result;
+    ctx->iterating = false;
+    /* Same index as the single lookups, unless a table of contents answers */
+    if (!ctx->mtar.toc) {
+        if (!ctx->indexed) {
+            ctx->indexed = mtar_index_build(&ctx->mtar, &ctx->index) == MTAR_ESUCCESS;
+        }
+        idx = ctx->indexed ? &ctx->index : NULL;
+    }
+    /* Names are matched as entries() hands them out, a leading "./" removed */
+    const char *cwd_what = m.skip_cwd ? lua_pushfstring(L, "./%s", what) : what;
+    lua_newtable(L);
+    result = find_match(ctx, idx, what, glob, &m);
+    if (m.skip_cwd && (result == MTAR_ESUCCESS || result == MTAR_ENOTFOUND)) {
+        m.skip_cwd = false;
+        result = find_match(ctx, idx, cwd_what, glob, &m);
+    }
+    if (result != MTAR_ESUCCESS && result != MTAR_ENOTFOUND) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    return 1;
+}
+
+static int _find_prefix(lua_State *L) {
+    return find_matching(L, 0);
+}
+
+static int _find_glob(lua_State *L) {
+    return find_matching(L, 1);
+}
+
+static int _verify(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    mtar_header_t bad;
+    ctx->iterating = false;
+    memset(&bad, 0, sizeof(bad));
+    int result = mtar_verify(&ctx->mtar, &bad);
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        lua_pushstring(L, bad.name);
+        return 4;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static void set_counter(lua_State *L, const char *name, uint64_t value) {
+    lua_pushstring(L, name);
+    lua_pushnumber(L, (lua_Number) value);
+    lua_settable(L, -3);
+}
+
+static int _stats(lua_State *L) {
+    mtar_ctx *ctx = check_mtar_ctx(L, 1);
+    mtar_stats_t stats;
+    /* The first call starts counting, unless the archive was opened with stats = true */
+    int result = mtar_stats(&ctx->mtar, &stats);
+    if (result == MTAR_EUNSUPPORTED) {
+        result = mtar_stats_enable(&ctx->mtar, NULL, NULL);
+        memset(&stats, 0, sizeof(stats));
+    }
+    if (result != MTAR_ESUCCESS) {
+        lua_pushnil(L);
+        lua_pushinteger(L, result);
+        lua_pushstring(L, mtar_strerror(result));
+        return 3;
+    }
+    lua_newtable(L);
+    set_counter(L, "bytes_read", stats.bytes_read);
+    set_counter(L, "bytes_written", stats.bytes_written);
+    set_counter(L, "reads", stats.reads);
+    set_counter(L, "writes", stats.writes);
+    set_counter(L, "seeks", stats.seeks);
+    set_counter(L, "headers", stats.headers);
+    set_counter(L, "checksum_failures", stats.checksum_failures);
+    set_counter(L, "read_ns", stats.read_ns);
+    set_counter(L, "write_ns", stats.write_ns);
+    set_counter(L, "seek_ns", stats.seek_ns);
+    return 1;
+}
+
 static int _gc(lua_State *L) {
     mtar_ctx *ctx = get_mtar_ctx(L, 1);
     if (ctx->initialized) {
@@ -337,16 +1170,36 @@ static const struct luaL_Reg microtarlib[] = {
         {"write_file_header", _write_file_header},
         {"write_dir_header",  _write_dir_header},
         {"write_data",        _write_data},
+        {"add_file",          _add_file},
+        {"add_tree",          _add_tree},
+        {"backup",            _backup},
+        {"commit",            _commit},
+        {"set_buffer",        _set_buffer},
         {"next",              _next},
         {"find",              _find},
+        {"extract_entry",     _extract_entry},
+        {"extract_data",      _extract_data},
         {"read_header",       _read_header},
         {"read_data",         _read_data},
+        {"entries",           _entries},
+        {"list",              _list},
+        {"find_prefix",       _find_prefix},
+        {"find_glob",         _find_glob},
+        {"verify",            _verify},
+        {"stats",             _stats},
         {"__gc",              _gc},
         {NULL, NULL}
 };
 
 static const struct luaL_Reg microtarlibctx[] = {
         {"open", _open},
+        {"open_mmap", _open_mmap},
+        {"open_stream", _open_stream},
+        {"open_string", _open_string},
+        {"compression", _compression},
+        {"extract", _extract},
+        {"create", _create},
+        {"walk", _walk},
         {NULL, NULL}
 };
 
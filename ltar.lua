@@ -34,6 +34,19 @@ local function mkdirp(p)
     return lfs.mkdir(p)
 end
 
+-- Member names must stay below the destination: no absolute paths, no ".."
+local function safe_name(name)
+    if name:sub(1, 1) == "/" then
+        return false
+    end
+    for part in name:gmatch("[^/]+") do
+        if part == ".." then
+            return false
+        end
+    end
+    return true
+end
+
 local function dirtree(dir)
     assert(dir and dir ~= "", "directory parameter is missing or empty")
     if string.sub(dir, -1) == "/" then
@@ -45,9 +58,12 @@ local function dirtree(dir)
             if entry ~= "." and entry ~= ".." then
                 entry = dir .. "/" .. entry
                 local attr = lfs.attributes(entry)
-                coroutine.yield(entry, attr)
-                if attr.mode == "directory" then
-                    yieldtree(entry)
+                -- Symlinks leading nowhere have no attributes, and are skipped
+                if attr then
+                    coroutine.yield(entry, attr)
+                    if attr.mode == "directory" then
+                        yieldtree(entry)
+                    end
                 end
             end
         end
@@ -58,15 +74,11 @@ local function dirtree(dir)
     end)
 end
 
-local function write_tarfile_chunks(handle, fd)
-    local size = 1024 * 512
-    while true do
-        local block = fd:read(size)
-        if not block then
-            break
-        end
-        handle:write_data(block, block:len())
+local function open_archive(where, mode, opts)
+    if io.type(where) == "file" then
+        return microtar.open_stream(where, mode)
     end
+    return microtar.open(where, mode, opts)
 end
 
 local function read_tarfile_chunks(handle, fd, total_size)
@@ -86,17 +98,20 @@ end
 
 --- Create empty tar file
 -- @function create
--- @param path where to put newly created tar file
+-- @param path where to put newly created tar file, or file handle to stream it to
+-- @param opts optional table, `compress` ("gzip" or "zstd") and `level` compress the file,
+-- `seekable` (true or a frame size in bytes) splits it into independently compressed frames,
+-- `checksum` ("crc32c", "sha256" or "both") records payload digests of uncompressed archives,
+-- `toc` (true) appends a table of contents that lets later lookups skip reading the headers,
+-- `dedup` (true) stores files whose content was already added as hard links to the first copy,
+-- `sparse` (true) stores only the data of files with holes,
+-- `pax` (true) also records sizes past 8 GiB in PAX headers, for readers that do not know base-256
 -- @return tar handle or nil
-function tar.create(path)
+function tar.create(path, opts)
     Handle = {
-        handle = microtar.open(path, "w"),
+        handle = open_archive(path, "w", opts),
         add_file = function(self, filename)
-            local size = lfs.attributes(filename, "size")
-            local fd = io.open(filename, "r")
-            self.handle:write_file_header(filename, size)
-            write_tarfile_chunks(self.handle, fd)
-            fd:close()
+            self.handle:add_file(filename)
         end,
         add_directory = function(self, path)
             self.handle:write_dir_header(path)
@@ -112,26 +127,42 @@ end
 -- @function iter_by_handle
 -- @param handle tar handle create by @{create}
 function tar.iter_by_handle(handle)
-    return function()
-        local f = handle:read_header()
-        if f then
-            handle:next()
-            return f
-        end
-    end
+    return handle:entries()
 end
 
 --- Iterate over contents of tar file
 -- @function iter_by_path
--- @param path path to tar file
+-- @param path path to tar file, or file handle to read it from
 function tar.iter_by_path(path)
-    local handle = microtar.open(path)
-    return function()
-        local f = handle:read_header()
-        if f then
-            handle:next()
-            return f
+    local handle = open_archive(path, "r")
+    return handle:entries()
+end
+
+-- The threaded writer lays out plain archives only
+local function use_parallel_create(where, opts)
+    return opts and (opts.threads or opts.queue_depth) and not opts.compress and not opts.checksum and not opts.toc
+        and not opts.dedup and not opts.sparse and type(where) == "string"
+end
+
+local function create_from_walk(path, where, walk_opts, opts)
+    walk_opts = walk_opts or { sorted = opts and opts.sorted }
+    if use_parallel_create(where, opts) then
+        local entries, _, err = microtar.walk(path, walk_opts)
+        if not entries then
+            error(err)
+        end
+        local ok
+        ok, _, err = microtar.create(where, entries, opts)
+        if not ok then
+            error(err)
         end
+        return
+    end
+    local handle = open_archive(where, "w", opts)
+    local ok, _, err = handle:add_tree(path, walk_opts)
+    handle:close()
+    if not ok then
+        error(err)
     end
 end
 
@@ -139,50 +170,191 @@ end
 -- @function create_from_path
 -- @param path directory 
 -- @param where where to save tar file 
-function tar.create_from_path(path, where)
-    tar.create_from_path_match(path, where, ".*")
+-- @param opts optional table, see @{create_from_path_glob}
+function tar.create_from_path(path, where, opts)
+    create_from_walk(path, where, nil, opts)
+end
+
+--- Pack contents of specified dir to tar file using a shell glob
+-- @function create_from_path_glob
+-- @param path directory
+-- @param where where to save tar file, or file handle to stream it to
+-- @param glob pattern matched against names inside the archive, e.g. "*.lua"
+-- @param opts optional table, see @{create_from_path_regex}; `sorted` stores entries in name order
+function tar.create_from_path_glob(path, where, glob, opts)
+    create_from_walk(path, where, { glob = glob, sorted = opts and opts.sorted }, opts)
 end
 
 --- Pack contents of specified dir to tar file using regex
 -- @function create_from_path_regex
 -- @param path directory 
--- @param where where to save tar file 
+-- @param where where to save tar file, or file handle to stream it to
 -- @param matcher regex expression
-function tar.create_from_path_regex(path, where, matcher)
-    local handle = microtar.open(where, "w")
+-- @param opts optional table, `threads` lays the archive out up front and fills payloads from that many threads,
+-- or `queue_depth` from that many io_uring transfers in flight (threads where io_uring is unavailable),
+-- `compress` ("gzip" or "zstd"), `level`, `seekable`, `checksum`, `toc`, `dedup` and `sparse` apply instead, see @{create}
+function tar.create_from_path_regex(path, where, matcher, opts)
+    if use_parallel_create(where, opts) then
+        local entries = {}
+        for filename, attr in dirtree(path) do
+            local name = strip_from_prefix(path, filename)
+            if name:match(matcher) then
+                if attr.mode == "directory" then
+                    entries[#entries + 1] = { name = name, type = microtar.TDIR }
+                elseif attr.mode == "file" then
+                    entries[#entries + 1] = { name = name, path = filename, size = attr.size, type = microtar.TREG }
+                end
+            end
+        end
+        local ok, _, err = microtar.create(where, entries, opts)
+        if not ok then
+            error(err)
+        end
+        return
+    end
+    local handle = open_archive(where, "w", opts)
     for filename, attr in dirtree(path) do
         local name = strip_from_prefix(path, filename)
         if name:match(matcher) then
             if attr.mode == "directory" then
                 handle:write_dir_header(name)
-            else
-                handle:write_file_header(name, attr.size)
-                local fd = io.open(filename, "r")
-                write_tarfile_chunks(handle, fd)
-                fd:close()
+            elseif attr.mode == "file" then
+                handle:add_file(filename, name)
             end
         end
     end
     handle:close()
 end
 
+--- List the entries of a tar file in one pass
+-- @function list
+-- @param path tar file, or file handle to read it from
+-- @param opts optional table, `fields` lists the header fields wanted ("name", "size", "mtime", "type",
+-- "mode", "linkname"; all by default), `filter` keeps only names starting with that prefix
+-- @return table mapping each field to an array of values, one per entry, and the number of entries
+function tar.list(path, opts)
+    local handle, code, err = open_archive(path, "r", opts)
+    if not handle then
+        return nil, code, err
+    end
+    local fields, count, list_err = handle:list(opts)
+    handle:close()
+    if not fields then
+        return nil, count, list_err
+    end
+    return fields, count
+end
+
+--- Check payload digests recorded in a tar file, without extracting it
+-- @function verify
+-- @param path tar file
+-- @return true, or nil, error code, message and the name of the first bad entry
+function tar.verify(path)
+    local handle, code, err = microtar.open(path)
+    if not handle then
+        return nil, code, err
+    end
+    local ok, vcode, verr, name = handle:verify()
+    handle:close()
+    return ok, vcode, verr, name
+end
+
 --- Unpack tar file to specified directory
 -- @function unpack
--- @param path directory 
--- @param where where to store unpacked files 
-function tar.unpack(path, where)
-    local handle = microtar.open(path)
-    local header = handle:read_header()
-    while header do
+-- @param path tar file, or file handle to read it from, e.g. io.stdin; compressed files are recognised
+-- @param where where to store unpacked files; members named outside it, absolute or through "..", raise an error
+-- @param opts optional table, `threads` sets the number of extraction threads, or of decompression
+-- threads for seekable compressed archives; `queue_depth` keeps that many io_uring transfers in flight
+-- when extracting plain archives, falling back to the threads where io_uring is unavailable
+function tar.unpack(path, where, opts)
+    if type(path) == "string" and not microtar.compression(path) then
+        local ok, _, err = microtar.extract(path, where, opts)
+        if not ok then
+            error(err)
+        end
+        return
+    end
+    local handle = open_archive(path, "r", opts)
+    for header in handle:entries() do
+        if not safe_name(header.name) or (header.type == microtar.TLNK and not safe_name(header.linkname)) then
+            handle:close()
+            error("unsafe member name: " .. header.name)
+        end
+        local target = where .. "/" .. header.name
+        -- Files may come before their directories, or without them
+        if header.type ~= microtar.TDIR and header.type ~= microtar.TDELETED then
+            mkdirp(basedir(target))
+        end
+        -- A new copy gets a file of its own, hard links made to the old one keep its data
+        if header.type == microtar.TREG then
+            os.remove(target)
+        end
         if header.type == microtar.TDIR then
-            mkdirp(where .. "/" .. header.name)
+            mkdirp(target)
+        elseif header.type == microtar.TREG and header.realsize then
+            local ok, _, err = handle:extract_data(target)
+            if not ok then
+                handle:close()
+                error(err)
+            end
         elseif header.type == microtar.TREG then
-            local fd = io.open(where .. "/" .. header.name, "w")
+            local fd = io.open(target, "w")
             read_tarfile_chunks(handle, fd, header.size)
             fd:close()
+        elseif header.type == microtar.TLNK then
+            os.remove(target)
+            lfs.link(where .. "/" .. header.linkname, target)
+        elseif header.type == microtar.TDELETED then
+            os.remove(target)
+        end
+    end
+    handle:close()
+end
+
+--- Unpack only the entries under a path, reading nothing else of the tar file
+-- @function unpack_subtree
+-- @param path tar file
+-- @param prefix names to unpack start with it, e.g. "lua/src/"
+-- @param where where to store unpacked files, under their full names
+-- @param opts optional table, `glob` (true) treats `prefix` as a shell pattern, e.g. "lua/*/*.o"
+function tar.unpack_subtree(path, prefix, where, opts)
+    local handle, _, err = microtar.open_mmap(path)
+    if not handle then
+        handle, _, err = microtar.open(path)
+    end
+    if not handle then
+        error(err)
+    end
+    local headers
+    if opts and opts.glob then
+        headers, _, err = handle:find_glob(prefix)
+    else
+        headers, _, err = handle:find_prefix(prefix)
+    end
+    if not headers then
+        handle:close()
+        error(err)
+    end
+    for _, header in ipairs(headers) do
+        if not safe_name(header.name) or (header.type == microtar.TLNK and not safe_name(header.linkname)) then
+            handle:close()
+            error("unsafe member name: " .. header.name)
+        end
+        local target = where .. "/" .. header.name
+        if header.type == microtar.TDIR then
+            mkdirp(target)
+        elseif header.type == microtar.TREG then
+            mkdirp(basedir(target))
+            local ok, _, extract_err = handle:extract_entry(header.name, target)
+            if not ok then
+                handle:close()
+                error(extract_err)
+            end
+        elseif header.type == microtar.TLNK then
+            mkdirp(basedir(target))
+            os.remove(target)
+            lfs.link(where .. "/" .. header.linkname, target)
         end
-        handle:next()
-        header = handle:read_header()
     end
     handle:close()
 end
@@ -193,17 +365,11 @@ end
 -- @param where location of already existing tar file 
 function tar.append(path, where)
     local handle = microtar.open(where, "a")
-    for filename, attr in dirtree(path) do
-        if attr.mode == "directory" then
-            handle:write_dir_header(filename)
-        else
-            handle:write_file_header(filename, attr.size)
-            local fd = io.open(filename, "r")
-            write_tarfile_chunks(handle, fd)
-            fd:close()
-        end
-    end
+    local ok, _, err = handle:add_tree(path, { keep_root = true })
     handle:close()
+    if not ok then
+        error(err)
+    end
 end
 
 --- Append file to already existing tar file
@@ -212,22 +378,76 @@ end
 -- @param where location of already existing tar file 
 function tar.append_file(path, where)
     local filename = get_filename(path)
-    local size = lfs.attributes(path, 'size')
     local handle = microtar.open(where, "a")
-    handle:write_file_header(filename, size)
-    local fd = io.open(path, "r")
-    write_tarfile_chunks(handle, fd)
-    fd:close()
+    handle:add_file(path, filename)
+    handle:close()
+end
+
+--- Append several files to already existing tar file, opening it once
+-- @function append_files
+-- @param list table of file paths, each stored under its file name
+-- @param where location of already existing tar file
+function tar.append_files(list, where)
+    local handle, _, err = microtar.open(where, "a")
+    if not handle then
+        error(err)
+    end
+    for _, path in ipairs(list) do
+        local ok, _, add_err = handle:add_file(path, get_filename(path))
+        if not ok then
+            handle:close()
+            error(add_err)
+        end
+    end
     handle:close()
 end
 
+--- Bring a tar file up to date with a directory, appending only what changed since the last backup
+-- @function backup
+-- @param path directory
+-- @param where location of the tar file, created on the first backup
+-- @param opts optional table, `hash` (true) also compares the CRC32C of files whose size and modification
+-- time are unchanged, `sorted` and `keep_root` as in @{create_from_path_glob} and @{append};
+-- files removed from the directory are recorded as deleted, and @{unpack} restores the latest state
+function tar.backup(path, where, opts)
+    local mode = lfs.attributes(where, "mode") == "file" and "a" or "w"
+    local handle, _, err = microtar.open(where, mode)
+    if not handle then
+        error(err)
+    end
+    local ok, _, backup_err = handle:backup(path, opts)
+    handle:close()
+    if not ok then
+        error(backup_err)
+    end
+end
+
+local function read_entry(handle, name)
+    local stats = handle:find(name)
+    if stats == nil then
+        return nil
+    end
+    if stats.size == 0 then
+        return ""
+    end
+    return handle:read_data(stats.size)
+end
+
+--- Read contents of file(s) stored in tar file
+-- @function find
+-- @param tar_path path to tar file
+-- @param what file name, or table of file names looked up in a single scan of the archive
+-- @return file contents or nil; for a table of names, table mapping each found name to its contents
 function tar.find(tar_path, what)
-    local handle = microtar.open(tar_path)
-    local stats = handle:find(what)
-    if stats ~= nil then
-        return handle:read_data()
+    local handle = microtar.open_mmap(tar_path) or microtar.open(tar_path)
+    if type(what) == "table" then
+        local found = {}
+        for _, name in ipairs(what) do
+            found[name] = read_entry(handle, name)
+        end
+        return found
     end
-    return nil
+    return read_entry(handle, what)
 end
 
 return tar
@@ -20,10 +20,47 @@
  * IN THE SOFTWARE.
  */
 
+#define _FILE_OFFSET_BITS 64
+/* For SEEK_DATA and SEEK_HOLE */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MTAR_HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
+#endif
+
+#if defined(MTAR_HAVE_MMAP) && defined(SEEK_HOLE)
+#define MTAR_HAVE_SPARSE
+#endif
+
+#ifdef __linux__
+#define MTAR_HAVE_KERNEL_COPY
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 
 #include "microtar.h"
 
@@ -41,68 +78,544 @@ typedef struct {
 } mtar_raw_header_t;
 
 
-static unsigned round_up(unsigned n, unsigned incr) {
+/* Largest value an 11 digit octal size field can hold, 8 GiB - 1 */
+#define OCTAL_SIZE_MAX 077777777777ULL
+
+/* Upper bound on extended header records we are willing to load */
+#define PAX_MAX_SIZE (1024 * 1024)
+
+/* Chunk size when file payloads have to be copied through user space */
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+/* Payload digests recorded in, and checked against, PAX headers */
+#define MTAR_FDIGESTS (MTAR_FCRC32C | MTAR_FSHA256)
+#define PAX_CRC32C_KEY "LTAR.crc32c"
+#define PAX_SHA256_KEY "LTAR.sha256"
+
+/* Names removed between incremental backups, one global header each */
+#define PAX_DELETED_KEY "LTAR.deleted"
+
+/* GNU sparse format 1.0: the records name the file, the data starts with
+ * a decimal map of "offset\nsize\n" pairs padded to a block */
+#define PAX_SPARSE_MAJOR_KEY "GNU.sparse.major"
+#define PAX_SPARSE_NAME_KEY "GNU.sparse.name"
+#define PAX_SPARSE_SIZE_KEY "GNU.sparse.realsize"
+
+/* Table of contents stored past the end-of-archive records, where tar
+ * readers stop looking. Fixed records, then names, then a footer that
+ * closes the last 512-byte block of the file */
+#define TOC_MAGIC "LTARTOC1"
+#define TOC_RECORD_SIZE 32
+#define TOC_FOOTER_SIZE 32
+
+typedef struct {
+    mtar_index_t index;
+    uint64_t tail;
+} toc_t;
+
+
+static uint64_t round_up(uint64_t n, unsigned incr) {
     return n + (incr - n % incr) % incr;
 }
 
 
 static unsigned checksum(const mtar_raw_header_t *rh) {
+    /* Sum of all header bytes with the checksum field itself counted as
+     * spaces: sum everything, then swap the field's bytes for 8 * ' ' */
     unsigned i;
-    unsigned char *p = (unsigned char *) rh;
-    unsigned res = 256;
-    for (i = 0; i < offsetof(mtar_raw_header_t, checksum); i++) {
-        res += p[i];
+    const unsigned char *p = (const unsigned char *) rh;
+    unsigned res = 8 * ' ';
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (i = 0; i < sizeof(*rh); i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, _mm256_setzero_si256()));
+    }
+    res += _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+           _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (i = 0; i < sizeof(*rh); i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
     }
-    for (i = offsetof(mtar_raw_header_t, type); i < sizeof(*rh); i++) {
+    res += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#else
+    for (i = 0; i < sizeof(*rh); i++) {
         res += p[i];
     }
+#endif
+    for (i = 0; i < sizeof(rh->checksum); i++) {
+        res -= (unsigned char) rh->checksum[i];
+    }
+    return res;
+}
+
+
+#if !(defined(__SSE4_2__) && defined(__x86_64__)) && !defined(__ARM_FEATURE_CRC32)
+static const uint32_t crc32c_table[256] = {
+    0x00000000u, 0xf26b8303u, 0xe13b70f7u, 0x1350f3f4u, 0xc79a971fu, 0x35f1141cu,
+    0x26a1e7e8u, 0xd4ca64ebu, 0x8ad958cfu, 0x78b2dbccu, 0x6be22838u, 0x9989ab3bu,
+    0x4d43cfd0u, 0xbf284cd3u, 0xac78bf27u, 0x5e133c24u, 0x105ec76fu, 0xe235446cu,
+    0xf165b798u, 0x030e349bu, 0xd7c45070u, 0x25afd373u, 0x36ff2087u, 0xc494a384u,
+    0x9a879fa0u, 0x68ec1ca3u, 0x7bbcef57u, 0x89d76c54u, 0x5d1d08bfu, 0xaf768bbcu,
+    0xbc267848u, 0x4e4dfb4bu, 0x20bd8edeu, 0xd2d60dddu, 0xc186fe29u, 0x33ed7d2au,
+    0xe72719c1u, 0x154c9ac2u, 0x061c6936u, 0xf477ea35u, 0xaa64d611u, 0x580f5512u,
+    0x4b5fa6e6u, 0xb93425e5u, 0x6dfe410eu, 0x9f95c20du, 0x8cc531f9u, 0x7eaeb2fau,
+    0x30e349b1u, 0xc288cab2u, 0xd1d83946u, 0x23b3ba45u, 0xf779deaeu, 0x05125dadu,
+    0x1642ae59u, 0xe4292d5au, 0xba3a117eu, 0x4851927du, 0x5b016189u, 0xa96ae28au,
+    0x7da08661u, 0x8fcb0562u, 0x9c9bf696u, 0x6ef07595u, 0x417b1dbcu, 0xb3109ebfu,
+    0xa0406d4bu, 0x522bee48u, 0x86e18aa3u, 0x748a09a0u, 0x67dafa54u, 0x95b17957u,
+    0xcba24573u, 0x39c9c670u, 0x2a993584u, 0xd8f2b687u, 0x0c38d26cu, 0xfe53516fu,
+    0xed03a29bu, 0x1f682198u, 0x5125dad3u, 0xa34e59d0u, 0xb01eaa24u, 0x42752927u,
+    0x96bf4dccu, 0x64d4cecfu, 0x77843d3bu, 0x85efbe38u, 0xdbfc821cu, 0x2997011fu,
+    0x3ac7f2ebu, 0xc8ac71e8u, 0x1c661503u, 0xee0d9600u, 0xfd5d65f4u, 0x0f36e6f7u,
+    0x61c69362u, 0x93ad1061u, 0x80fde395u, 0x72966096u, 0xa65c047du, 0x5437877eu,
+    0x4767748au, 0xb50cf789u, 0xeb1fcbadu, 0x197448aeu, 0x0a24bb5au, 0xf84f3859u,
+    0x2c855cb2u, 0xdeeedfb1u, 0xcdbe2c45u, 0x3fd5af46u, 0x7198540du, 0x83f3d70eu,
+    0x90a324fau, 0x62c8a7f9u, 0xb602c312u, 0x44694011u, 0x5739b3e5u, 0xa55230e6u,
+    0xfb410cc2u, 0x092a8fc1u, 0x1a7a7c35u, 0xe811ff36u, 0x3cdb9bddu, 0xceb018deu,
+    0xdde0eb2au, 0x2f8b6829u, 0x82f63b78u, 0x709db87bu, 0x63cd4b8fu, 0x91a6c88cu,
+    0x456cac67u, 0xb7072f64u, 0xa457dc90u, 0x563c5f93u, 0x082f63b7u, 0xfa44e0b4u,
+    0xe9141340u, 0x1b7f9043u, 0xcfb5f4a8u, 0x3dde77abu, 0x2e8e845fu, 0xdce5075cu,
+    0x92a8fc17u, 0x60c37f14u, 0x73938ce0u, 0x81f80fe3u, 0x55326b08u, 0xa759e80bu,
+    0xb4091bffu, 0x466298fcu, 0x1871a4d8u, 0xea1a27dbu, 0xf94ad42fu, 0x0b21572cu,
+    0xdfeb33c7u, 0x2d80b0c4u, 0x3ed04330u, 0xccbbc033u, 0xa24bb5a6u, 0x502036a5u,
+    0x4370c551u, 0xb11b4652u, 0x65d122b9u, 0x97baa1bau, 0x84ea524eu, 0x7681d14du,
+    0x2892ed69u, 0xdaf96e6au, 0xc9a99d9eu, 0x3bc21e9du, 0xef087a76u, 0x1d63f975u,
+    0x0e330a81u, 0xfc588982u, 0xb21572c9u, 0x407ef1cau, 0x532e023eu, 0xa145813du,
+    0x758fe5d6u, 0x87e466d5u, 0x94b49521u, 0x66df1622u, 0x38cc2a06u, 0xcaa7a905u,
+    0xd9f75af1u, 0x2b9cd9f2u, 0xff56bd19u, 0x0d3d3e1au, 0x1e6dcdeeu, 0xec064eedu,
+    0xc38d26c4u, 0x31e6a5c7u, 0x22b65633u, 0xd0ddd530u, 0x0417b1dbu, 0xf67c32d8u,
+    0xe52cc12cu, 0x1747422fu, 0x49547e0bu, 0xbb3ffd08u, 0xa86f0efcu, 0x5a048dffu,
+    0x8ecee914u, 0x7ca56a17u, 0x6ff599e3u, 0x9d9e1ae0u, 0xd3d3e1abu, 0x21b862a8u,
+    0x32e8915cu, 0xc083125fu, 0x144976b4u, 0xe622f5b7u, 0xf5720643u, 0x07198540u,
+    0x590ab964u, 0xab613a67u, 0xb831c993u, 0x4a5a4a90u, 0x9e902e7bu, 0x6cfbad78u,
+    0x7fab5e8cu, 0x8dc0dd8fu, 0xe330a81au, 0x115b2b19u, 0x020bd8edu, 0xf0605beeu,
+    0x24aa3f05u, 0xd6c1bc06u, 0xc5914ff2u, 0x37faccf1u, 0x69e9f0d5u, 0x9b8273d6u,
+    0x88d28022u, 0x7ab90321u, 0xae7367cau, 0x5c18e4c9u, 0x4f48173du, 0xbd23943eu,
+    0xf36e6f75u, 0x0105ec76u, 0x12551f82u, 0xe03e9c81u, 0x34f4f86au, 0xc69f7b69u,
+    0xd5cf889du, 0x27a40b9eu, 0x79b737bau, 0x8bdcb4b9u, 0x988c474du, 0x6ae7c44eu,
+    0xbe2da0a5u, 0x4c4623a6u, 0x5f16d052u, 0xad7d5351u
+};
+#endif
+
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    /* Castagnoli polynomial, 8 bytes per instruction where the CPU can */
+    const unsigned char *p = data;
+    crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t) _mm_crc32_u64(crc, v);
+    }
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    for (; len > 0; p++, len--) {
+        crc = __crc32cb(crc, *p);
+    }
+#else
+    for (; len > 0; p++, len--) {
+        crc = crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+#endif
+    return ~crc;
+}
+
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t len;
+    unsigned char block[64];
+    unsigned fill;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u, 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u,
+    0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u, 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u,
+    0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu, 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau,
+    0x983e5152u, 0xa831c66du, 0xb00327c8u, 0xbf597fc7u, 0xc6e00bf3u, 0xd5a79147u, 0x06ca6351u, 0x14292967u,
+    0x27b70a85u, 0x2e1b2138u, 0x4d2c6dfcu, 0x53380d13u, 0x650a7354u, 0x766a0abbu, 0x81c2c92eu, 0x92722c85u,
+    0xa2bfe8a1u, 0xa81a664bu, 0xc24b8b70u, 0xc76c51a3u, 0xd192e819u, 0xd6990624u, 0xf40e3585u, 0x106aa070u,
+    0x19a4c116u, 0x1e376c08u, 0x2748774cu, 0x34b0bcb5u, 0x391c0cb3u, 0x4ed8aa4au, 0x5b9cca4fu, 0x682e6ff3u,
+    0x748f82eeu, 0x78a5636fu, 0x84c87814u, 0x8cc70208u, 0x90befffau, 0xa4506cebu, 0xbef9a3f7u, 0xc67178f2u
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_t *s, const unsigned char *p) {
+    uint32_t w[64], a, b, c, d, e, f, g, h;
+    unsigned i;
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+               (uint32_t) p[4 * i + 2] << 8 | (uint32_t) p[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = s->state[0], b = s->state[1], c = s->state[2], d = s->state[3];
+    e = s->state[4], f = s->state[5], g = s->state[6], h = s->state[7];
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1;
+        d = c, c = b, b = a, a = t1 + t2;
+    }
+    s->state[0] += a, s->state[1] += b, s->state[2] += c, s->state[3] += d;
+    s->state[4] += e, s->state[5] += f, s->state[6] += g, s->state[7] += h;
+}
+
+static void sha256_init(sha256_t *s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667u, 0xbb67ae85u, 0x3c6ef372u, 0xa54ff53au, 0x510e527fu, 0x9b05688cu, 0x1f83d9abu, 0x5be0cd19u
+    };
+    memcpy(s->state, iv, sizeof(iv));
+    s->len = 0;
+    s->fill = 0;
+}
+
+static void sha256_update(sha256_t *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->len += len;
+    if (s->fill) {
+        size_t n = 64 - s->fill < len ? 64 - s->fill : len;
+        memcpy(s->block + s->fill, p, n);
+        s->fill += (unsigned) n;
+        p += n;
+        len -= n;
+        if (s->fill < 64) {
+            return;
+        }
+        sha256_block(s, s->block);
+        s->fill = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+        sha256_block(s, p);
+    }
+    memcpy(s->block, p, len);
+    s->fill = (unsigned) len;
+}
+
+static void sha256_final(sha256_t *s, unsigned char out[32]) {
+    uint64_t bits = s->len * 8;
+    unsigned i;
+    s->block[s->fill++] = 0x80;
+    if (s->fill > 56) {
+        memset(s->block + s->fill, 0, 64 - s->fill);
+        sha256_block(s, s->block);
+        s->fill = 0;
+    }
+    memset(s->block + s->fill, 0, 56 - s->fill);
+    for (i = 0; i < 8; i++) {
+        s->block[56 + i] = (unsigned char) (bits >> (56 - 8 * i));
+    }
+    sha256_block(s, s->block);
+    for (i = 0; i < 32; i++) {
+        out[i] = (unsigned char) (s->state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+static uint64_t parse_octal(const char *p, unsigned len) {
+    /* Fixed-width numeric field: optional leading spaces, octal digits,
+     * terminated by NUL, space or the end of the field. A set high bit
+     * marks the GNU base-256 form, a big-endian binary number */
+    unsigned i = 0;
+    uint64_t res = 0;
+    if ((unsigned char) p[0] & 0x80) {
+        res = (unsigned char) p[0] & 0x3f;
+        for (i = 1; i < len; i++) {
+            res = (res << 8) | (unsigned char) p[i];
+        }
+        return res;
+    }
+    while (i < len && p[i] == ' ') {
+        i++;
+    }
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; i++) {
+        res = (res << 3) | (unsigned) (p[i] - '0');
+    }
     return res;
 }
 
 
+static void format_octal(char *p, unsigned len, uint64_t value, unsigned digits) {
+    /* Writes at least `digits` octal digits, leaving room for the NUL
+     * terminator the field already holds */
+    unsigned n = 1;
+    uint64_t v = value;
+    while (v >>= 3) {
+        n++;
+    }
+    if (n < digits) {
+        n = digits;
+    }
+    if (n > len - 1) {
+        n = len - 1;
+    }
+    while (n--) {
+        p[n] = (char) ('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+
+static void format_base256(char *p, unsigned len, uint64_t value) {
+    /* GNU extension for values that do not fit the octal field */
+    unsigned i;
+    memset(p, 0, len);
+    for (i = len; i-- > 1 && value;) {
+        p[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+    p[0] = (char) 0x80;
+}
+
+
+static void copy_field(char *dst, const char *src, unsigned len) {
+    /* Header strings fill their field without a terminator when at full
+     * length; the destination holds one byte less than the field */
+    unsigned n = 0;
+    while (n < len - 1 && src[n]) {
+        n++;
+    }
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+
+static const char null_record[512];
+
+
+typedef struct {
+    mtar_stats_t counters;
+    int (*read)(mtar_t *tar, void *data, unsigned size);
+    int (*write)(mtar_t *tar, const void *data, unsigned size);
+    int (*seek)(mtar_t *tar, int64_t pos, int mode);
+    int (*view)(mtar_t *tar, const void **data, unsigned size);
+    mtar_trace_fn trace;
+    void *trace_arg;
+} stats_t;
+
+
+static uint64_t now_ns(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+#else
+    return (uint64_t) clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+
+static void stats_count(mtar_t *tar, int op, int64_t value, int err, uint64_t start) {
+    stats_t *s = tar->stats;
+    uint64_t ns;
+    if (!s) {
+        return;
+    }
+    ns = now_ns() - start;
+    switch (op) {
+        case MTAR_TRACE_READ:
+            s->counters.reads++;
+            s->counters.bytes_read += err ? 0 : (uint64_t) value;
+            s->counters.read_ns += ns;
+            break;
+        case MTAR_TRACE_WRITE:
+            s->counters.writes++;
+            s->counters.bytes_written += err ? 0 : (uint64_t) value;
+            s->counters.write_ns += ns;
+            break;
+        default:
+            s->counters.seeks++;
+            s->counters.seek_ns += ns;
+            break;
+    }
+    if (s->trace) {
+        s->trace(s->trace_arg, op, value, err, ns);
+    }
+}
+
+
+static void stats_failure(mtar_t *tar) {
+    stats_t *s = tar->stats;
+    if (s) {
+        s->counters.checksum_failures++;
+    }
+}
+
+
+/* Callbacks standing in for the backend's while statistics are kept */
+
+static int stats_read(mtar_t *tar, void *data, unsigned size) {
+    stats_t *s = tar->stats;
+    uint64_t start = now_ns();
+    int err = s->read(tar, data, size);
+    stats_count(tar, MTAR_TRACE_READ, size, err, start);
+    return err;
+}
+
+static int stats_view(mtar_t *tar, const void **data, unsigned size) {
+    stats_t *s = tar->stats;
+    uint64_t start = now_ns();
+    int err = s->view(tar, data, size);
+    stats_count(tar, MTAR_TRACE_READ, size, err, start);
+    return err;
+}
+
+static int stats_write(mtar_t *tar, const void *data, unsigned size) {
+    stats_t *s = tar->stats;
+    uint64_t start = now_ns();
+    int err = s->write(tar, data, size);
+    stats_count(tar, MTAR_TRACE_WRITE, size, err, start);
+    return err;
+}
+
+static int stats_seek(mtar_t *tar, int64_t pos, int mode) {
+    stats_t *s = tar->stats;
+    uint64_t start = now_ns();
+    int err = s->seek(tar, pos, mode);
+    stats_count(tar, MTAR_TRACE_SEEK, pos, err, start);
+    return err;
+}
+
+
+typedef int (*read_fn)(mtar_t *tar, void *data, unsigned size);
+typedef int (*write_fn)(mtar_t *tar, const void *data, unsigned size);
+
+static read_fn backend_read(const mtar_t *tar) {
+    /* The backend's own callback, seen through the statistics wrappers */
+    const stats_t *s = tar->stats;
+    return s ? s->read : tar->read;
+}
+
+static write_fn backend_write(const mtar_t *tar) {
+    const stats_t *s = tar->stats;
+    return s ? s->write : tar->write;
+}
+
+
+static int tflush(mtar_t *tar) {
+    int err;
+    if (tar->buffer_len == 0) {
+        return MTAR_ESUCCESS;
+    }
+    err = tar->write(tar, tar->buffer, tar->buffer_len);
+    tar->buffer_len = 0;
+    return err;
+}
+
+
 static int tread(mtar_t *tar, void *data, unsigned size) {
-    int err = tar->read(tar, data, size);
+    int err = tflush(tar);
+    if (err) {
+        return err;
+    }
+    err = tar->read(tar, data, size);
+    tar->pos += size;
+    return err;
+}
+
+
+static int tview(mtar_t *tar, const void **data, unsigned size) {
+    int err = tar->view(tar, data, size);
     tar->pos += size;
     return err;
 }
 
 
+static int buffered_write(mtar_t *tar, const char *data, unsigned size) {
+    int err;
+    unsigned n;
+    while (size > 0) {
+        /* Bypass the buffer for whole buffer-sized blocks when it is empty */
+        if (tar->buffer_len == 0 && size >= tar->buffer_size) {
+            n = size - size % tar->buffer_size;
+            err = tar->write(tar, data, n);
+            if (err) {
+                return err;
+            }
+        } else {
+            n = tar->buffer_size - tar->buffer_len;
+            if (n > size) {
+                n = size;
+            }
+            memcpy(tar->buffer + tar->buffer_len, data, n);
+            tar->buffer_len += n;
+            if (tar->buffer_len == tar->buffer_size) {
+                err = tflush(tar);
+                if (err) {
+                    return err;
+                }
+            }
+        }
+        data += n;
+        size -= n;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
 static int twrite(mtar_t *tar, const void *data, unsigned size) {
-    int err = tar->write(tar, data, size);
+    int err;
+    if (tar->buffer) {
+        err = buffered_write(tar, data, size);
+    } else {
+        err = tar->write(tar, data, size);
+    }
     tar->pos += size;
     return err;
 }
 
 
 static int write_null_bytes(mtar_t *tar, int n) {
-    int i, err;
-    char nul = '\0';
-    for (i = 0; i < n; i++) {
-        err = twrite(tar, &nul, 1);
+    int err, chunk;
+    while (n > 0) {
+        chunk = n < (int) sizeof(null_record) ? n : (int) sizeof(null_record);
+        err = twrite(tar, null_record, chunk);
         if (err) {
             return err;
         }
+        n -= chunk;
     }
     return MTAR_ESUCCESS;
 }
 
+static uint64_t toc_tail(const mtar_t *tar);
+static int toc_load(mtar_t *tar);
+static int toc_record(mtar_t *tar, const mtar_header_t *h, uint64_t offset);
+static int toc_write(mtar_t *tar);
+static void toc_free(mtar_t *tar);
+static void dedup_free(mtar_t *tar);
+
 static int check_final_segment(mtar_t *tar) {
-    int i, err;
-    char nul;
-    tar->seek(tar, -1024, SEEK_END);
-    for (i = 0; i < 1024; i++) {
-        err = tar->read(tar, &nul, 1);
-        if (err) {
-            return err;
-        }
-        if (nul != '\0') {
-            return MTAR_ENOTFOUND;
-        }
+    int err;
+    char trailer[1024];
+    /* The trailer sits right in front of a loaded table of contents */
+    tar->seek(tar, -(int64_t) (sizeof(trailer) + toc_tail(tar)), SEEK_END);
+    err = tar->read(tar, trailer, sizeof(trailer));
+    if (err) {
+        return err;
+    }
+    if (memcmp(trailer, null_record, sizeof(null_record)) != 0 ||
+        memcmp(trailer + sizeof(null_record), null_record, sizeof(null_record)) != 0) {
+        return MTAR_ENOTFOUND;
     }
     return MTAR_ESUCCESS;
 }
 
-static bool check_valid_header(mtar_t *tar) {
+static int check_valid_header(mtar_t *tar) {
     mtar_header_t h = {};
     return mtar_read_header(tar, &h);
 }
@@ -118,19 +631,19 @@ static int raw_to_header(mtar_header_t *h, const mtar_raw_header_t *rh) {
 
     /* Build and compare checksum */
     chksum1 = checksum(rh);
-    sscanf(rh->checksum, "%o", &chksum2);
+    chksum2 = (unsigned) parse_octal(rh->checksum, sizeof(rh->checksum));
     if (chksum1 != chksum2) {
         return MTAR_EBADCHKSUM;
     }
 
     /* Load raw header into header */
-    sscanf(rh->mode, "%o", &h->mode);
-    sscanf(rh->owner, "%o", &h->owner);
-    sscanf(rh->size, "%o", &h->size);
-    sscanf(rh->mtime, "%o", &h->mtime);
+    h->mode = (unsigned) parse_octal(rh->mode, sizeof(rh->mode));
+    h->owner = (unsigned) parse_octal(rh->owner, sizeof(rh->owner));
+    h->size = parse_octal(rh->size, sizeof(rh->size));
+    h->mtime = (unsigned) parse_octal(rh->mtime, sizeof(rh->mtime));
     h->type = rh->type;
-    strcpy(h->name, rh->name);
-    strcpy(h->linkname, rh->linkname);
+    copy_field(h->name, rh->name, sizeof(rh->name));
+    copy_field(h->linkname, rh->linkname, sizeof(rh->linkname));
 
     return MTAR_ESUCCESS;
 }
@@ -141,23 +654,226 @@ static int header_to_raw(mtar_raw_header_t *rh, const mtar_header_t *h) {
 
     /* Load header into raw header */
     memset(rh, 0, sizeof(*rh));
-    sprintf(rh->mode, "%o", h->mode);
-    sprintf(rh->owner, "%o", h->owner);
-    sprintf(rh->size, "%o", h->size);
-    sprintf(rh->mtime, "%o", h->mtime);
+    format_octal(rh->mode, sizeof(rh->mode), h->mode, 1);
+    format_octal(rh->owner, sizeof(rh->owner), h->owner, 1);
+    if (h->size > OCTAL_SIZE_MAX) {
+        format_base256(rh->size, sizeof(rh->size), h->size);
+    } else {
+        format_octal(rh->size, sizeof(rh->size), h->size, 1);
+    }
+    format_octal(rh->mtime, sizeof(rh->mtime), h->mtime, 1);
     rh->type = h->type ? h->type : MTAR_TREG;
     strcpy(rh->name, h->name);
     strcpy(rh->linkname, h->linkname);
+    /* GNU tar only honours sparse records on headers with the ustar magic */
+    if (h->sparse) {
+        memcpy(rh->_padding, "ustar\0" "00", 8);
+    }
 
     /* Calculate and write checksum */
     chksum = checksum(rh);
-    sprintf(rh->checksum, "%06o", chksum);
+    format_octal(rh->checksum, sizeof(rh->checksum), chksum, 6);
     rh->checksum[7] = ' ';
 
     return MTAR_ESUCCESS;
 }
 
 
+typedef struct {
+    bool has_size;
+    uint64_t size;
+    bool has_path;
+    char path[100];
+    bool has_linkpath;
+    char linkpath[100];
+    unsigned digests;
+    uint32_t crc32c;
+    unsigned char sha256[32];
+    bool has_deleted;
+    char deleted[100];
+    unsigned sparse_major;
+    bool has_sparse_name;
+    char sparse_name[100];
+    uint64_t sparse_size;
+} pax_t;
+
+
+static bool parse_hex(unsigned char *out, const char *p, size_t bytes, const char *end) {
+    size_t i;
+    if ((size_t) (end - p) != bytes * 2) {
+        return false;
+    }
+    for (i = 0; i < bytes * 2; i++) {
+        char ch = p[i];
+        unsigned v = (ch >= '0' && ch <= '9') ? (unsigned) (ch - '0') :
+                     (ch >= 'a' && ch <= 'f') ? (unsigned) (ch - 'a' + 10) :
+                     (ch >= 'A' && ch <= 'F') ? (unsigned) (ch - 'A' + 10) : 16;
+        if (v > 15) {
+            return false;
+        }
+        out[i / 2] = (unsigned char) ((i % 2) ? (out[i / 2] | v) : (v << 4));
+    }
+    return true;
+}
+
+
+static uint64_t parse_decimal(const char *p, const char *end) {
+    uint64_t n = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        n = n * 10 + (uint64_t) (*p - '0');
+    }
+    return n;
+}
+
+
+static void parse_pax(pax_t *pax, const char *data, size_t len) {
+    /* Records look like "<len> <key>=<value>\n", <len> counting the
+     * whole record including itself */
+    size_t pos = 0;
+    while (pos < len) {
+        size_t rec_len = 0, i = pos;
+        const char *key, *value, *end;
+        while (i < len && data[i] >= '0' && data[i] <= '9') {
+            rec_len = rec_len * 10 + (size_t) (data[i++] - '0');
+        }
+        /* The shortest record is "<len> =\n" */
+        if (i >= len || data[i] != ' ' || rec_len < i - pos + 3 || rec_len > len - pos) {
+            return;
+        }
+        key = data + i + 1;
+        end = data + pos + rec_len - 1;
+        value = memchr(key, '=', (size_t) (end - key));
+        if (!value || *end != '\n') {
+            return;
+        }
+        value++;
+        if (!strncmp(key, "size=", 5)) {
+            pax->has_size = true;
+            pax->size = parse_decimal(value, end);
+        } else if (!strncmp(key, "path=", 5) && (size_t) (end - value) < sizeof(pax->path)) {
+            pax->has_path = true;
+            memcpy(pax->path, value, (size_t) (end - value));
+            pax->path[end - value] = '\0';
+        } else if (!strncmp(key, "linkpath=", 9) && (size_t) (end - value) < sizeof(pax->linkpath)) {
+            pax->has_linkpath = true;
+            memcpy(pax->linkpath, value, (size_t) (end - value));
+            pax->linkpath[end - value] = '\0';
+        } else if (!strncmp(key, PAX_CRC32C_KEY "=", sizeof(PAX_CRC32C_KEY))) {
+            unsigned char crc[4];
+            if (parse_hex(crc, value, sizeof(crc), end)) {
+                pax->digests |= MTAR_FCRC32C;
+                pax->crc32c = (uint32_t) crc[0] << 24 | (uint32_t) crc[1] << 16 | (uint32_t) crc[2] << 8 | crc[3];
+            }
+        } else if (!strncmp(key, PAX_SHA256_KEY "=", sizeof(PAX_SHA256_KEY))) {
+            if (parse_hex(pax->sha256, value, sizeof(pax->sha256), end)) {
+                pax->digests |= MTAR_FSHA256;
+            }
+        } else if (!strncmp(key, PAX_DELETED_KEY "=", sizeof(PAX_DELETED_KEY)) &&
+                   (size_t) (end - value) < sizeof(pax->deleted) && end > value) {
+            pax->has_deleted = true;
+            memcpy(pax->deleted, value, (size_t) (end - value));
+            pax->deleted[end - value] = '\0';
+        } else if (!strncmp(key, PAX_SPARSE_MAJOR_KEY "=", sizeof(PAX_SPARSE_MAJOR_KEY))) {
+            pax->sparse_major = (unsigned) parse_decimal(value, end);
+        } else if (!strncmp(key, PAX_SPARSE_NAME_KEY "=", sizeof(PAX_SPARSE_NAME_KEY)) &&
+                   (size_t) (end - value) < sizeof(pax->sparse_name)) {
+            pax->has_sparse_name = true;
+            memcpy(pax->sparse_name, value, (size_t) (end - value));
+            pax->sparse_name[end - value] = '\0';
+        } else if (!strncmp(key, PAX_SPARSE_SIZE_KEY "=", sizeof(PAX_SPARSE_SIZE_KEY))) {
+            pax->sparse_size = parse_decimal(value, end);
+        }
+        pos += rec_len;
+    }
+}
+
+
+static void apply_pax(mtar_header_t *h, const pax_t *pax) {
+    if (pax->has_size) {
+        h->size = pax->size;
+    }
+    if (pax->has_path) {
+        strcpy(h->name, pax->path);
+    }
+    if (pax->has_linkpath) {
+        strcpy(h->linkname, pax->linkpath);
+    }
+    /* Only format 1.0 keeps the map in the data, older ones are left as
+     * they are stored */
+    h->sparse = pax->sparse_major == 1 && pax->has_sparse_name;
+    h->realsize = h->sparse ? pax->sparse_size : 0;
+    if (h->sparse) {
+        strcpy(h->name, pax->sparse_name);
+    }
+    h->digests = pax->digests;
+    h->crc32c = pax->crc32c;
+    memcpy(h->sha256, pax->sha256, sizeof(h->sha256));
+}
+
+
+static void deleted_header(mtar_header_t *h, const pax_t *global) {
+    memset(h, 0, sizeof(*h));
+    strcpy(h->name, global->deleted);
+    h->type = MTAR_TDELETED;
+}
+
+
+int mtar_decode_headers(const void *data, size_t size, mtar_header_t *h, uint64_t *offsets,
+                        unsigned max, unsigned *count) {
+    int err = MTAR_ESUCCESS;
+    unsigned n = 0;
+    uint64_t pos = 0;
+    const char *p = data;
+    uint64_t start = 0;
+    pax_t pax, global;
+    memset(&pax, 0, sizeof(pax));
+    /* Walk an in-memory archive image, jumping from header to header */
+    while (n < max && size - pos >= sizeof(mtar_raw_header_t)) {
+        err = raw_to_header(&h[n], (const mtar_raw_header_t *) (p + pos));
+        if (err) {
+            break;
+        }
+        pos += sizeof(mtar_raw_header_t);
+        if (h[n].type == MTAR_TPAX || h[n].type == MTAR_TPAXG) {
+            /* Extended header, applies to the entry that follows; global
+             * ones only matter when they record a deletion */
+            memset(&global, 0, sizeof(global));
+            if (h[n].size <= size - pos) {
+                parse_pax(h[n].type == MTAR_TPAX ? &pax : &global, p + pos, (size_t) h[n].size);
+            }
+            pos += round_up(h[n].size, 512);
+            if (pos > size) {
+                break;
+            }
+            if (!global.has_deleted) {
+                continue;
+            }
+            deleted_header(&h[n], &global);
+            memset(&pax, 0, sizeof(pax));
+            if (offsets) {
+                offsets[n] = start;
+            }
+            start = pos;
+            n++;
+            continue;
+        }
+        apply_pax(&h[n], &pax);
+        memset(&pax, 0, sizeof(pax));
+        if (offsets) {
+            offsets[n] = start;
+        }
+        pos += round_up(h[n].size, 512);
+        start = pos;
+        n++;
+        if (pos > size) {
+            break;
+        }
+    }
+    *count = n;
+    return err;
+}
+
+
 const char *mtar_strerror(int err) {
     switch (err) {
         case MTAR_ESUCCESS     :
@@ -178,6 +894,10 @@ const char *mtar_strerror(int err) {
             return "null record";
         case MTAR_ENOTFOUND    :
             return "file not found";
+        case MTAR_EUNSUPPORTED :
+            return "operation not supported";
+        case MTAR_EBADNAME     :
+            return "unsafe member name";
     }
     return "unknown error";
 }
@@ -193,13 +913,21 @@ static int file_read(mtar_t *tar, void *data, unsigned size) {
     return (res == size) ? MTAR_ESUCCESS : MTAR_EREADFAIL;
 }
 
-static int file_seek(mtar_t *tar, long offset, int mode) {
-    int res = fseek(tar->stream, offset, mode);
+static int file_seek(mtar_t *tar, int64_t offset, int mode) {
+#ifdef MTAR_HAVE_MMAP
+    int res = fseeko(tar->stream, offset, mode);
+#else
+    int res = fseek(tar->stream, (long) offset, mode);
+#endif
     return (res == 0) ? MTAR_ESUCCESS : MTAR_ESEEKFAIL;
 }
 
-static long file_tell(mtar_t *tar) {
+static int64_t file_tell(mtar_t *tar) {
+#ifdef MTAR_HAVE_MMAP
+    return ftello(tar->stream);
+#else
     return ftell(tar->stream);
+#endif
 }
 
 static int file_close(mtar_t *tar) {
@@ -208,6 +936,114 @@ static int file_close(mtar_t *tar) {
 }
 
 
+static int stream_seek(mtar_t *tar, int64_t offset, int mode) {
+    (void) tar;
+    (void) offset;
+    (void) mode;
+    return MTAR_ESEEKFAIL;
+}
+
+static int64_t stream_tell(mtar_t *tar) {
+    (void) tar;
+    return -1;
+}
+
+static int stream_close(mtar_t *tar) {
+    /* The stream belongs to the caller, only push out what we wrote */
+    return fflush(tar->stream) == 0 ? MTAR_ESUCCESS : MTAR_EWRITEFAIL;
+}
+
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t pos;
+    size_t capacity;    /* 0 for read-only buffers we do not own */
+} mem_stream_t;
+
+static int mem_write(mtar_t *tar, const void *data, unsigned size) {
+    mem_stream_t *mem = tar->stream;
+    if (mem->capacity == 0) {
+        return MTAR_EWRITEFAIL;
+    }
+    if (size > mem->capacity - mem->pos) {
+        size_t capacity = mem->capacity;
+        char *p;
+        while (size > capacity - mem->pos) {
+            if (capacity > SIZE_MAX / 2) {
+                return MTAR_EWRITEFAIL;
+            }
+            capacity *= 2;
+        }
+        p = realloc(mem->data, capacity);
+        if (!p) {
+            return MTAR_EWRITEFAIL;
+        }
+        mem->data = p;
+        mem->capacity = capacity;
+    }
+    memcpy(mem->data + mem->pos, data, size);
+    mem->pos += size;
+    if (mem->pos > mem->size) {
+        mem->size = mem->pos;
+    }
+    return MTAR_ESUCCESS;
+}
+
+static int mem_read(mtar_t *tar, void *data, unsigned size) {
+    mem_stream_t *mem = tar->stream;
+    if (size > mem->size - mem->pos) {
+        return MTAR_EREADFAIL;
+    }
+    memcpy(data, mem->data + mem->pos, size);
+    mem->pos += size;
+    return MTAR_ESUCCESS;
+}
+
+static int mem_view(mtar_t *tar, const void **data, unsigned size) {
+    mem_stream_t *mem = tar->stream;
+    if (size > mem->size - mem->pos) {
+        return MTAR_EREADFAIL;
+    }
+    *data = mem->data + mem->pos;
+    mem->pos += size;
+    return MTAR_ESUCCESS;
+}
+
+static int mem_seek(mtar_t *tar, int64_t offset, int mode) {
+    mem_stream_t *mem = tar->stream;
+    int64_t base = (mode == SEEK_SET) ? 0 : (mode == SEEK_CUR) ? (int64_t) mem->pos : (int64_t) mem->size;
+    if (base + offset < 0 || base + offset > (int64_t) mem->size) {
+        return MTAR_ESEEKFAIL;
+    }
+    mem->pos = base + offset;
+    return MTAR_ESUCCESS;
+}
+
+static int64_t mem_tell(mtar_t *tar) {
+    mem_stream_t *mem = tar->stream;
+    return mem->pos;
+}
+
+static int mem_close(mtar_t *tar) {
+    mem_stream_t *mem = tar->stream;
+    if (mem->capacity) {
+        free(mem->data);
+    }
+    free(mem);
+    return MTAR_ESUCCESS;
+}
+
+#ifdef MTAR_HAVE_MMAP
+static int mmap_close(mtar_t *tar) {
+    mem_stream_t *mem = tar->stream;
+    munmap(mem->data, mem->size);
+    free(mem);
+    return MTAR_ESUCCESS;
+}
+#endif
+
+
 int mtar_open(mtar_t *tar, const char *filename, const char *mode) {
     int err = MTAR_ESUCCESS;
 
@@ -219,37 +1055,50 @@ int mtar_open(mtar_t *tar, const char *filename, const char *mode) {
     tar->tell = file_tell;
 
     if ((*mode == 'a') || (*mode == 'r')) {
-        tar->stream = fopen(filename, "rb");
+        /* Appends validate and update the same open file */
+        tar->stream = fopen(filename, *mode == 'a' ? "rb+" : "rb");
         if (!tar->stream) {
             return MTAR_EOPENFAIL;
         }
         err = check_valid_header(tar);
+        /* An archive holding nothing but its trailer can still be appended to */
+        if (err == MTAR_ENULLRECORD && *mode == 'a') {
+            err = MTAR_ESUCCESS;
+        }
+        if (err != MTAR_ESUCCESS) {
+            goto error;
+        }
+        err = toc_load(tar);
         if (err != MTAR_ESUCCESS) {
             goto error;
         }
         err = check_final_segment(tar);
-        if (err == MTAR_ENOTFOUND) {
-            tar->close(tar);
-            char n_mode[2] = {*mode, 'b'};
-            tar->stream = fopen(filename, n_mode);
+        if (err == MTAR_ESUCCESS && *mode == 'a') {
+            /* Overwrite the trailer and table of contents */
+            err = tar->seek(tar, -(int64_t) (1024 + toc_tail(tar)), SEEK_END);
+        } else if (err == MTAR_ENOTFOUND) {
+            /* Unterminated archives are read from the start, or appended
+             * to after whatever they hold */
+            err = tar->seek(tar, 0, *mode == 'a' ? SEEK_END : SEEK_SET);
         } else if (err == MTAR_ESUCCESS) {
-            if (*mode == 'a') {
-                tar->close(tar);
-                tar->stream = fopen(filename, "rb+");
-                tar->seek(tar, -1024, SEEK_END);
-                tar->pos = tar->tell(tar);
-            } else {
-                tar->seek(tar, 0, SEEK_SET);
-            }
-        } else {
+            err = tar->seek(tar, 0, SEEK_SET);
+        }
+        if (err != MTAR_ESUCCESS) {
             goto error;
         }
+        tar->pos = tar->tell(tar);
+        tar->last_header = 0;
     } else {
         tar->stream = fopen(filename, "wb");
         if (!tar->stream) {
-            goto error;
+            return MTAR_EOPENFAIL;
         }
     }
+    /* Coalesce headers, data and padding of writable archives. Running
+     * unbuffered is still correct, just slower, if the allocation fails */
+    if (*mode != 'r') {
+        mtar_set_buffer(tar, MTAR_DEFAULT_BUFFER_SIZE);
+    }
     return MTAR_ESUCCESS;
 
     error:
@@ -260,13 +1109,250 @@ int mtar_open(mtar_t *tar, const char *filename, const char *mode) {
 }
 
 
-int mtar_close(mtar_t *tar) {
-    return tar->close(tar);
+int mtar_open_mmap(mtar_t *tar, const char *filename) {
+#ifdef MTAR_HAVE_MMAP
+    int err, fd;
+    struct stat st;
+    mem_stream_t *mem;
+
+    memset(tar, 0, sizeof(*tar));
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return MTAR_EOPENFAIL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return MTAR_EOPENFAIL;
+    }
+    mem = calloc(1, sizeof(*mem));
+    if (!mem) {
+        close(fd);
+        return MTAR_EOPENFAIL;
+    }
+    if ((uint64_t) st.st_size > SIZE_MAX) {
+        free(mem);
+        close(fd);
+        return MTAR_EOPENFAIL;
+    }
+    mem->size = (size_t) st.st_size;
+    mem->data = mmap(NULL, mem->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* The mapping stays valid after the descriptor is closed */
+    close(fd);
+    if (mem->data == MAP_FAILED) {
+        free(mem);
+        return MTAR_EOPENFAIL;
+    }
+
+    tar->write = mem_write;
+    tar->read = mem_read;
+    tar->view = mem_view;
+    tar->seek = mem_seek;
+    tar->tell = mem_tell;
+    tar->close = mmap_close;
+    tar->stream = mem;
+
+    err = check_valid_header(tar);
+    if (err != MTAR_ESUCCESS) {
+        mtar_close(tar);
+        return err;
+    }
+    err = toc_load(tar);
+    if (err != MTAR_ESUCCESS) {
+        mtar_close(tar);
+        return err;
+    }
+    /* A missing trailer is tolerated, as in mtar_open() */
+    err = check_final_segment(tar);
+    if (err != MTAR_ESUCCESS && err != MTAR_ENOTFOUND) {
+        mtar_close(tar);
+        return err;
+    }
+    return mtar_seek(tar, 0);
+#else
+    return MTAR_EUNSUPPORTED;
+#endif
+}
+
+
+int mtar_open_mem(mtar_t *tar, const void *data, size_t size, const char *mode) {
+    int err;
+    mtar_header_t h;
+    mem_stream_t *mem;
+
+    memset(tar, 0, sizeof(*tar));
+    mem = calloc(1, sizeof(*mem));
+    if (!mem) {
+        return MTAR_EOPENFAIL;
+    }
+    tar->write = mem_write;
+    tar->read = mem_read;
+    tar->view = mem_view;
+    tar->seek = mem_seek;
+    tar->tell = mem_tell;
+    tar->close = mem_close;
+    tar->stream = mem;
+
+    if (*mode == 'r') {
+        /* Read straight out of the caller's buffer, which must outlive tar */
+        mem->data = (char *) data;
+        mem->size = size;
+    } else {
+        /* Writers own a growable copy, appends start from the given data */
+        mem->size = (*mode == 'a') ? size : 0;
+        mem->capacity = MTAR_DEFAULT_BUFFER_SIZE;
+        while (mem->capacity < mem->size) {
+            mem->capacity *= 2;
+        }
+        mem->data = malloc(mem->capacity);
+        if (!mem->data) {
+            free(mem);
+            return MTAR_EOPENFAIL;
+        }
+        if (mem->size) {
+            memcpy(mem->data, data, mem->size);
+        }
+    }
+    if (*mode == 'w') {
+        return MTAR_ESUCCESS;
+    }
+
+    err = mtar_read_header(tar, &h);
+    if (err == MTAR_ESUCCESS) {
+        err = toc_load(tar);
+    }
+    if (err != MTAR_ESUCCESS) {
+        mtar_close(tar);
+        return err;
+    }
+    err = check_final_segment(tar);
+    if (err != MTAR_ESUCCESS && err != MTAR_ENOTFOUND) {
+        mtar_close(tar);
+        return err;
+    }
+    if (*mode == 'a') {
+        /* Overwrite the trailer and table of contents, or carry on after an
+         * unterminated archive */
+        return mtar_seek(tar, err == MTAR_ESUCCESS ? mem->size - 1024 - toc_tail(tar) : mem->size);
+    }
+    return mtar_seek(tar, 0);
+}
+
+
+int mtar_mem_data(mtar_t *tar, const void **data, size_t *size) {
+    mem_stream_t *mem;
+    int err;
+    if (tar->close != mem_close) {
+        return MTAR_EUNSUPPORTED;
+    }
+    err = tflush(tar);
+    if (err) {
+        return err;
+    }
+    mem = tar->stream;
+    *data = mem->data;
+    *size = mem->size;
+    return MTAR_ESUCCESS;
+}
+
+
+int mtar_open_stream(mtar_t *tar, FILE *stream, const char *mode) {
+    memset(tar, 0, sizeof(*tar));
+    tar->write = file_write;
+    tar->read = file_read;
+    tar->seek = stream_seek;
+    tar->close = stream_close;
+    tar->tell = stream_tell;
+    tar->stream = stream;
+    /* Forward-only: no trailer check up front, data is skipped by reading
+     * through it and the end of the archive is found by the cursor */
+    tar->flags = MTAR_FSTREAM;
+    if (*mode != 'r') {
+        mtar_set_buffer(tar, MTAR_DEFAULT_BUFFER_SIZE);
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+int mtar_close(mtar_t *tar) {
+    int err = tflush(tar);
+    int close_err = tar->close(tar);
+    free(tar->buffer);
+    tar->buffer = NULL;
+    tar->buffer_size = 0;
+    free(tar->digest);
+    tar->digest = NULL;
+    toc_free(tar);
+    free(tar->stats);
+    tar->stats = NULL;
+    dedup_free(tar);
+    return err ? err : close_err;
+}
+
+
+int mtar_set_buffer(mtar_t *tar, unsigned size) {
+    int err;
+    char *buffer = NULL;
+    /* Keep the buffer a whole number of records */
+    size = round_up(size, 512);
+    if (size > 0) {
+        buffer = malloc(size);
+        if (!buffer) {
+            return MTAR_EFAILURE;
+        }
+    }
+    err = tflush(tar);
+    free(tar->buffer);
+    tar->buffer = buffer;
+    tar->buffer_size = size;
+    return err;
+}
+
+
+int mtar_flush(mtar_t *tar) {
+    return tflush(tar);
+}
+
+
+int mtar_stats_enable(mtar_t *tar, mtar_trace_fn trace, void *arg) {
+    stats_t *s = tar->stats;
+    if (!s) {
+        s = calloc(1, sizeof(*s));
+        if (!s) {
+            return MTAR_EFAILURE;
+        }
+        /* Route the backend's callbacks through the counting ones */
+        s->read = tar->read;
+        s->write = tar->write;
+        s->seek = tar->seek;
+        s->view = tar->view;
+        tar->read = stats_read;
+        tar->write = stats_write;
+        tar->seek = stats_seek;
+        tar->view = tar->view ? stats_view : NULL;
+        tar->stats = s;
+    }
+    s->trace = trace;
+    s->trace_arg = arg;
+    return MTAR_ESUCCESS;
+}
+
+
+int mtar_stats(const mtar_t *tar, mtar_stats_t *stats) {
+    const stats_t *s = tar->stats;
+    if (!s) {
+        return MTAR_EUNSUPPORTED;
+    }
+    *stats = s->counters;
+    return MTAR_ESUCCESS;
 }
 
 
-int mtar_seek(mtar_t *tar, unsigned pos) {
-    int err = tar->seek(tar, pos, SEEK_SET);
+int mtar_seek(mtar_t *tar, uint64_t pos) {
+    int err = tflush(tar);
+    if (err) {
+        return err;
+    }
+    err = tar->seek(tar, pos, SEEK_SET);
     tar->pos = pos;
     return err;
 }
@@ -279,143 +1365,590 @@ int mtar_rewind(mtar_t *tar) {
 }
 
 
+static int skip_forward(mtar_t *tar, uint64_t n);
+
+
+static int read_pax(mtar_t *tar, const mtar_header_t *h, pax_t *pax) {
+    int err;
+    char *data;
+    /* Oversized records are stepped over */
+    if (h->size > PAX_MAX_SIZE) {
+        return skip_forward(tar, round_up(h->size, 512));
+    }
+    data = malloc(h->size ? (size_t) h->size : 1);
+    if (!data) {
+        return MTAR_EFAILURE;
+    }
+    err = tread(tar, data, (unsigned) h->size);
+    if (!err) {
+        parse_pax(pax, data, (size_t) h->size);
+        err = skip_forward(tar, round_up(h->size, 512) - h->size);
+    }
+    free(data);
+    return err;
+}
+
+
+static int read_entry_header(mtar_t *tar, mtar_header_t *h) {
+    int err;
+    pax_t pax, global;
+    mtar_raw_header_t rh;
+    /* Reads the entry's header, and any extended headers in front of it,
+     * leaving the archive at the start of the entry's data */
+    memset(&pax, 0, sizeof(pax));
+    for (;;) {
+        err = tread(tar, &rh, sizeof(rh));
+        if (err) {
+            return err;
+        }
+        err = raw_to_header(h, &rh);
+        if (err) {
+            if (err == MTAR_EBADCHKSUM) {
+                stats_failure(tar);
+            }
+            return err;
+        }
+        if (h->type != MTAR_TPAX && h->type != MTAR_TPAXG) {
+            break;
+        }
+        memset(&global, 0, sizeof(global));
+        err = read_pax(tar, h, h->type == MTAR_TPAX ? &pax : &global);
+        if (err) {
+            return err;
+        }
+        /* A recorded deletion stands as an entry of its own, without data */
+        if (global.has_deleted) {
+            deleted_header(h, &global);
+            memset(&pax, 0, sizeof(pax));
+            break;
+        }
+    }
+    apply_pax(h, &pax);
+    if (tar->stats) {
+        ((stats_t *) tar->stats)->counters.headers++;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static unsigned format_pax_record(char *out, unsigned size, const char *key, const char *value) {
+    /* The length prefix of a record counts its own digits */
+    unsigned n = (unsigned) (strlen(key) + strlen(value)) + 3;
+    unsigned len = n + 1;
+    while ((unsigned) snprintf(NULL, 0, "%u", len) + n != len) {
+        len++;
+    }
+    snprintf(out, size, "%u %s=%s\n", len, key, value);
+    return len;
+}
+
+
+static int write_pax_records(mtar_t *tar, unsigned type, const char *records, unsigned len) {
+    int err;
+    mtar_header_t ph;
+    mtar_raw_header_t rh;
+    memset(&ph, 0, sizeof(ph));
+    strcpy(ph.name, "././@PaxHeader");
+    ph.mode = 0644;
+    ph.size = len;
+    ph.type = type;
+    header_to_raw(&rh, &ph);
+    err = twrite(tar, &rh, sizeof(rh));
+    if (err) {
+        return err;
+    }
+    err = twrite(tar, records, len);
+    if (err) {
+        return err;
+    }
+    return write_null_bytes(tar, (int) (round_up(len, 512) - len));
+}
+
+
+static int write_pax(mtar_t *tar, const mtar_header_t *h) {
+    char value[24], record[64];
+    unsigned len;
+    /* A single "size" record */
+    snprintf(value, sizeof(value), "%llu", (unsigned long long) h->size);
+    len = format_pax_record(record, sizeof(record), "size", value);
+    return write_pax_records(tar, MTAR_TPAX, record, len);
+}
+
+
+static int write_deletion(mtar_t *tar, const char *name) {
+    int err;
+    char record[160];
+    uint64_t offset = tar->pos;
+    mtar_header_t h;
+    unsigned len = format_pax_record(record, sizeof(record), PAX_DELETED_KEY, name);
+    err = write_pax_records(tar, MTAR_TPAXG, record, len);
+    if (err) {
+        return err;
+    }
+    /* A table of contents keeps the deletion, lookups then miss the name */
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, name);
+    h.type = MTAR_TDELETED;
+    return toc_record(tar, &h, offset);
+}
+
+
+static int sparse_stand_in(char *out, const char *name) {
+    /* The name readers without sparse support see, as GNU tar forms it */
+    const char *base = strrchr(name, '/');
+    int n = base ? snprintf(out, 100, "%.*sGNUSparseFile.0/%s", (int) (base + 1 - name), name, base + 1)
+                 : snprintf(out, 100, "GNUSparseFile.0/%s", name);
+    return n >= 0 && n < 100 ? MTAR_ESUCCESS : MTAR_EFAILURE;
+}
+
+
+static int write_sparse_pax(mtar_t *tar, const mtar_header_t *h) {
+    char records[256], value[24];
+    unsigned len;
+    snprintf(value, sizeof(value), "%llu", (unsigned long long) h->realsize);
+    len = format_pax_record(records, sizeof(records), PAX_SPARSE_MAJOR_KEY, "1");
+    len += format_pax_record(records + len, sizeof(records) - len, "GNU.sparse.minor", "0");
+    len += format_pax_record(records + len, sizeof(records) - len, PAX_SPARSE_NAME_KEY, h->name);
+    len += format_pax_record(records + len, sizeof(records) - len, PAX_SPARSE_SIZE_KEY, value);
+    return write_pax_records(tar, MTAR_TPAX, records, len);
+}
+
+
+typedef struct {
+    unsigned active;
+    uint32_t crc;
+    sha256_t sha;
+    uint64_t pos;
+    uint64_t end;
+    uint64_t pax_pos;
+    unsigned pax_len;
+    uint32_t expect_crc;
+    unsigned char expect_sha[32];
+} digest_t;
+
+
+static digest_t *get_digest(mtar_t *tar) {
+    if (!tar->digest) {
+        tar->digest = calloc(1, sizeof(digest_t));
+    }
+    return tar->digest;
+}
+
+
+static bool digest_active(const mtar_t *tar) {
+    const digest_t *d = tar->digest;
+    return d && d->active;
+}
+
+
+static void digest_begin(mtar_t *tar, unsigned which, const mtar_header_t *h) {
+    /* Starts over for the payload at tar->pos; `which` are the digests the
+     * entry carries (reading) or gets (writing), limited to tar->flags */
+    digest_t *d = tar->digest;
+    which &= tar->flags & MTAR_FDIGESTS;
+    if (which && !d) {
+        d = get_digest(tar);
+    }
+    if (!d) {
+        return;
+    }
+    d->active = which;
+    d->crc = 0;
+    sha256_init(&d->sha);
+    d->pos = tar->pos;
+    d->end = tar->pos + h->size;
+    d->expect_crc = h->crc32c;
+    memcpy(d->expect_sha, h->sha256, sizeof(d->expect_sha));
+}
+
+
+static void digest_update(mtar_t *tar, const void *data, unsigned size, uint64_t at) {
+    digest_t *d = tar->digest;
+    if (!d || !d->active) {
+        return;
+    }
+    /* Only an in-order pass over the payload can be checked */
+    if (at != d->pos) {
+        d->active = 0;
+        return;
+    }
+    if (d->active & MTAR_FCRC32C) {
+        d->crc = crc32c(d->crc, data, size);
+    }
+    if (d->active & MTAR_FSHA256) {
+        sha256_update(&d->sha, data, size);
+    }
+    d->pos += size;
+}
+
+
+static int digest_check(mtar_t *tar) {
+    /* Reading: compares against the recorded values once the payload is in */
+    digest_t *d = tar->digest;
+    unsigned char sha[32];
+    unsigned which;
+    int err = MTAR_ESUCCESS;
+    if (!d || !d->active || d->pos != d->end) {
+        return MTAR_ESUCCESS;
+    }
+    which = d->active;
+    d->active = 0;
+    if ((which & MTAR_FCRC32C) && d->crc != d->expect_crc) {
+        err = MTAR_EBADCHKSUM;
+    }
+    if (!err && (which & MTAR_FSHA256)) {
+        sha256_final(&d->sha, sha);
+        if (memcmp(sha, d->expect_sha, sizeof(sha)) != 0) {
+            err = MTAR_EBADCHKSUM;
+        }
+    }
+    if (err) {
+        stats_failure(tar);
+    }
+    return err;
+}
+
+
+struct mtar_digest {
+    unsigned which;
+    uint32_t crc;
+    sha256_t sha;
+    uint32_t expect_crc;
+    unsigned char expect_sha[32];
+};
+
+
+int mtar_digest_begin(mtar_digest_t **d, const mtar_header_t *h) {
+    /* Leaves *d NULL for entries without digests, there is nothing to check */
+    *d = NULL;
+    if (!(h->digests & MTAR_FDIGESTS)) {
+        return MTAR_ESUCCESS;
+    }
+    *d = calloc(1, sizeof(**d));
+    if (!*d) {
+        return MTAR_EFAILURE;
+    }
+    (*d)->which = h->digests & MTAR_FDIGESTS;
+    sha256_init(&(*d)->sha);
+    (*d)->expect_crc = h->crc32c;
+    memcpy((*d)->expect_sha, h->sha256, sizeof((*d)->expect_sha));
+    return MTAR_ESUCCESS;
+}
+
+
+void mtar_digest_update(mtar_digest_t *d, const void *data, size_t size) {
+    /* The payload must be passed in order */
+    if (!d) {
+        return;
+    }
+    if (d->which & MTAR_FCRC32C) {
+        d->crc = crc32c(d->crc, data, size);
+    }
+    if (d->which & MTAR_FSHA256) {
+        sha256_update(&d->sha, data, size);
+    }
+}
+
+
+int mtar_digest_end(mtar_digest_t *d) {
+    int err = MTAR_ESUCCESS;
+    unsigned char sha[32];
+    if (!d) {
+        return MTAR_ESUCCESS;
+    }
+    if ((d->which & MTAR_FCRC32C) && d->crc != d->expect_crc) {
+        err = MTAR_EBADCHKSUM;
+    }
+    if (!err && (d->which & MTAR_FSHA256)) {
+        sha256_final(&d->sha, sha);
+        if (memcmp(sha, d->expect_sha, sizeof(sha)) != 0) {
+            err = MTAR_EBADCHKSUM;
+        }
+    }
+    free(d);
+    return err;
+}
+
+
+static unsigned format_digests(char *out, unsigned which, uint32_t crc, const unsigned char *sha) {
+    /* Fixed width records, so placeholders can be overwritten in place:
+     * "24 LTAR.crc32c=<8 hex>\n" and "80 LTAR.sha256=<64 hex>\n" */
+    unsigned i, n = 0;
+    if (which & MTAR_FCRC32C) {
+        n += (unsigned) sprintf(out + n, "24 " PAX_CRC32C_KEY "=%08x\n", (unsigned) crc);
+    }
+    if (which & MTAR_FSHA256) {
+        n += (unsigned) sprintf(out + n, "80 " PAX_SHA256_KEY "=");
+        for (i = 0; i < 32; i++) {
+            n += (unsigned) sprintf(out + n, "%02x", sha ? sha[i] : 0);
+        }
+        out[n++] = '\n';
+    }
+    return n;
+}
+
+
+static int write_digest_pax(mtar_t *tar) {
+    /* Placeholder records, filled in by patch_digests() after the data */
+    char records[128];
+    unsigned len = format_digests(records, tar->flags & MTAR_FDIGESTS, 0, NULL);
+    digest_t *d = get_digest(tar);
+    if (!d) {
+        return MTAR_EFAILURE;
+    }
+    d->pax_pos = tar->pos + sizeof(mtar_raw_header_t);
+    d->pax_len = len;
+    return write_pax_records(tar, MTAR_TPAX, records, len);
+}
+
+
+static int patch_digests(mtar_t *tar) {
+    int err;
+    char records[128];
+    unsigned char sha[32];
+    uint64_t buffered;
+    digest_t *d = tar->digest;
+    if (!d || !d->active || d->pos != d->end) {
+        return MTAR_ESUCCESS;
+    }
+    if (d->active & MTAR_FSHA256) {
+        sha256_final(&d->sha, sha);
+    }
+    format_digests(records, d->active, d->crc, sha);
+    d->active = 0;
+    /* Records still in the write buffer are patched there */
+    buffered = tar->pos - tar->buffer_len;
+    if (d->pax_pos >= buffered) {
+        memcpy(tar->buffer + (d->pax_pos - buffered), records, d->pax_len);
+        return MTAR_ESUCCESS;
+    }
+    err = tflush(tar);
+    if (!err) {
+        err = tar->seek(tar, (int64_t) d->pax_pos, SEEK_SET);
+    }
+    if (!err) {
+        err = tar->write(tar, records, d->pax_len);
+    }
+    if (!err) {
+        err = tar->seek(tar, (int64_t) tar->pos, SEEK_SET);
+    }
+    return err;
+}
+
+
 int mtar_next(mtar_t *tar) {
-    int err, n;
+    int err;
     mtar_header_t h;
     /* Load header */
-    err = mtar_read_header(tar, &h);
+    err = read_entry_header(tar, &h);
     if (err) {
         return err;
     }
     /* Seek to next record */
-    n = round_up(h.size, 512) + sizeof(mtar_raw_header_t);
-    return mtar_seek(tar, tar->pos + n);
+    return mtar_seek(tar, tar->pos + round_up(h.size, 512));
 }
 
 
 int mtar_find(mtar_t *tar, const char *name, mtar_header_t *h) {
     int err;
-    mtar_header_t header;
+    bool found = false;
+    uint64_t found_at = 0;
+    mtar_header_t header, match;
+    /* A table of contents answers without touching the headers */
+    if (tar->toc) {
+        toc_t *toc = tar->toc;
+        return mtar_index_find(tar, &toc->index, name, h);
+    }
     /* Start at beginning */
     err = mtar_rewind(tar);
     if (err) {
         return err;
     }
-    /* Iterate all files until we hit an error or find the file */
+    /* Iterate all files; appended copies and deletions override what came
+     * before them, so the last occurrence of the name decides */
     while ((err = mtar_read_header(tar, &header)) == MTAR_ESUCCESS) {
         if (!strcmp(header.name, name)) {
-            if (h) {
-                *h = header;
-            }
-            return MTAR_ESUCCESS;
+            found = header.type != MTAR_TDELETED;
+            found_at = tar->last_header;
+            match = header;
         }
         mtar_next(tar);
     }
-    /* Return error */
-    if (err == MTAR_ENULLRECORD) {
-        err = MTAR_ENOTFOUND;
+    if (err != MTAR_ENULLRECORD) {
+        return err;
+    }
+    if (!found) {
+        return MTAR_ENOTFOUND;
+    }
+    /* Leave the archive at the entry's header, ready for its data */
+    tar->remaining_data = 0;
+    tar->last_header = found_at;
+    err = mtar_seek(tar, found_at);
+    if (!err && h) {
+        *h = match;
     }
     return err;
 }
 
 
 int mtar_read_header(mtar_t *tar, mtar_header_t *h) {
-    int err;
-    mtar_raw_header_t rh;
+    int err, seek_err;
     /* Save header position */
     tar->last_header = tar->pos;
-    /* Read raw header */
-    err = tread(tar, &rh, sizeof(rh));
-    if (err) {
+    /* Read header */
+    err = read_entry_header(tar, h);
+    if (err == MTAR_EREADFAIL) {
         return err;
     }
     /* Seek back to start of header */
-    err = mtar_seek(tar, tar->last_header);
-    if (err) {
-        return err;
-    }
-    /* Load raw header into header struct and return */
-    return raw_to_header(h, &rh);
+    seek_err = mtar_seek(tar, tar->last_header);
+    return err ? err : seek_err;
 }
 
 
-int mtar_read_data(mtar_t *tar, void *ptr, unsigned size) {
-    int err;
+static int read_data(mtar_t *tar, void *ptr, const void **view, unsigned size) {
+    int err, seek_err;
+    uint64_t at;
     /* If we have no remaining data then this is the first read, we get the size,
      * set the remaining data and seek to the beginning of the data */
     if (tar->remaining_data == 0) {
         mtar_header_t h;
-        /* Read header */
-        err = mtar_read_header(tar, &h);
-        if (err) {
-            return err;
-        }
-        /* Seek past header and init remaining data */
-        err = mtar_seek(tar, tar->pos + sizeof(mtar_raw_header_t));
+        /* Read header, which leaves us at the data, and init remaining data */
+        tar->last_header = tar->pos;
+        err = read_entry_header(tar, &h);
         if (err) {
             return err;
         }
         tar->remaining_data = h.size;
+        digest_begin(tar, h.digests, &h);
+    }
+    /* Read data, or just reference it if the caller asked for a view */
+    at = tar->pos;
+    if (view) {
+        err = tview(tar, view, size);
+    } else {
+        err = tread(tar, ptr, size);
     }
-    /* Read data */
-    err = tread(tar, ptr, size);
     if (err) {
         return err;
     }
+    digest_update(tar, view ? *view : ptr, size, at);
     tar->remaining_data -= size;
     /* If there is no remaining data we've finished reading and seek back to the
      * header */
     if (tar->remaining_data == 0) {
-        return mtar_seek(tar, tar->last_header);
+        err = digest_check(tar);
+        seek_err = mtar_seek(tar, tar->last_header);
+        return err ? err : seek_err;
     }
     return MTAR_ESUCCESS;
 }
 
 
-int mtar_write_header(mtar_t *tar, const mtar_header_t *h) {
-    mtar_raw_header_t rh;
+int mtar_read_data(mtar_t *tar, void *ptr, unsigned size) {
+    return read_data(tar, ptr, NULL, size);
+}
+
+
+int mtar_read_data_view(mtar_t *tar, const void **ptr, unsigned size) {
+    if (!tar->view) {
+        return MTAR_EUNSUPPORTED;
+    }
+    return read_data(tar, NULL, ptr, size);
+}
+
+
+int mtar_write_header(mtar_t *tar, const mtar_header_t *h) {
+    int err;
+    unsigned digests;
+    uint64_t offset = tar->pos;
+    mtar_header_t stand_in;
+    mtar_raw_header_t rh;
+    /* Sizes past the octal field go out as base-256, and with MTAR_FPAX
+     * additionally as a PAX record for readers that only know that */
+    if (h->size > OCTAL_SIZE_MAX && (tar->flags & MTAR_FPAX)) {
+        err = write_pax(tar, h);
+        if (err) {
+            return err;
+        }
+    }
+    /* Sparse files go under a stand-in name, the real one is a record */
+    if (h->sparse) {
+        stand_in = *h;
+        err = sparse_stand_in(stand_in.name, h->name);
+        if (!err) {
+            err = write_sparse_pax(tar, h);
+        }
+        if (err) {
+            return err;
+        }
+    }
+    /* Digests of regular files are recorded up front and filled in once
+     * the data is through, which takes a seekable archive */
+    digests = (h->type == MTAR_TREG && h->size > 0 && !h->sparse && !(tar->flags & MTAR_FSTREAM))
+              ? tar->flags & MTAR_FDIGESTS : 0;
+    if (digests) {
+        err = write_digest_pax(tar);
+        if (err) {
+            return err;
+        }
+    }
     /* Build raw header and write */
-    header_to_raw(&rh, h);
+    header_to_raw(&rh, h->sparse ? &stand_in : h);
     tar->remaining_data = h->size;
-    return twrite(tar, &rh, sizeof(rh));
+    err = twrite(tar, &rh, sizeof(rh));
+    if (err) {
+        return err;
+    }
+    digest_begin(tar, digests, h);
+    return toc_record(tar, h, offset);
 }
 
 
-int mtar_write_file_header(mtar_t *tar, const char *name, unsigned size) {
+static int write_entry_header(mtar_t *tar, const char *name, unsigned type, uint64_t size,
+                              unsigned mode, unsigned mtime) {
     mtar_header_t h;
+    if (strlen(name) >= sizeof(h.name)) {
+        return MTAR_EFAILURE;
+    }
     /* Build header */
     memset(&h, 0, sizeof(h));
     strcpy(h.name, name);
     h.size = size;
-    h.type = MTAR_TREG;
-    h.mode = 0664;
+    h.type = type;
+    h.mode = mode;
+    h.mtime = mtime;
     /* Write header */
     return mtar_write_header(tar, &h);
 }
 
 
+int mtar_write_file_header(mtar_t *tar, const char *name, uint64_t size) {
+    return write_entry_header(tar, name, MTAR_TREG, size, 0664, 0);
+}
+
+
 int mtar_write_dir_header(mtar_t *tar, const char *name) {
-    mtar_header_t h;
-    /* Build header */
-    memset(&h, 0, sizeof(h));
-    strcpy(h.name, name);
-    h.type = MTAR_TDIR;
-    h.mode = 0775;
-    /* Write header */
-    return mtar_write_header(tar, &h);
+    return write_entry_header(tar, name, MTAR_TDIR, 0, 0775, 0);
 }
 
 
 int mtar_write_data(mtar_t *tar, const void *data, unsigned size) {
     int err;
+    uint64_t at = tar->pos;
     /* Write data */
     err = twrite(tar, data, size);
     if (err) {
         return err;
     }
+    digest_update(tar, data, size, at);
     tar->remaining_data -= size;
     /* Write padding if we've written all the data for this file */
     if (tar->remaining_data == 0) {
+        err = patch_digests(tar);
+        if (err) {
+            return err;
+        }
         return write_null_bytes(tar, round_up(tar->pos, 512) - tar->pos);
     }
     return MTAR_ESUCCESS;
@@ -423,6 +1956,1601 @@ int mtar_write_data(mtar_t *tar, const void *data, unsigned size) {
 
 
 int mtar_finalize(mtar_t *tar) {
+    int err;
     /* Write two NULL records */
-    return write_null_bytes(tar, sizeof(mtar_raw_header_t) * 2);
+    err = write_null_bytes(tar, sizeof(mtar_raw_header_t) * 2);
+    if (err) {
+        return err;
+    }
+    if (tar->toc) {
+        err = toc_write(tar);
+        if (err) {
+            return err;
+        }
+    }
+    return tflush(tar);
+}
+
+
+int mtar_commit(mtar_t *tar) {
+    int err;
+    uint64_t end = tar->pos;
+    /* Only between entries, and only where the trailer can be taken back */
+    if (tar->remaining_data != 0) {
+        return MTAR_EFAILURE;
+    }
+    if (tar->flags & MTAR_FSTREAM) {
+        return MTAR_EUNSUPPORTED;
+    }
+    err = mtar_finalize(tar);
+    if (err) {
+        return err;
+    }
+    /* The next entry replaces the trailer and table of contents again */
+    return mtar_seek(tar, end);
+}
+
+
+#ifdef MTAR_HAVE_KERNEL_COPY
+static int kernel_copy(int in, int64_t *in_off, int out, uint64_t size) {
+    /* Moves file data without passing it through user space. Returns
+     * MTAR_EUNSUPPORTED when neither copy_file_range nor sendfile can
+     * handle this pair of descriptors and nothing has been moved yet */
+    bool use_sendfile = false;
+    uint64_t done = 0;
+    while (done < size) {
+        size_t chunk = size - done > 0x40000000 ? 0x40000000 : (size_t) (size - done);
+        ssize_t n = -1;
+#ifdef SYS_copy_file_range
+        if (!use_sendfile) {
+            loff_t off = in_off ? (loff_t) *in_off : 0;
+            n = syscall(SYS_copy_file_range, in, in_off ? &off : NULL, out, NULL, chunk, 0);
+            if (n < 0 && done == 0 && errno != EINTR) {
+                use_sendfile = true;
+                continue;
+            }
+        } else
+#endif
+        {
+            off_t off = in_off ? (off_t) *in_off : 0;
+            n = sendfile(out, in, in_off ? &off : NULL, chunk);
+            if (n < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                return MTAR_EUNSUPPORTED;
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return MTAR_EWRITEFAIL;
+        }
+        /* The source ended early */
+        if (n == 0) {
+            return MTAR_EREADFAIL;
+        }
+        done += (uint64_t) n;
+        if (in_off) {
+            *in_off += n;
+        }
+    }
+    return MTAR_ESUCCESS;
+}
+#endif
+
+
+static int copy_into_archive(mtar_t *tar, FILE *src, uint64_t size, sha256_t *sha) {
+    int err;
+    char *buf;
+#ifdef MTAR_HAVE_KERNEL_COPY
+    /* Digests and hashes need the bytes, so those entries take the user
+     * space path */
+    if (backend_write(tar) == file_write && !digest_active(tar) && !sha) {
+        uint64_t start;
+        err = tflush(tar);
+        if (err) {
+            return err;
+        }
+        if (fflush(tar->stream) != 0) {
+            return MTAR_EWRITEFAIL;
+        }
+        /* stdio seeks lazily, so descriptor offsets are set explicitly on
+         * both sides rather than trusted */
+        int64_t src_off = 0;
+        if (!(tar->flags & MTAR_FSTREAM) &&
+            lseek(fileno(tar->stream), (off_t) tar->pos, SEEK_SET) == (off_t) -1) {
+            return MTAR_ESEEKFAIL;
+        }
+        start = now_ns();
+        err = kernel_copy(fileno(src), &src_off, fileno(tar->stream), size);
+        if (err != MTAR_EUNSUPPORTED) {
+            stats_count(tar, MTAR_TRACE_WRITE, (int64_t) size, err, start);
+            if (err) {
+                return err;
+            }
+            tar->pos += size;
+            tar->remaining_data = 0;
+            /* Bring the stdio stream back in line with its descriptor */
+            if (!(tar->flags & MTAR_FSTREAM) && fseeko(tar->stream, (off_t) tar->pos, SEEK_SET) != 0) {
+                return MTAR_ESEEKFAIL;
+            }
+            return write_null_bytes(tar, (int) (round_up(tar->pos, 512) - tar->pos));
+        }
+    }
+#endif
+    /* One buffer for the whole file, padding comes with the last chunk */
+    buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        return MTAR_EFAILURE;
+    }
+    err = MTAR_ESUCCESS;
+    while (size > 0 && !err) {
+        unsigned chunk = size < COPY_BUFFER_SIZE ? (unsigned) size : COPY_BUFFER_SIZE;
+        if (fread(buf, 1, chunk, src) != chunk) {
+            err = MTAR_EREADFAIL;
+            break;
+        }
+        if (sha) {
+            sha256_update(sha, buf, chunk);
+        }
+        err = mtar_write_data(tar, buf, chunk);
+        size -= chunk;
+    }
+    free(buf);
+    return err;
+}
+
+
+static int copy_from_archive(mtar_t *tar, FILE *dst, uint64_t size) {
+    int err = MTAR_ESUCCESS;
+    char *buf;
+    if (tar->view) {
+        /* Memory backed archive, write straight out of it */
+        while (size > 0 && !err) {
+            const void *data;
+            uint64_t at = tar->pos;
+            unsigned chunk = size < 0x40000000 ? (unsigned) size : 0x40000000;
+            err = tview(tar, &data, chunk);
+            if (!err) {
+                digest_update(tar, data, chunk, at);
+            }
+            if (!err && fwrite(data, 1, chunk, dst) != chunk) {
+                err = MTAR_EWRITEFAIL;
+            }
+            size -= chunk;
+        }
+        return err;
+    }
+#ifdef MTAR_HAVE_KERNEL_COPY
+    /* Explicit offsets leave the archive's descriptor offset alone. Streams
+     * are excluded, stdio may already hold read-ahead data of theirs */
+    if (backend_read(tar) == file_read && !(tar->flags & MTAR_FSTREAM) && !digest_active(tar)) {
+        int64_t off = (int64_t) tar->pos;
+        uint64_t start;
+        err = tflush(tar);
+        if (err || fflush(tar->stream) != 0) {
+            return err ? err : MTAR_EWRITEFAIL;
+        }
+        start = now_ns();
+        err = kernel_copy(fileno(tar->stream), &off, fileno(dst), size);
+        if (err != MTAR_EUNSUPPORTED) {
+            stats_count(tar, MTAR_TRACE_READ, (int64_t) size, err, start);
+            tar->pos += size;
+            return err;
+        }
+        err = MTAR_ESUCCESS;
+    }
+#endif
+    buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        return MTAR_EFAILURE;
+    }
+    while (size > 0 && !err) {
+        uint64_t at = tar->pos;
+        unsigned chunk = size < COPY_BUFFER_SIZE ? (unsigned) size : COPY_BUFFER_SIZE;
+        err = tread(tar, buf, chunk);
+        if (!err) {
+            digest_update(tar, buf, chunk, at);
+        }
+        if (!err && fwrite(buf, 1, chunk, dst) != chunk) {
+            err = MTAR_EWRITEFAIL;
+        }
+        size -= chunk;
+    }
+    free(buf);
+    return err;
+}
+
+
+/* Files already written, by size, for MTAR_FDEDUP, with the hash of the
+ * bytes that went into the archive. A new file is hashed only when one of
+ * the same size was written before */
+typedef struct {
+    uint64_t size;
+    char name[100];
+    unsigned char sha256[32];
+    unsigned next;
+} dedup_entry_t;
+
+typedef struct {
+    dedup_entry_t *entries;
+    unsigned count;
+    unsigned capacity;
+    unsigned *buckets;
+    unsigned bucket_count;
+} dedup_t;
+
+
+static void dedup_free(mtar_t *tar) {
+    dedup_t *d = tar->dedup;
+    if (!d) {
+        return;
+    }
+    free(d->entries);
+    free(d->buckets);
+    free(d);
+    tar->dedup = NULL;
+}
+
+
+static unsigned dedup_bucket(const dedup_t *d, uint64_t size) {
+    return (unsigned) ((size ^ (size >> 32)) * 2654435761u) & (d->bucket_count - 1);
+}
+
+
+static int dedup_grow(dedup_t *d) {
+    unsigned i, b, count = d->bucket_count ? d->bucket_count * 2 : 256;
+    unsigned *buckets = calloc(count, sizeof(*buckets));
+    if (!buckets) {
+        return MTAR_EFAILURE;
+    }
+    /* Chains are rebuilt in entry order, oldest first */
+    free(d->buckets);
+    d->buckets = buckets;
+    d->bucket_count = count;
+    for (i = d->count; i > 0; i--) {
+        b = dedup_bucket(d, d->entries[i - 1].size);
+        d->entries[i - 1].next = d->buckets[b];
+        d->buckets[b] = i;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static int stream_sha256(FILE *f, unsigned char out[32]) {
+    size_t n;
+    sha256_t s;
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        return MTAR_EFAILURE;
+    }
+    sha256_init(&s);
+    while ((n = fread(buf, 1, COPY_BUFFER_SIZE, f)) > 0) {
+        sha256_update(&s, buf, n);
+    }
+    free(buf);
+    if (ferror(f)) {
+        return MTAR_EREADFAIL;
+    }
+    sha256_final(&s, out);
+    return MTAR_ESUCCESS;
+}
+
+
+static int dedup_match(mtar_t *tar, FILE *src, uint64_t size, const char **target) {
+    int err;
+    unsigned i;
+    bool hashed = false;
+    unsigned char sum[32];
+    dedup_t *d = tar->dedup;
+    *target = NULL;
+    if (!d || d->count == 0) {
+        return MTAR_ESUCCESS;
+    }
+    for (i = d->buckets[dedup_bucket(d, size)]; i != 0; i = d->entries[i - 1].next) {
+        dedup_entry_t *e = &d->entries[i - 1];
+        if (e->size != size) {
+            continue;
+        }
+        if (!hashed) {
+            err = stream_sha256(src, sum);
+            if (err) {
+                return err;
+            }
+            hashed = true;
+            if (fseek(src, 0, SEEK_SET) != 0) {
+                return MTAR_EREADFAIL;
+            }
+        }
+        if (!memcmp(e->sha256, sum, 32)) {
+            *target = e->name;
+            return MTAR_ESUCCESS;
+        }
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static int dedup_add(mtar_t *tar, const char *name, uint64_t size, const unsigned char sum[32]) {
+    unsigned b;
+    dedup_entry_t *e;
+    dedup_t *d = tar->dedup;
+    if (!d) {
+        d = tar->dedup = calloc(1, sizeof(*d));
+        if (!d) {
+            return MTAR_EFAILURE;
+        }
+    }
+    if (d->count >= d->bucket_count && dedup_grow(d)) {
+        return MTAR_EFAILURE;
+    }
+    if (d->count == d->capacity) {
+        unsigned capacity = d->capacity ? d->capacity * 2 : 64;
+        void *p = realloc(d->entries, capacity * sizeof(*d->entries));
+        if (!p) {
+            return MTAR_EFAILURE;
+        }
+        d->entries = p;
+        d->capacity = capacity;
+    }
+    e = &d->entries[d->count];
+    memset(e, 0, sizeof(*e));
+    e->size = size;
+    strcpy(e->name, name);
+    memcpy(e->sha256, sum, 32);
+    /* Appended at the tail, so the first copy of a content is matched first */
+    b = dedup_bucket(d, size);
+    if (d->buckets[b] == 0) {
+        d->buckets[b] = d->count + 1;
+    } else {
+        unsigned i = d->buckets[b];
+        while (d->entries[i - 1].next != 0) {
+            i = d->entries[i - 1].next;
+        }
+        d->entries[i - 1].next = d->count + 1;
+    }
+    d->count++;
+    return MTAR_ESUCCESS;
+}
+
+
+static int write_link_header(mtar_t *tar, const char *name, const char *target, unsigned mode,
+                             unsigned mtime) {
+    mtar_header_t h;
+    if (strlen(name) >= sizeof(h.name)) {
+        return MTAR_EFAILURE;
+    }
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, name);
+    strcpy(h.linkname, target);
+    h.type = MTAR_TLNK;
+    h.mode = mode;
+    h.mtime = mtime;
+    return mtar_write_header(tar, &h);
+}
+
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} sparse_extent_t;
+
+
+#ifdef MTAR_HAVE_SPARSE
+static int sparse_add(sparse_extent_t **extents, unsigned *count, unsigned *cap, uint64_t offset, uint64_t size) {
+    if (*count == *cap) {
+        unsigned n = *cap ? *cap * 2 : 16;
+        void *p = realloc(*extents, n * sizeof(**extents));
+        if (!p) {
+            return MTAR_EFAILURE;
+        }
+        *extents = p;
+        *cap = n;
+    }
+    (*extents)[*count].offset = offset;
+    (*extents)[*count].size = size;
+    (*count)++;
+    return MTAR_ESUCCESS;
+}
+
+
+static void sha256_zeros(sha256_t *s, uint64_t n) {
+    while (n > 0) {
+        unsigned chunk = n < sizeof(null_record) ? (unsigned) n : (unsigned) sizeof(null_record);
+        sha256_update(s, null_record, chunk);
+        n -= chunk;
+    }
+}
+
+
+static int write_sparse(mtar_t *tar, int fd, const char *name, uint64_t size, unsigned mode, unsigned mtime,
+                        sha256_t *sha) {
+    int err = MTAR_ESUCCESS;
+    unsigned i, count = 0, cap = 0;
+    uint64_t pos = 0, stored = 0, hashed = 0;
+    size_t map_len, map_cap;
+    char *map, *buf, stand_in[100];
+    sparse_extent_t *extents = NULL;
+    mtar_header_t h;
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+
+    /* Files without holes, and file systems that cannot tell, are stored
+     * as usual */
+    if (hole < 0 || (uint64_t) hole >= size || sparse_stand_in(stand_in, name)) {
+        return MTAR_EUNSUPPORTED;
+    }
+    while (pos < size && !err) {
+        off_t start = lseek(fd, (off_t) pos, SEEK_DATA), end;
+        if (start < 0) {
+            /* Nothing but a hole up to the end */
+            break;
+        }
+        end = lseek(fd, start, SEEK_HOLE);
+        if (end < 0 || (uint64_t) end > size) {
+            end = (off_t) size;
+        }
+        err = sparse_add(&extents, &count, &cap, (uint64_t) start, (uint64_t) (end - start));
+        stored += (uint64_t) (end - start);
+        pos = (uint64_t) end;
+    }
+    /* A trailing hole still gets an empty extent, the map ends at the
+     * file's length */
+    if (!err && (count == 0 || extents[count - 1].offset + extents[count - 1].size < size)) {
+        err = sparse_add(&extents, &count, &cap, size, 0);
+    }
+    if (err) {
+        free(extents);
+        return err;
+    }
+
+    /* The map, padded to a block, goes in front of the extents' data */
+    map_cap = 24 + (size_t) count * 42;
+    map = calloc(1, round_up(map_cap, 512));
+    buf = malloc(COPY_BUFFER_SIZE);
+    if (!map || !buf) {
+        free(map);
+        free(buf);
+        free(extents);
+        return MTAR_EFAILURE;
+    }
+    map_len = (size_t) snprintf(map, map_cap, "%u\n", count);
+    for (i = 0; i < count; i++) {
+        map_len += (size_t) snprintf(map + map_len, map_cap - map_len, "%llu\n%llu\n",
+                                     (unsigned long long) extents[i].offset,
+                                     (unsigned long long) extents[i].size);
+    }
+    map_len = (size_t) round_up(map_len, 512);
+
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, name);
+    h.size = map_len + stored;
+    h.type = MTAR_TREG;
+    h.mode = mode;
+    h.mtime = mtime;
+    h.sparse = 1;
+    h.realsize = size;
+    err = mtar_write_header(tar, &h);
+    if (!err) {
+        err = mtar_write_data(tar, map, (unsigned) map_len);
+    }
+    for (i = 0; i < count && !err; i++) {
+        uint64_t off = extents[i].offset, left = extents[i].size;
+        /* Hashes cover the whole file, holes read as zeros */
+        if (sha) {
+            sha256_zeros(sha, off - hashed);
+            hashed = off + left;
+        }
+        while (left > 0 && !err) {
+            unsigned chunk = left < COPY_BUFFER_SIZE ? (unsigned) left : COPY_BUFFER_SIZE;
+            if (pread(fd, buf, chunk, (off_t) off) != (ssize_t) chunk) {
+                err = MTAR_EREADFAIL;
+                break;
+            }
+            if (sha) {
+                sha256_update(sha, buf, chunk);
+            }
+            err = mtar_write_data(tar, buf, chunk);
+            off += chunk;
+            left -= chunk;
+        }
+    }
+    if (sha) {
+        sha256_zeros(sha, size - hashed);
+    }
+    free(map);
+    free(buf);
+    free(extents);
+    return err;
+}
+#endif
+
+
+static int write_file(mtar_t *tar, const char *path, const char *name, unsigned mode, unsigned mtime) {
+    int err;
+    int64_t size;
+    sha256_t sha, *hashing = NULL;
+    unsigned char sum[32];
+    const char *target = NULL;
+    FILE *src = fopen(path, "rb");
+    if (!src) {
+        return MTAR_EOPENFAIL;
+    }
+    /* Size the file from the stream we are about to copy */
+#ifdef MTAR_HAVE_MMAP
+    err = fseeko(src, 0, SEEK_END);
+    size = ftello(src);
+    err = err || fseeko(src, 0, SEEK_SET);
+#else
+    err = fseek(src, 0, SEEK_END);
+    size = ftell(src);
+    err = err || fseek(src, 0, SEEK_SET);
+#endif
+    if (err || size < 0) {
+        fclose(src);
+        return MTAR_EREADFAIL;
+    }
+    /* With MTAR_FDEDUP, a later copy of the same content becomes a hard
+     * link to the first */
+    if ((tar->flags & MTAR_FDEDUP) && size > 0) {
+        err = dedup_match(tar, src, (uint64_t) size, &target);
+        if (!err && target) {
+            fclose(src);
+            return write_link_header(tar, name, target, mode, mtime);
+        }
+        /* Later copies are matched against the bytes written now, not
+         * against the file as it may be by then */
+        hashing = &sha;
+        sha256_init(hashing);
+    }
+    if (err) {
+        fclose(src);
+        return err;
+    }
+    err = MTAR_EUNSUPPORTED;
+#ifdef MTAR_HAVE_SPARSE
+    /* With MTAR_FSPARSE, files with holes store only their data */
+    if ((tar->flags & MTAR_FSPARSE) && size > 0) {
+        err = write_sparse(tar, fileno(src), name, (uint64_t) size, mode, mtime, hashing);
+    }
+#endif
+    if (err == MTAR_EUNSUPPORTED) {
+        err = write_entry_header(tar, name, MTAR_TREG, (uint64_t) size, mode, mtime);
+        if (!err && size > 0) {
+            err = copy_into_archive(tar, src, (uint64_t) size, hashing);
+        }
+    }
+    fclose(src);
+    if (!err && hashing) {
+        sha256_final(hashing, sum);
+        err = dedup_add(tar, name, (uint64_t) size, sum);
+    }
+    return err;
+}
+
+
+int mtar_write_file(mtar_t *tar, const char *path, const char *name) {
+    return write_file(tar, path, name, 0664, 0);
+}
+
+
+static int read_sparse_map(mtar_t *tar, const mtar_header_t *h, sparse_extent_t **extents,
+                           unsigned *count, uint64_t *map_len) {
+    int err;
+    unsigned i, k = 0, cap = 0;
+    uint64_t n = 0, numbers = 1;
+    char block[512];
+    *extents = NULL;
+    *count = 0;
+    *map_len = 0;
+    /* "count\n" then "offset\nsize\n" pairs, block by block, as the
+     * map may span several */
+    while (k < numbers) {
+        if (*map_len + sizeof(block) > h->size) {
+            return MTAR_EFAILURE;
+        }
+        err = tread(tar, block, sizeof(block));
+        if (err) {
+            return err;
+        }
+        *map_len += sizeof(block);
+        for (i = 0; i < sizeof(block) && k < numbers; i++) {
+            if (block[i] >= '0' && block[i] <= '9') {
+                n = n * 10 + (uint64_t) (block[i] - '0');
+                continue;
+            }
+            if (block[i] != '\n') {
+                return MTAR_EFAILURE;
+            }
+            if (k == 0) {
+                /* Every extent takes at least four bytes of map */
+                if (n > h->size / 4) {
+                    return MTAR_EFAILURE;
+                }
+                cap = (unsigned) n;
+                numbers = 1 + 2 * n;
+                *extents = calloc(cap ? cap : 1, sizeof(**extents));
+                if (!*extents) {
+                    return MTAR_EFAILURE;
+                }
+            } else if (k % 2) {
+                (*extents)[(k - 1) / 2].offset = n;
+            } else {
+                (*extents)[(k - 1) / 2].size = n;
+            }
+            k++;
+            n = 0;
+        }
+    }
+    *count = cap;
+    return MTAR_ESUCCESS;
+}
+
+
+static int extract_sparse(mtar_t *tar, FILE *dst, const mtar_header_t *h) {
+#ifdef MTAR_HAVE_MMAP
+    int err;
+    unsigned i, count;
+    uint64_t used;
+    sparse_extent_t *extents;
+    err = read_sparse_map(tar, h, &extents, &count, &used);
+    /* Holes are never written, only seeked over */
+    for (i = 0; i < count && !err; i++) {
+        if (extents[i].size > h->size - used || extents[i].offset + extents[i].size > h->realsize) {
+            err = MTAR_EFAILURE;
+            break;
+        }
+        if (fseeko(dst, (off_t) extents[i].offset, SEEK_SET) != 0) {
+            err = MTAR_EWRITEFAIL;
+            break;
+        }
+        err = copy_from_archive(tar, dst, extents[i].size);
+        used += extents[i].size;
+    }
+    free(extents);
+    /* Kernel copies leave the descriptor where it was, so seekable
+     * archives move on by absolute position */
+    if (!err && used < h->size) {
+        err = (tar->flags & MTAR_FSTREAM) ? skip_forward(tar, h->size - used)
+                                          : mtar_seek(tar, tar->pos + h->size - used);
+    }
+    if (!err && (fflush(dst) != 0 || ftruncate(fileno(dst), (off_t) h->realsize) != 0)) {
+        err = MTAR_EWRITEFAIL;
+    }
+    return err;
+#else
+    (void) tar;
+    (void) dst;
+    (void) h;
+    return MTAR_EUNSUPPORTED;
+#endif
+}
+
+
+int mtar_extract_file(mtar_t *tar, const char *path) {
+    int err, check_err;
+    mtar_header_t h;
+    FILE *dst;
+    /* Read header, which leaves us at the data */
+    tar->remaining_data = 0;
+    tar->last_header = tar->pos;
+    err = read_entry_header(tar, &h);
+    if (err) {
+        return err;
+    }
+    dst = fopen(path, "wb");
+    if (!dst) {
+        return MTAR_EOPENFAIL;
+    }
+    digest_begin(tar, h.digests, &h);
+    if (h.sparse) {
+        err = extract_sparse(tar, dst, &h);
+    } else {
+        err = copy_from_archive(tar, dst, h.size);
+    }
+    if (fclose(dst) != 0 && !err) {
+        err = MTAR_EWRITEFAIL;
+    }
+    if (err) {
+        return err;
+    }
+    /* A digest mismatch leaves the file in place for the caller to judge */
+    check_err = digest_check(tar);
+    /* Like mtar_read_data, finish back at the entry's header; streams
+     * instead move on to the next one */
+    if (tar->flags & MTAR_FSTREAM) {
+        err = skip_forward(tar, round_up(h.size, 512) - h.size);
+    } else {
+        err = mtar_seek(tar, tar->last_header);
+    }
+    return check_err ? check_err : err;
+}
+
+
+static int skip_forward(mtar_t *tar, uint64_t n) {
+    int err;
+    char discard[4096];
+    if (n == 0) {
+        return MTAR_ESUCCESS;
+    }
+    err = tflush(tar);
+    if (err) {
+        return err;
+    }
+    if (!(tar->flags & MTAR_FSTREAM)) {
+        err = tar->seek(tar, n, SEEK_CUR);
+        tar->pos += n;
+        return err;
+    }
+    /* Streams cannot seek, read through the skipped bytes instead */
+    while (n > 0) {
+        unsigned chunk = n < sizeof(discard) ? (unsigned) n : sizeof(discard);
+        err = tread(tar, discard, chunk);
+        if (err) {
+            return err;
+        }
+        n -= chunk;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+int mtar_cursor_init(mtar_cursor_t *c, mtar_t *tar) {
+    /* The cursor starts at the archive's current position */
+    memset(c, 0, sizeof(*c));
+    c->tar = tar;
+    c->header_pos = tar->pos;
+    c->data_pos = tar->pos;
+    c->next_pos = tar->pos;
+    return MTAR_ESUCCESS;
+}
+
+
+int mtar_cursor_next(mtar_cursor_t *c) {
+    int err;
+    mtar_t *tar = c->tar;
+    /* Skip whatever is left of the current entry's data and padding */
+    if (tar->pos > c->next_pos) {
+        return MTAR_ESEEKFAIL;
+    }
+    err = skip_forward(tar, c->next_pos - tar->pos);
+    if (err) {
+        return err;
+    }
+    /* Read and decode the header, leaving the archive at its data */
+    c->header_pos = tar->pos;
+    err = read_entry_header(tar, &c->header);
+    if (err) {
+        return err;
+    }
+    digest_begin(tar, c->header.digests, &c->header);
+    c->data_pos = tar->pos;
+    c->next_pos = c->data_pos + round_up(c->header.size, 512);
+    return MTAR_ESUCCESS;
+}
+
+
+static int cursor_read(mtar_cursor_t *c, void *ptr, const void **view, unsigned size) {
+    int err;
+    mtar_t *tar = c->tar;
+    uint64_t at = tar->pos;
+    if (tar->pos < c->data_pos || size > c->data_pos + c->header.size - tar->pos) {
+        return MTAR_EREADFAIL;
+    }
+    if (view) {
+        if (!tar->view) {
+            return MTAR_EUNSUPPORTED;
+        }
+        err = tview(tar, view, size);
+    } else {
+        err = tread(tar, ptr, size);
+    }
+    if (err) {
+        return err;
+    }
+    digest_update(tar, view ? *view : ptr, size, at);
+    return digest_check(tar);
+}
+
+
+int mtar_verify(mtar_t *tar, mtar_header_t *bad) {
+    int err;
+    char *buf = NULL;
+    unsigned flags = tar->flags;
+    mtar_cursor_t c;
+    /* One pass over the archive, reading only entries that carry digests */
+    if (!(tar->flags & MTAR_FSTREAM)) {
+        err = mtar_rewind(tar);
+        if (err) {
+            return err;
+        }
+    }
+    if (!tar->view) {
+        buf = malloc(COPY_BUFFER_SIZE);
+        if (!buf) {
+            return MTAR_EFAILURE;
+        }
+    }
+    tar->flags |= MTAR_FDIGESTS;
+    mtar_cursor_init(&c, tar);
+    while ((err = mtar_cursor_next(&c)) == MTAR_ESUCCESS) {
+        uint64_t left = c.header.digests ? c.header.size : 0;
+        while (left > 0 && !err) {
+            const void *data;
+            unsigned chunk = left < COPY_BUFFER_SIZE ? (unsigned) left : COPY_BUFFER_SIZE;
+            err = buf ? mtar_cursor_read(&c, buf, chunk) : mtar_cursor_read_view(&c, &data, chunk);
+            left -= chunk;
+        }
+        if (err) {
+            if (err == MTAR_EBADCHKSUM && bad) {
+                *bad = c.header;
+            }
+            break;
+        }
+    }
+    tar->flags = flags;
+    free(buf);
+    return err == MTAR_ENULLRECORD ? MTAR_ESUCCESS : err;
+}
+
+
+int mtar_cursor_extract(mtar_cursor_t *c, const char *path) {
+    int err, check_err;
+    mtar_t *tar = c->tar;
+    FILE *dst;
+    /* Only a whole entry, straight after mtar_cursor_next() */
+    if (tar->pos != c->data_pos) {
+        return MTAR_EREADFAIL;
+    }
+    dst = fopen(path, "wb");
+    if (!dst) {
+        return MTAR_EOPENFAIL;
+    }
+    if (c->header.sparse) {
+        err = extract_sparse(tar, dst, &c->header);
+    } else {
+        err = copy_from_archive(tar, dst, c->header.size);
+    }
+    if (fclose(dst) != 0 && !err) {
+        err = MTAR_EWRITEFAIL;
+    }
+    if (err) {
+        return err;
+    }
+    check_err = digest_check(tar);
+    /* Kernel copies leave the descriptor behind, and the cursor's next
+     * step seeks relative to it */
+    err = (tar->flags & MTAR_FSTREAM) ? MTAR_ESUCCESS : mtar_seek(tar, tar->pos);
+    return check_err ? check_err : err;
+}
+
+
+int mtar_cursor_read(mtar_cursor_t *c, void *ptr, unsigned size) {
+    return cursor_read(c, ptr, NULL, size);
+}
+
+
+int mtar_cursor_read_view(mtar_cursor_t *c, const void **ptr, unsigned size) {
+    return cursor_read(c, NULL, ptr, size);
+}
+
+
+static unsigned hash_name(const char *name) {
+    /* FNV-1a */
+    unsigned h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+static const mtar_index_entry_t *index_lookup(const mtar_index_t *idx, const char *name, unsigned hash) {
+    unsigned mask, i;
+    if (idx->slot_count == 0) {
+        return NULL;
+    }
+    mask = idx->slot_count - 1;
+    for (i = hash & mask; idx->slots[i] != 0; i = (i + 1) & mask) {
+        const mtar_index_entry_t *e = &idx->entries[idx->slots[i] - 1];
+        if (e->hash == hash && !strcmp(idx->names + e->name, name)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+static int index_grow_slots(mtar_index_t *idx) {
+    unsigned i, j, mask;
+    unsigned count = idx->slot_count ? idx->slot_count * 2 : 64;
+    unsigned *slots = calloc(count, sizeof(*slots));
+    if (!slots) {
+        return MTAR_EFAILURE;
+    }
+    /* Rehash existing entries into the new table */
+    mask = count - 1;
+    for (i = 0; i < idx->slot_count; i++) {
+        if (idx->slots[i] == 0) {
+            continue;
+        }
+        j = idx->entries[idx->slots[i] - 1].hash & mask;
+        while (slots[j] != 0) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = idx->slots[i];
+    }
+    free(idx->slots);
+    idx->slots = slots;
+    idx->slot_count = count;
+    return MTAR_ESUCCESS;
+}
+
+
+static int index_add(mtar_index_t *idx, const mtar_header_t *h, uint64_t offset) {
+    unsigned hash = hash_name(h->name);
+    unsigned len = strlen(h->name) + 1;
+    unsigned mask, i;
+    mtar_index_entry_t *e = (mtar_index_entry_t *) index_lookup(idx, h->name, hash);
+
+    /* Later occurrences of a name replace earlier ones, as they do on
+     * extraction; a deletion record leaves an MTAR_TDELETED entry */
+    if (e) {
+        e->offset = offset;
+        e->size = h->size;
+        e->type = h->type;
+        e->mode = h->mode;
+        e->mtime = h->mtime;
+        return MTAR_ESUCCESS;
+    }
+    /* A new name puts the sorted order out of date */
+    free(idx->order);
+    idx->order = NULL;
+    /* Keep the load factor of the slot table at or below 1/2 */
+    if ((idx->count + 1) * 2 > idx->slot_count) {
+        if (index_grow_slots(idx)) {
+            return MTAR_EFAILURE;
+        }
+    }
+    if (idx->count == idx->capacity) {
+        unsigned capacity = idx->capacity ? idx->capacity * 2 : 32;
+        void *p = realloc(idx->entries, capacity * sizeof(*idx->entries));
+        if (!p) {
+            return MTAR_EFAILURE;
+        }
+        idx->entries = p;
+        idx->capacity = capacity;
+    }
+    if (idx->names_len + len > idx->names_cap) {
+        unsigned cap = idx->names_cap ? idx->names_cap : 1024;
+        void *p;
+        while (idx->names_len + len > cap) {
+            cap *= 2;
+        }
+        p = realloc(idx->names, cap);
+        if (!p) {
+            return MTAR_EFAILURE;
+        }
+        idx->names = p;
+        idx->names_cap = cap;
+    }
+
+    /* Store entry and its name */
+    e = &idx->entries[idx->count];
+    e->offset = offset;
+    e->size = h->size;
+    e->type = h->type;
+    e->mode = h->mode;
+    e->mtime = h->mtime;
+    e->hash = hash;
+    e->name = idx->names_len;
+    memcpy(idx->names + idx->names_len, h->name, len);
+    idx->names_len += len;
+
+    /* Insert into slot table */
+    mask = idx->slot_count - 1;
+    i = hash & mask;
+    while (idx->slots[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    idx->slots[i] = ++idx->count;
+    return MTAR_ESUCCESS;
+}
+
+
+static int index_copy(mtar_index_t *idx, const mtar_index_t *from) {
+    unsigned i;
+    for (i = 0; i < from->count; i++) {
+        const mtar_index_entry_t *e = &from->entries[i];
+        mtar_header_t h;
+        memset(&h, 0, sizeof(h));
+        strcpy(h.name, from->names + e->name);
+        h.size = e->size;
+        h.type = e->type;
+        h.mode = e->mode;
+        h.mtime = e->mtime;
+        if (index_add(idx, &h, e->offset)) {
+            return MTAR_EFAILURE;
+        }
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+int mtar_index_build(mtar_t *tar, mtar_index_t *idx) {
+    int err;
+    mtar_cursor_t c;
+
+    memset(idx, 0, sizeof(*idx));
+    /* Copy a table of contents instead of reading any headers */
+    if (tar->toc) {
+        toc_t *toc = tar->toc;
+        err = index_copy(idx, &toc->index);
+        if (err) {
+            mtar_index_free(idx);
+            return err;
+        }
+        return mtar_rewind(tar);
+    }
+    err = mtar_rewind(tar);
+    if (err) {
+        return err;
+    }
+    /* Single pass over all headers, jumping straight over the data */
+    mtar_cursor_init(&c, tar);
+    while ((err = mtar_cursor_next(&c)) == MTAR_ESUCCESS) {
+        err = index_add(idx, &c.header, c.header_pos);
+        if (err) {
+            break;
+        }
+    }
+    if (err != MTAR_ENULLRECORD) {
+        mtar_index_free(idx);
+        return err;
+    }
+    return mtar_rewind(tar);
+}
+
+
+int mtar_index_find(mtar_t *tar, const mtar_index_t *idx, const char *name, mtar_header_t *h) {
+    int err;
+    const mtar_index_entry_t *e = index_lookup(idx, name, hash_name(name));
+    if (!e || e->type == MTAR_TDELETED) {
+        return MTAR_ENOTFOUND;
+    }
+    /* Position the archive at the entry's header, as mtar_find would */
+    tar->remaining_data = 0;
+    tar->last_header = e->offset;
+    err = mtar_seek(tar, e->offset);
+    if (err) {
+        return err;
+    }
+    if (h) {
+        return mtar_read_header(tar, h);
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+void mtar_index_free(mtar_index_t *idx) {
+    free(idx->entries);
+    free(idx->slots);
+    free(idx->names);
+    free(idx->order);
+    memset(idx, 0, sizeof(*idx));
+}
+
+
+typedef struct {
+    const char *name;
+    unsigned entry;
+} sort_item_t;
+
+
+static int compare_sort_items(const void *a, const void *b) {
+    return strcmp(((const sort_item_t *) a)->name, ((const sort_item_t *) b)->name);
+}
+
+
+static int index_sort(mtar_index_t *idx) {
+    unsigned i;
+    sort_item_t *items;
+    /* Built on the first prefix or glob lookup, kept until a name is added */
+    if (idx->order || idx->count == 0) {
+        return MTAR_ESUCCESS;
+    }
+    items = malloc(idx->count * sizeof(*items));
+    idx->order = malloc(idx->count * sizeof(*idx->order));
+    if (!items || !idx->order) {
+        free(items);
+        free(idx->order);
+        idx->order = NULL;
+        return MTAR_EFAILURE;
+    }
+    for (i = 0; i < idx->count; i++) {
+        items[i].name = idx->names + idx->entries[i].name;
+        items[i].entry = i;
+    }
+    qsort(items, idx->count, sizeof(*items), compare_sort_items);
+    for (i = 0; i < idx->count; i++) {
+        idx->order[i] = items[i].entry;
+    }
+    free(items);
+    return MTAR_ESUCCESS;
+}
+
+
+static int index_match(mtar_t *tar, mtar_index_t *idx, const char *prefix, size_t len, const char *pattern,
+                       mtar_match_fn fn, void *arg) {
+    int err;
+    unsigned lo = 0, hi, found = 0;
+    err = index_sort(idx);
+    if (err) {
+        return err;
+    }
+    /* Names sharing the prefix sit together in name order; binary search
+     * for the first of them */
+    hi = idx->count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (strncmp(idx->names + idx->entries[idx->order[mid]].name, prefix, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < idx->count; lo++) {
+        const mtar_index_entry_t *e = &idx->entries[idx->order[lo]];
+        const char *name = idx->names + e->name;
+        if (strncmp(name, prefix, len) != 0) {
+            break;
+        }
+        if (e->type == MTAR_TDELETED) {
+            continue;
+        }
+#ifdef MTAR_HAVE_MMAP
+        if (pattern && fnmatch(pattern, name, 0) != 0) {
+            continue;
+        }
+#endif
+        found++;
+        err = fn(tar, e, name, arg);
+        if (err) {
+            return err;
+        }
+    }
+    return found ? MTAR_ESUCCESS : MTAR_ENOTFOUND;
+}
+
+
+static int find_matching(mtar_t *tar, mtar_index_t *idx, const char *prefix, size_t len, const char *pattern,
+                         mtar_match_fn fn, void *arg) {
+    int err;
+    mtar_index_t scanned;
+    /* A given index, else the table of contents, else one pass over the
+     * headers for this lookup only */
+    if (idx) {
+        return index_match(tar, idx, prefix, len, pattern, fn, arg);
+    }
+    if (tar->toc) {
+        return index_match(tar, &((toc_t *) tar->toc)->index, prefix, len, pattern, fn, arg);
+    }
+    err = mtar_index_build(tar, &scanned);
+    if (err) {
+        return err;
+    }
+    err = index_match(tar, &scanned, prefix, len, pattern, fn, arg);
+    mtar_index_free(&scanned);
+    return err;
+}
+
+
+int mtar_find_prefix(mtar_t *tar, mtar_index_t *idx, const char *prefix, mtar_match_fn fn, void *arg) {
+    return find_matching(tar, idx, prefix, strlen(prefix), NULL, fn, arg);
+}
+
+
+int mtar_find_glob(mtar_t *tar, mtar_index_t *idx, const char *pattern, mtar_match_fn fn, void *arg) {
+#ifdef MTAR_HAVE_MMAP
+    /* Only names starting with the pattern's literal part are matched */
+    return find_matching(tar, idx, pattern, strcspn(pattern, "*?[\\"), pattern, fn, arg);
+#else
+    (void) tar;
+    (void) idx;
+    (void) pattern;
+    (void) fn;
+    (void) arg;
+    return MTAR_EUNSUPPORTED;
+#endif
+}
+
+
+#define BACKUP_SEEN 1
+#define BACKUP_CRC  2
+
+typedef struct {
+    mtar_t *tar;
+    const mtar_backup_opts_t *opts;
+    mtar_index_t index;
+    unsigned char *state;
+    uint32_t *crc;
+    unsigned capacity;
+} backup_t;
+
+
+static int backup_note(backup_t *b, const mtar_header_t *h, uint64_t offset) {
+    unsigned i;
+    mtar_index_entry_t *e = (mtar_index_entry_t *) index_lookup(&b->index, h->name, hash_name(h->name));
+    /* Later occurrences of a name replace earlier ones */
+    if (!e) {
+        if (index_add(&b->index, h, offset)) {
+            return MTAR_EFAILURE;
+        }
+        if (b->index.capacity > b->capacity) {
+            void *state = realloc(b->state, b->index.capacity);
+            void *crc = state ? realloc(b->crc, b->index.capacity * sizeof(*b->crc)) : NULL;
+            if (state) {
+                b->state = state;
+            }
+            if (!crc) {
+                return MTAR_EFAILURE;
+            }
+            b->crc = crc;
+            b->capacity = b->index.capacity;
+        }
+        e = &b->index.entries[b->index.count - 1];
+    }
+    e->offset = offset;
+    e->size = h->sparse ? h->realsize : h->size;
+    e->type = h->type;
+    e->mode = h->mode;
+    e->mtime = h->mtime;
+    i = (unsigned) (e - b->index.entries);
+    b->state[i] = (h->digests & MTAR_FCRC32C) ? BACKUP_CRC : 0;
+    b->crc[i] = h->crc32c;
+    return MTAR_ESUCCESS;
+}
+
+
+static int backup_scan(backup_t *b, uint64_t end) {
+    int err;
+    mtar_cursor_t c;
+    err = mtar_rewind(b->tar);
+    if (err) {
+        return err;
+    }
+    mtar_cursor_init(&c, b->tar);
+    while (c.next_pos < end && (err = mtar_cursor_next(&c)) == MTAR_ESUCCESS) {
+        err = backup_note(b, &c.header, c.header_pos);
+        if (err) {
+            return err;
+        }
+    }
+    if (err && err != MTAR_ENULLRECORD) {
+        return err;
+    }
+    return mtar_seek(b->tar, end);
+}
+
+
+static int file_crc32c(const char *path, uint32_t *crc) {
+    size_t n;
+    char *buf;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return MTAR_EOPENFAIL;
+    }
+    buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        fclose(f);
+        return MTAR_EFAILURE;
+    }
+    *crc = 0;
+    while ((n = fread(buf, 1, COPY_BUFFER_SIZE, f)) > 0) {
+        *crc = crc32c(*crc, buf, n);
+    }
+    n = (size_t) ferror(f);
+    free(buf);
+    fclose(f);
+    return n ? MTAR_EREADFAIL : MTAR_ESUCCESS;
+}
+
+
+static bool backup_unchanged(backup_t *b, const mtar_index_entry_t *s, const mtar_walk_entry_t *e) {
+    unsigned i = (unsigned) (s - b->index.entries);
+    uint32_t crc;
+    if (s->type != e->type || s->mode != e->mode || s->mtime != e->mtime) {
+        return false;
+    }
+    if (e->type == MTAR_TDIR) {
+        return true;
+    }
+    if (s->size != e->size) {
+        return false;
+    }
+    /* Same size and time; the content is only read when asked to and
+     * there is a digest to hold it against */
+    if (!b->opts || !b->opts->hash || !(b->state[i] & BACKUP_CRC)) {
+        return true;
+    }
+    return file_crc32c(e->path, &crc) == MTAR_ESUCCESS && crc == b->crc[i];
+}
+
+
+static int backup_entry(const mtar_walk_entry_t *e, void *arg) {
+    backup_t *b = arg;
+    const mtar_index_entry_t *s = index_lookup(&b->index, e->name, hash_name(e->name));
+    if (s) {
+        b->state[s - b->index.entries] |= BACKUP_SEEN;
+        if (backup_unchanged(b, s, e)) {
+            return MTAR_ESUCCESS;
+        }
+    }
+    /* New or changed, appended with its own mode and time */
+    if (e->type == MTAR_TDIR) {
+        return write_entry_header(b->tar, e->name, MTAR_TDIR, 0, e->mode, e->mtime);
+    }
+    return write_file(b->tar, e->path, e->name, e->mode, e->mtime);
+}
+
+
+int mtar_backup(mtar_t *tar, const char *root, const mtar_backup_opts_t *opts) {
+    int err;
+    unsigned i, flags = tar->flags;
+    uint64_t end = tar->pos;
+    backup_t b;
+    mtar_walk_opts_t walk;
+
+    if (tar->flags & MTAR_FSTREAM) {
+        return MTAR_EUNSUPPORTED;
+    }
+    memset(&b, 0, sizeof(b));
+    b.tar = tar;
+    b.opts = opts;
+    /* The latest state of every name in the archive so far; a fresh
+     * archive has nothing to compare against */
+    err = end > 0 ? backup_scan(&b, end) : MTAR_ESUCCESS;
+
+    /* Appended files carry a digest for the next backup to compare */
+    if (!err && opts && opts->hash) {
+        tar->flags |= MTAR_FCRC32C;
+    }
+    if (!err) {
+        memset(&walk, 0, sizeof(walk));
+        walk.sorted = opts ? opts->sorted : 0;
+        walk.keep_root = opts ? opts->keep_root : 0;
+        err = mtar_walk(root, &walk, backup_entry, &b);
+    }
+    tar->flags = flags;
+
+    /* Whatever the walk did not see is gone; in reverse, so a directory's
+     * contents go before the directory */
+    for (i = b.index.count; i > 0 && !err; i--) {
+        const mtar_index_entry_t *e = &b.index.entries[i - 1];
+        if (!(b.state[i - 1] & BACKUP_SEEN) && e->type != MTAR_TDELETED) {
+            err = write_deletion(tar, b.index.names + e->name);
+        }
+    }
+    mtar_index_free(&b.index);
+    free(b.state);
+    free(b.crc);
+    return err;
+}
+
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    put_le32(p, (uint32_t) v);
+    put_le32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    return get_le32(p) | (uint64_t) get_le32(p + 4) << 32;
+}
+
+
+static toc_t *toc_get(mtar_t *tar) {
+    if (!tar->toc) {
+        tar->toc = calloc(1, sizeof(toc_t));
+    }
+    return tar->toc;
+}
+
+
+static void toc_free(mtar_t *tar) {
+    toc_t *toc = tar->toc;
+    if (toc) {
+        mtar_index_free(&toc->index);
+        free(toc);
+        tar->toc = NULL;
+    }
+}
+
+
+static uint64_t toc_tail(const mtar_t *tar) {
+    const toc_t *toc = tar->toc;
+    return toc ? toc->tail : 0;
+}
+
+
+static int toc_parse(toc_t *toc, const unsigned char *body, uint32_t count, uint32_t names_len) {
+    uint32_t i;
+    const char *names = (const char *) body + (size_t) count * TOC_RECORD_SIZE;
+    for (i = 0; i < count; i++) {
+        const unsigned char *r = body + (size_t) i * TOC_RECORD_SIZE;
+        uint32_t name = get_le32(r + 24);
+        mtar_header_t h;
+        if (name >= names_len || !memchr(names + name, 0, names_len - name) ||
+            strlen(names + name) >= sizeof(h.name)) {
+            return MTAR_ENOTFOUND;
+        }
+        memset(&h, 0, sizeof(h));
+        strcpy(h.name, names + name);
+        h.size = get_le64(r + 8);
+        h.mtime = get_le32(r + 16);
+        h.mode = get_le32(r + 20);
+        h.type = get_le32(r + 28);
+        if (index_add(&toc->index, &h, get_le64(r))) {
+            return MTAR_EFAILURE;
+        }
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static int toc_load(mtar_t *tar) {
+    /* Anything that does not look like an intact table of contents is left
+     * alone, the archive is then simply read header by header */
+    int err;
+    int64_t size;
+    uint64_t tail, body_len;
+    uint32_t count, names_len;
+    unsigned char footer[TOC_FOOTER_SIZE];
+    unsigned char *body;
+    toc_t *toc;
+
+    if (tar->seek(tar, 0, SEEK_END)) {
+        return MTAR_ESUCCESS;
+    }
+    size = tar->tell(tar);
+    if (size < 3 * 512 + TOC_FOOTER_SIZE ||
+        tar->seek(tar, -TOC_FOOTER_SIZE, SEEK_END) ||
+        tar->read(tar, footer, sizeof(footer)) ||
+        memcmp(footer, TOC_MAGIC, 8) != 0) {
+        return MTAR_ESUCCESS;
+    }
+    tail = get_le64(footer + 8);
+    count = get_le32(footer + 16);
+    names_len = get_le32(footer + 20);
+    body_len = (uint64_t) count * TOC_RECORD_SIZE + names_len;
+    if (tail % 512 != 0 || tail > (uint64_t) size - 3 * 512 ||
+        body_len + TOC_FOOTER_SIZE > tail || body_len > 0xffffffffu) {
+        return MTAR_ESUCCESS;
+    }
+
+    /* One read brings in the whole table */
+    body = malloc(body_len ? body_len : 1);
+    if (!body) {
+        return MTAR_EFAILURE;
+    }
+    if (tar->seek(tar, -(int64_t) tail, SEEK_END) ||
+        tar->read(tar, body, (unsigned) body_len) ||
+        crc32c(0, body, body_len) != get_le32(footer + 24)) {
+        free(body);
+        return MTAR_ESUCCESS;
+    }
+    toc = toc_get(tar);
+    if (!toc) {
+        free(body);
+        return MTAR_EFAILURE;
+    }
+    err = toc_parse(toc, body, count, names_len);
+    free(body);
+    if (err) {
+        toc_free(tar);
+        return err == MTAR_EFAILURE ? err : MTAR_ESUCCESS;
+    }
+    toc->tail = tail;
+    return MTAR_ESUCCESS;
+}
+
+
+static int toc_record(mtar_t *tar, const mtar_header_t *h, uint64_t offset) {
+    /* Writers ask for a table with MTAR_FTOC, appends keep a loaded one
+     * current. It is only found again at the end of a seekable archive */
+    toc_t *toc = tar->toc;
+    if (!toc) {
+        if (!(tar->flags & MTAR_FTOC) || (tar->flags & MTAR_FSTREAM)) {
+            return MTAR_ESUCCESS;
+        }
+        toc = toc_get(tar);
+        if (!toc) {
+            return MTAR_EFAILURE;
+        }
+    }
+    return index_add(&toc->index, h, offset);
+}
+
+
+typedef struct {
+    const char *name;
+    const mtar_index_entry_t *entry;
+} toc_order_t;
+
+static int toc_order_cmp(const void *a, const void *b) {
+    return strcmp(((const toc_order_t *) a)->name, ((const toc_order_t *) b)->name);
+}
+
+
+static int toc_write(mtar_t *tar) {
+    int err = MTAR_ESUCCESS;
+    unsigned i;
+    uint32_t crc = 0, names_len = 0;
+    uint64_t body_len, tail;
+    unsigned char record[TOC_RECORD_SIZE];
+    unsigned char footer[TOC_FOOTER_SIZE];
+    toc_t *toc = tar->toc;
+    const mtar_index_t *idx = &toc->index;
+    toc_order_t *order = NULL;
+
+    /* Records go out sorted by name */
+    if (idx->count) {
+        order = malloc(idx->count * sizeof(*order));
+        if (!order) {
+            return MTAR_EFAILURE;
+        }
+    }
+    for (i = 0; i < idx->count; i++) {
+        order[i].name = idx->names + idx->entries[i].name;
+        order[i].entry = &idx->entries[i];
+    }
+    if (idx->count > 1) {
+        qsort(order, idx->count, sizeof(*order), toc_order_cmp);
+    }
+
+    for (i = 0; i < idx->count && !err; i++) {
+        const mtar_index_entry_t *e = order[i].entry;
+        put_le64(record, e->offset);
+        put_le64(record + 8, e->size);
+        put_le32(record + 16, e->mtime);
+        put_le32(record + 20, e->mode);
+        put_le32(record + 24, names_len);
+        put_le32(record + 28, e->type);
+        crc = crc32c(crc, record, sizeof(record));
+        names_len += strlen(order[i].name) + 1;
+        err = twrite(tar, record, sizeof(record));
+    }
+    for (i = 0; i < idx->count && !err; i++) {
+        unsigned len = strlen(order[i].name) + 1;
+        crc = crc32c(crc, order[i].name, len);
+        err = twrite(tar, order[i].name, len);
+    }
+    free(order);
+    if (err) {
+        return err;
+    }
+
+    /* Pad so the footer ends the last block */
+    body_len = (uint64_t) idx->count * TOC_RECORD_SIZE + names_len;
+    tail = round_up(body_len + TOC_FOOTER_SIZE, 512);
+    err = write_null_bytes(tar, (int) (tail - body_len - TOC_FOOTER_SIZE));
+    if (err) {
+        return err;
+    }
+    memcpy(footer, TOC_MAGIC, 8);
+    put_le64(footer + 8, tail);
+    put_le32(footer + 16, idx->count);
+    put_le32(footer + 20, names_len);
+    put_le32(footer + 24, crc);
+    put_le32(footer + 28, 0);
+    return twrite(tar, footer, sizeof(footer));
 }
@@ -15,9 +15,14 @@ extern "C"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #define MTAR_VERSION "0.1.0"
 
+#ifndef MTAR_DEFAULT_BUFFER_SIZE
+#define MTAR_DEFAULT_BUFFER_SIZE (32 * 512)
+#endif
+
 enum {
   MTAR_ESUCCESS     =  0,
   MTAR_EFAILURE     = -1,
@@ -27,7 +32,31 @@ enum {
   MTAR_ESEEKFAIL    = -5,
   MTAR_EBADCHKSUM   = -6,
   MTAR_ENULLRECORD  = -7,
-  MTAR_ENOTFOUND    = -8
+  MTAR_ENOTFOUND    = -8,
+  MTAR_EUNSUPPORTED = -9,
+  MTAR_EBADNAME     = -10
+};
+
+enum {
+  MTAR_FSTREAM = 1 << 0,
+  MTAR_FPAX    = 1 << 1,
+  MTAR_FCRC32C = 1 << 2,
+  MTAR_FSHA256 = 1 << 3,
+  MTAR_FTOC    = 1 << 4,
+  MTAR_FDEDUP  = 1 << 5,
+  MTAR_FSPARSE = 1 << 6
+};
+
+enum {
+  MTAR_COMPRESS_NONE = 0,
+  MTAR_COMPRESS_GZIP = 1,
+  MTAR_COMPRESS_ZSTD = 2
+};
+
+enum {
+  MTAR_TRACE_READ  = 0,
+  MTAR_TRACE_WRITE = 1,
+  MTAR_TRACE_SEEK  = 2
 };
 
 enum {
@@ -37,52 +66,223 @@ enum {
   MTAR_TCHR   = '3',
   MTAR_TBLK   = '4',
   MTAR_TDIR   = '5',
-  MTAR_TFIFO  = '6'
+  MTAR_TFIFO  = '6',
+  MTAR_TPAX   = 'x',
+  MTAR_TPAXG  = 'g'
+};
+
+/* Reported for names an incremental backup recorded as deleted; never
+ * the type of a raw header */
+enum {
+  MTAR_TDELETED = 0x100
 };
 
 typedef struct {
   unsigned mode;
   unsigned owner;
-  unsigned size;
+  uint64_t size;
   unsigned mtime;
   unsigned type;
   char name[100];
   char linkname[100];
+  unsigned digests;
+  uint32_t crc32c;
+  unsigned char sha256[32];
+  /* Sparse files store a map of their data extents and the extents
+   * themselves, size counts both; realsize is the length of the file */
+  unsigned sparse;
+  uint64_t realsize;
 } mtar_header_t;
 
+/* Checks the digests an entry carries against its payload, for readers
+ * that move the data themselves */
+typedef struct mtar_digest mtar_digest_t;
+
 
 typedef struct mtar_t mtar_t;
 
 struct mtar_t {
   int (*read)(mtar_t *tar, void *data, unsigned size);
   int (*write)(mtar_t *tar, const void *data, unsigned size);
-  int (*seek)(mtar_t *tar, long pos, int mode);
-  long (*tell)(mtar_t *tar);
+  int (*seek)(mtar_t *tar, int64_t pos, int mode);
+  int64_t (*tell)(mtar_t *tar);
   int (*close)(mtar_t *tar);
+  int (*view)(mtar_t *tar, const void **data, unsigned size);
   void *stream;
-  unsigned pos;
-  unsigned remaining_data;
-  unsigned last_header;
+  unsigned flags;
+  uint64_t pos;
+  uint64_t remaining_data;
+  uint64_t last_header;
+  char *buffer;
+  unsigned buffer_size;
+  unsigned buffer_len;
+  void *digest;
+  void *toc;
+  void *stats;
+  void *dedup;
 };
 
 
+typedef struct {
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t seeks;
+  uint64_t headers;
+  uint64_t checksum_failures;
+  uint64_t read_ns;
+  uint64_t write_ns;
+  uint64_t seek_ns;
+} mtar_stats_t;
+
+/* Called after every read, write or seek of the backend; value is the size
+ * in bytes, or the offset for seeks, ns the time the call took */
+typedef void (*mtar_trace_fn)(void *arg, int op, int64_t value, int err, uint64_t ns);
+
+
+typedef struct {
+  mtar_t *tar;
+  mtar_header_t header;
+  uint64_t header_pos;
+  uint64_t data_pos;
+  uint64_t next_pos;
+} mtar_cursor_t;
+
+
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+  unsigned type;
+  unsigned mode;
+  unsigned mtime;
+  unsigned hash;
+  unsigned name;
+} mtar_index_entry_t;
+
+typedef struct {
+  mtar_index_entry_t *entries;
+  unsigned count;
+  unsigned capacity;
+  unsigned *slots;
+  unsigned slot_count;
+  char *names;
+  unsigned names_len;
+  unsigned names_cap;
+  unsigned *order;
+} mtar_index_t;
+
+/* Called for every entry a prefix or glob lookup matches, in name order;
+ * anything but MTAR_ESUCCESS ends the lookup with that result */
+typedef int (*mtar_match_fn)(mtar_t *tar, const mtar_index_entry_t *e, const char *name, void *arg);
+
+
+typedef struct {
+  const char *path;
+  const char *name;
+  unsigned type;
+  unsigned mode;
+  uint64_t size;
+  unsigned mtime;
+} mtar_walk_entry_t;
+
+typedef int (*mtar_walk_fn)(const mtar_walk_entry_t *e, void *arg);
+
+typedef struct {
+  const char *glob;
+  int sorted;
+  int keep_root;
+} mtar_walk_opts_t;
+
+typedef struct {
+  int sorted;
+  int keep_root;
+  int hash;
+} mtar_backup_opts_t;
+
+typedef struct {
+  unsigned compress;
+  int level;
+  unsigned frame_size;
+  unsigned threads;
+} mtar_compress_opts_t;
+
+typedef struct {
+  unsigned threads;
+  unsigned queue_depth;
+} mtar_extract_opts_t;
+
+typedef struct {
+  unsigned threads;
+  unsigned queue_depth;
+} mtar_create_opts_t;
+
+typedef struct {
+  const char *name;
+  const char *path;
+  uint64_t size;
+  unsigned type;
+} mtar_create_entry_t;
+
+
 const char* mtar_strerror(int err);
 
 int mtar_open(mtar_t *tar, const char *filename, const char *mode);
+int mtar_open_mmap(mtar_t *tar, const char *filename);
+int mtar_open_mem(mtar_t *tar, const void *data, size_t size, const char *mode);
+int mtar_mem_data(mtar_t *tar, const void **data, size_t *size);
+int mtar_open_compressed(mtar_t *tar, const char *filename, const char *mode,
+                         const mtar_compress_opts_t *opts);
+int mtar_detect_compression(const char *filename);
+int mtar_open_stream(mtar_t *tar, FILE *stream, const char *mode);
 int mtar_close(mtar_t *tar);
+int mtar_set_buffer(mtar_t *tar, unsigned size);
+int mtar_flush(mtar_t *tar);
+int mtar_stats_enable(mtar_t *tar, mtar_trace_fn trace, void *arg);
+int mtar_stats(const mtar_t *tar, mtar_stats_t *stats);
 
-int mtar_seek(mtar_t *tar, unsigned pos);
+int mtar_seek(mtar_t *tar, uint64_t pos);
 int mtar_rewind(mtar_t *tar);
 int mtar_next(mtar_t *tar);
 int mtar_find(mtar_t *tar, const char *name, mtar_header_t *h);
 int mtar_read_header(mtar_t *tar, mtar_header_t *h);
 int mtar_read_data(mtar_t *tar, void *ptr, unsigned size);
+int mtar_read_data_view(mtar_t *tar, const void **ptr, unsigned size);
+int mtar_decode_headers(const void *data, size_t size, mtar_header_t *h, uint64_t *offsets,
+                        unsigned max, unsigned *count);
 
 int mtar_write_header(mtar_t *tar, const mtar_header_t *h);
-int mtar_write_file_header(mtar_t *tar, const char *name, unsigned size);
+int mtar_write_file_header(mtar_t *tar, const char *name, uint64_t size);
 int mtar_write_dir_header(mtar_t *tar, const char *name);
 int mtar_write_data(mtar_t *tar, const void *data, unsigned size);
+int mtar_write_file(mtar_t *tar, const char *path, const char *name);
+int mtar_extract_file(mtar_t *tar, const char *path);
 int mtar_finalize(mtar_t *tar);
+int mtar_commit(mtar_t *tar);
+
+int mtar_cursor_init(mtar_cursor_t *c, mtar_t *tar);
+int mtar_cursor_next(mtar_cursor_t *c);
+int mtar_cursor_extract(mtar_cursor_t *c, const char *path);
+int mtar_cursor_read(mtar_cursor_t *c, void *ptr, unsigned size);
+int mtar_cursor_read_view(mtar_cursor_t *c, const void **ptr, unsigned size);
+int mtar_verify(mtar_t *tar, mtar_header_t *bad);
+int mtar_digest_begin(mtar_digest_t **d, const mtar_header_t *h);
+void mtar_digest_update(mtar_digest_t *d, const void *data, size_t size);
+int mtar_digest_end(mtar_digest_t *d);
+
+int mtar_index_build(mtar_t *tar, mtar_index_t *idx);
+int mtar_index_find(mtar_t *tar, const mtar_index_t *idx, const char *name, mtar_header_t *h);
+void mtar_index_free(mtar_index_t *idx);
+int mtar_find_prefix(mtar_t *tar, mtar_index_t *idx, const char *prefix, mtar_match_fn fn, void *arg);
+int mtar_find_glob(mtar_t *tar, mtar_index_t *idx, const char *pattern, mtar_match_fn fn, void *arg);
+
+int mtar_walk(const char *root, const mtar_walk_opts_t *opts, mtar_walk_fn fn, void *arg);
+int mtar_write_tree(mtar_t *tar, const char *root, const mtar_walk_opts_t *opts);
+int mtar_backup(mtar_t *tar, const char *root, const mtar_backup_opts_t *opts);
+
+int mtar_extract(const char *filename, const char *dest, const mtar_extract_opts_t *opts);
+int mtar_create(const char *filename, const mtar_create_entry_t *entries, size_t count,
+                const mtar_create_opts_t *opts);
 
 #ifdef __cplusplus
 }
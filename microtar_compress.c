@@ -0,0 +1,1177 @@
+// Copyright (c) 2017-2022, Mudita Sp. z.o.o. All rights reserved.
+// For licensing, see https://github.com/mudita/MuditaOS/LICENSE.md
+
+#define _FILE_OFFSET_BITS 64
+
+#include "microtar.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+/* The codec thread needs pthreads and zlib; builds define MTAR_HAVE_THREADS
+ * and MTAR_HAVE_ZLIB where they have them. Without them archives are
+ * read and written uncompressed only */
+#if (defined(__unix__) || defined(__APPLE__)) && defined(MTAR_HAVE_THREADS) && defined(MTAR_HAVE_ZLIB)
+#define MTAR_HAVE_CODECS
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef MTAR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#endif
+
+#ifdef MTAR_HAVE_CODECS
+
+/* Uncompressed data travels between the tar side and the codec thread in
+ * RING_SLOTS blocks of RING_BLOCK bytes. Seekable archives use one slot per
+ * frame and up to MAX_SLOTS of them, to keep several decoders busy */
+#define RING_SLOTS 4
+#define RING_BLOCK (256 * 1024)
+#define MAX_SLOTS 16
+/* Compressed side of the codec */
+#define CODEC_BUFFER (64 * 1024)
+
+/* Frame table, laid out as in the zstd seekable format: per frame the
+ * compressed and decompressed size, then a frame count, a descriptor byte
+ * and a magic number. gzip archives carry it in the extra field of empty
+ * members at the end, zstd archives in a skippable frame */
+#define SEEKABLE_MAGIC 0x8F92EAB1u
+#define SEEKABLE_CHECKSUM 0x80
+#define SKIPPABLE_MAGIC 0x184D2A5Eu
+#define TABLE_FOOTER 9
+#define GZIP_TABLE_HEADER 16
+#define GZIP_TABLE_TRAILER 10
+/* What fits in one 64 KiB gzip extra field */
+#define GZIP_TABLE_FRAMES 8190
+/* Frames bigger than this are not worth a seekable reader */
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+    uint64_t c_off;
+    uint64_t u_off;
+    uint32_t c_size;
+    uint32_t u_size;
+} frame_t;
+
+typedef struct {
+    char *slot[MAX_SLOTS];
+    size_t len[MAX_SLOTS];
+    unsigned slots;
+    unsigned head;
+    unsigned count;
+    bool done;
+    bool stop;
+    int err;
+    /* Seekable readers: frames are handed out in order, finish in any */
+    size_t head_frame;
+    size_t next_frame;
+    bool ready[MAX_SLOTS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ring_t;
+
+typedef struct {
+    FILE *file;
+    unsigned codec;
+    int level;
+    bool writing;
+    bool seekable;
+    char *io;
+    bool ended;
+    bool eof;
+    z_stream zs;
+#ifdef MTAR_HAVE_ZSTD
+    ZSTD_CCtx *zc;
+    ZSTD_DCtx *zd;
+    ZSTD_inBuffer zin;
+#endif
+    ring_t ring;
+    size_t block;
+    unsigned threads;
+    unsigned running;
+    pthread_t workers[MAX_SLOTS];
+    /* Seekable archives */
+    frame_t *frames;
+    size_t nframes;
+    size_t frames_cap;
+    uint64_t out_bytes;
+    /* Writer: slot being filled */
+    char *fill;
+    size_t fill_len;
+    /* Reader: oldest slot, kept until the next one is needed so that
+     * seeking back within it (as mtar_read_header does) stays cheap */
+    const char *cur;
+    size_t cur_len;
+    size_t cur_off;
+    uint64_t cur_base;
+} ztar_t;
+
+
+static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+
+static void ring_reset(ring_t *r, size_t frame) {
+    r->head = 0;
+    r->count = 0;
+    r->done = false;
+    r->stop = false;
+    r->err = MTAR_ESUCCESS;
+    r->head_frame = frame;
+    r->next_frame = frame;
+    memset(r->ready, 0, sizeof(r->ready));
+}
+
+
+static char *ring_acquire(ring_t *r) {
+    /* Producer: waits for a free slot, NULL once the consumer stopped */
+    char *slot = NULL;
+    pthread_mutex_lock(&r->lock);
+    while (r->count == r->slots && !r->stop) {
+        pthread_cond_wait(&r->changed, &r->lock);
+    }
+    if (!r->stop) {
+        slot = r->slot[(r->head + r->count) % r->slots];
+    }
+    pthread_mutex_unlock(&r->lock);
+    return slot;
+}
+
+
+static void ring_publish(ring_t *r, size_t len) {
+    pthread_mutex_lock(&r->lock);
+    r->len[(r->head + r->count) % r->slots] = len;
+    r->count++;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+static void ring_finish(ring_t *r, int err) {
+    pthread_mutex_lock(&r->lock);
+    r->done = true;
+    if (!r->err) {
+        r->err = err;
+    }
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+static int ring_peek(ring_t *r, const char **data, size_t *len) {
+    /* Consumer: waits for the oldest slot, MTAR_ENOTFOUND at the end */
+    int err = MTAR_ENOTFOUND;
+    pthread_mutex_lock(&r->lock);
+    while (r->count == 0 && !r->done) {
+        pthread_cond_wait(&r->changed, &r->lock);
+    }
+    if (r->count > 0) {
+        *data = r->slot[r->head];
+        *len = r->len[r->head];
+        err = MTAR_ESUCCESS;
+    } else if (r->err) {
+        err = r->err;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return err;
+}
+
+
+static void ring_release(ring_t *r) {
+    pthread_mutex_lock(&r->lock);
+    r->head = (r->head + 1) % r->slots;
+    r->count--;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+static void ring_stop(ring_t *r, int err) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    if (!r->err) {
+        r->err = err;
+    }
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+static int ring_error(ring_t *r) {
+    int err;
+    pthread_mutex_lock(&r->lock);
+    err = r->err;
+    pthread_mutex_unlock(&r->lock);
+    return err;
+}
+
+
+static int codec_init(ztar_t *z) {
+    int level = z->level;
+    switch (z->codec) {
+        case MTAR_COMPRESS_GZIP:
+            if (level == 0) {
+                level = Z_DEFAULT_COMPRESSION;
+            }
+            /* 16 selects the gzip wrapper, 32 detects gzip or zlib */
+            if (z->writing) {
+                return deflateInit2(&z->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK
+                       ? MTAR_ESUCCESS : MTAR_EOPENFAIL;
+            }
+            return inflateInit2(&z->zs, 15 + 32) == Z_OK ? MTAR_ESUCCESS : MTAR_EOPENFAIL;
+#ifdef MTAR_HAVE_ZSTD
+        case MTAR_COMPRESS_ZSTD:
+            if (z->writing) {
+                z->zc = ZSTD_createCCtx();
+                if (!z->zc) {
+                    return MTAR_EOPENFAIL;
+                }
+                if (level != 0) {
+                    ZSTD_CCtx_setParameter(z->zc, ZSTD_c_compressionLevel, level);
+                }
+                return MTAR_ESUCCESS;
+            }
+            z->zd = ZSTD_createDCtx();
+            return z->zd ? MTAR_ESUCCESS : MTAR_EOPENFAIL;
+#endif
+        default:
+            return MTAR_EUNSUPPORTED;
+    }
+}
+
+
+static void codec_end(ztar_t *z) {
+    switch (z->codec) {
+        case MTAR_COMPRESS_GZIP:
+            if (z->writing) {
+                deflateEnd(&z->zs);
+            } else {
+                inflateEnd(&z->zs);
+            }
+            break;
+#ifdef MTAR_HAVE_ZSTD
+        case MTAR_COMPRESS_ZSTD:
+            ZSTD_freeCCtx(z->zc);
+            ZSTD_freeDCtx(z->zd);
+            break;
+#endif
+    }
+}
+
+
+static int codec_next_frame(ztar_t *z) {
+    /* Writer only: the next frame starts a stream of its own */
+    switch (z->codec) {
+        case MTAR_COMPRESS_GZIP:
+            return deflateReset(&z->zs) == Z_OK ? MTAR_ESUCCESS : MTAR_EWRITEFAIL;
+#ifdef MTAR_HAVE_ZSTD
+        case MTAR_COMPRESS_ZSTD:
+            return ZSTD_isError(ZSTD_CCtx_reset(z->zc, ZSTD_reset_session_only))
+                   ? MTAR_EWRITEFAIL : MTAR_ESUCCESS;
+#endif
+    }
+    return MTAR_EUNSUPPORTED;
+}
+
+
+static int codec_restart(ztar_t *z) {
+    /* Reader only: decode again from the first byte */
+    if (fseeko(z->file, 0, SEEK_SET) != 0) {
+        return MTAR_ESEEKFAIL;
+    }
+    z->ended = false;
+    z->eof = false;
+    switch (z->codec) {
+        case MTAR_COMPRESS_GZIP:
+            z->zs.avail_in = 0;
+            return inflateReset(&z->zs) == Z_OK ? MTAR_ESUCCESS : MTAR_EREADFAIL;
+#ifdef MTAR_HAVE_ZSTD
+        case MTAR_COMPRESS_ZSTD:
+            z->zin.pos = z->zin.size = 0;
+            ZSTD_DCtx_reset(z->zd, ZSTD_reset_session_only);
+            return MTAR_ESUCCESS;
+#endif
+    }
+    return MTAR_EUNSUPPORTED;
+}
+
+
+static int gzip_write(ztar_t *z, const char *data, size_t len, bool finish) {
+    z->zs.next_in = (Bytef *) data;
+    z->zs.avail_in = (uInt) len;
+    do {
+        size_t have;
+        z->zs.next_out = (Bytef *) z->io;
+        z->zs.avail_out = CODEC_BUFFER;
+        if (deflate(&z->zs, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+            return MTAR_EWRITEFAIL;
+        }
+        have = CODEC_BUFFER - z->zs.avail_out;
+        if (have && fwrite(z->io, 1, have, z->file) != have) {
+            return MTAR_EWRITEFAIL;
+        }
+        z->out_bytes += have;
+    } while (z->zs.avail_out == 0);
+    return MTAR_ESUCCESS;
+}
+
+
+static int gzip_fill(ztar_t *z, char *data, size_t cap, size_t *len) {
+    while (*len < cap && !z->eof) {
+        int ret;
+        bool member_start = false;
+        if (z->zs.avail_in == 0) {
+            size_t n = fread(z->io, 1, CODEC_BUFFER, z->file);
+            if (n == 0) {
+                /* A truncated stream is an error, a finished one is not */
+                z->eof = true;
+                return (ferror(z->file) || !z->ended) ? MTAR_EREADFAIL : MTAR_ESUCCESS;
+            }
+            z->zs.next_in = (Bytef *) z->io;
+            z->zs.avail_in = (uInt) n;
+        }
+        if (z->ended) {
+            /* Another member follows, as left by `cat a.gz b.gz` */
+            if (inflateReset(&z->zs) != Z_OK) {
+                return MTAR_EREADFAIL;
+            }
+            z->ended = false;
+            member_start = true;
+        }
+        z->zs.next_out = (Bytef *) data + *len;
+        z->zs.avail_out = (uInt) (cap - *len);
+        ret = inflate(&z->zs, Z_NO_FLUSH);
+        *len = cap - z->zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            z->ended = true;
+        } else if (ret != Z_OK) {
+            if (member_start && ret == Z_DATA_ERROR) {
+                /* Padding after the last member, e.g. from tape blocking */
+                z->ended = true;
+                z->eof = true;
+                return MTAR_ESUCCESS;
+            }
+            return MTAR_EREADFAIL;
+        }
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+#ifdef MTAR_HAVE_ZSTD
+static int zstd_write(ztar_t *z, const char *data, size_t len, bool finish) {
+    ZSTD_inBuffer in = {data, len, 0};
+    for (;;) {
+        ZSTD_outBuffer out = {z->io, CODEC_BUFFER, 0};
+        size_t left = ZSTD_compressStream2(z->zc, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(left)) {
+            return MTAR_EWRITEFAIL;
+        }
+        if (out.pos && fwrite(z->io, 1, out.pos, z->file) != out.pos) {
+            return MTAR_EWRITEFAIL;
+        }
+        z->out_bytes += out.pos;
+        if (finish ? left == 0 : in.pos == in.size) {
+            return MTAR_ESUCCESS;
+        }
+    }
+}
+
+
+static int zstd_fill(ztar_t *z, char *data, size_t cap, size_t *len) {
+    while (*len < cap && !z->eof) {
+        ZSTD_outBuffer out = {data, cap, *len};
+        size_t ret;
+        if (z->zin.pos == z->zin.size) {
+            size_t n = fread(z->io, 1, CODEC_BUFFER, z->file);
+            if (n == 0) {
+                z->eof = true;
+                return (ferror(z->file) || !z->ended) ? MTAR_EREADFAIL : MTAR_ESUCCESS;
+            }
+            z->zin.src = z->io;
+            z->zin.size = n;
+            z->zin.pos = 0;
+        }
+        /* Consecutive frames decode as one stream */
+        ret = ZSTD_decompressStream(z->zd, &out, &z->zin);
+        if (ZSTD_isError(ret)) {
+            return MTAR_EREADFAIL;
+        }
+        *len = out.pos;
+        z->ended = ret == 0;
+    }
+    return MTAR_ESUCCESS;
+}
+#endif
+
+
+static int codec_write(ztar_t *z, const char *data, size_t len, bool finish) {
+#ifdef MTAR_HAVE_ZSTD
+    if (z->codec == MTAR_COMPRESS_ZSTD) {
+        return zstd_write(z, data, len, finish);
+    }
+#endif
+    return gzip_write(z, data, len, finish);
+}
+
+
+static int codec_fill(ztar_t *z, char *data, size_t cap, size_t *len) {
+    /* Fills data completely unless the stream ends */
+    *len = 0;
+#ifdef MTAR_HAVE_ZSTD
+    if (z->codec == MTAR_COMPRESS_ZSTD) {
+        return zstd_fill(z, data, cap, len);
+    }
+#endif
+    return gzip_fill(z, data, cap, len);
+}
+
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+}
+
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+static int add_frame(ztar_t *z, uint64_t c_size, size_t u_size) {
+    frame_t *f;
+    if (c_size > UINT32_MAX) {
+        return MTAR_EWRITEFAIL;
+    }
+    if (z->nframes == z->frames_cap) {
+        size_t cap = z->frames_cap ? z->frames_cap * 2 : 64;
+        f = realloc(z->frames, cap * sizeof(*f));
+        if (!f) {
+            return MTAR_EFAILURE;
+        }
+        z->frames = f;
+        z->frames_cap = cap;
+    }
+    f = &z->frames[z->nframes];
+    f->c_off = z->nframes ? f[-1].c_off + f[-1].c_size : 0;
+    f->u_off = z->nframes ? f[-1].u_off + f[-1].u_size : 0;
+    f->c_size = (uint32_t) c_size;
+    f->u_size = (uint32_t) u_size;
+    z->nframes++;
+    return MTAR_ESUCCESS;
+}
+
+
+static unsigned char *table_payload(const ztar_t *z, size_t first, size_t n, size_t *len) {
+    size_t i;
+    unsigned char *p, *t;
+    *len = n * 8 + TABLE_FOOTER;
+    t = p = malloc(*len);
+    if (!t) {
+        return NULL;
+    }
+    for (i = first; i < first + n; i++, p += 8) {
+        put32(p, z->frames[i].c_size);
+        put32(p + 4, z->frames[i].u_size);
+    }
+    put32(p, (uint32_t) n);
+    p[4] = 0;
+    put32(p + 5, SEEKABLE_MAGIC);
+    return t;
+}
+
+
+static int write_table(ztar_t *z) {
+    size_t first = 0;
+    do {
+        size_t n = z->nframes - first, len;
+        unsigned char head[GZIP_TABLE_HEADER] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 255};
+        static const unsigned char tail[GZIP_TABLE_TRAILER] = {3, 0};
+        unsigned char *payload;
+        bool ok;
+#ifdef MTAR_HAVE_ZSTD
+        if (z->codec == MTAR_COMPRESS_ZSTD) {
+            payload = table_payload(z, 0, n, &len);
+            if (!payload) {
+                return MTAR_EFAILURE;
+            }
+            put32(head, SKIPPABLE_MAGIC);
+            put32(head + 4, (uint32_t) len);
+            ok = fwrite(head, 1, 8, z->file) == 8 && fwrite(payload, 1, len, z->file) == len;
+            free(payload);
+            return ok ? MTAR_ESUCCESS : MTAR_EWRITEFAIL;
+        }
+#endif
+        /* An empty gzip member: header with an 'LS' extra field, an empty
+         * final block and a zero CRC and size */
+        if (n > GZIP_TABLE_FRAMES) {
+            n = GZIP_TABLE_FRAMES;
+        }
+        payload = table_payload(z, first, n, &len);
+        if (!payload) {
+            return MTAR_EFAILURE;
+        }
+        head[10] = (unsigned char) (len + 4);
+        head[11] = (unsigned char) ((len + 4) >> 8);
+        head[12] = 'L';
+        head[13] = 'S';
+        head[14] = (unsigned char) len;
+        head[15] = (unsigned char) (len >> 8);
+        ok = fwrite(head, 1, sizeof(head), z->file) == sizeof(head) &&
+             fwrite(payload, 1, len, z->file) == len &&
+             fwrite(tail, 1, sizeof(tail), z->file) == sizeof(tail);
+        free(payload);
+        if (!ok) {
+            return MTAR_EWRITEFAIL;
+        }
+        first += n;
+    } while (first < z->nframes);
+    return MTAR_ESUCCESS;
+}
+
+
+static int read_at(FILE *file, uint64_t off, void *data, size_t len) {
+    return pread(fileno(file), data, len, (off_t) off) == (ssize_t) len ? MTAR_ESUCCESS : MTAR_EREADFAIL;
+}
+
+
+static int load_table(ztar_t *z) {
+    /* Walks table chunks back from the end until their frames account for
+     * everything before them. MTAR_ENOTFOUND for plain streams */
+    unsigned char foot[TABLE_FOOTER + GZIP_TABLE_TRAILER], head[GZIP_TABLE_HEADER];
+    frame_t *frames = NULL;
+    size_t nframes = 0, i;
+    uint64_t end, covered = 0;
+    off_t size;
+    if (fseeko(z->file, 0, SEEK_END) != 0 || (size = ftello(z->file)) < 0) {
+        return MTAR_ESEEKFAIL;
+    }
+    end = (uint64_t) size;
+    for (;;) {
+        size_t n, entry, trailer = z->codec == MTAR_COMPRESS_GZIP ? GZIP_TABLE_TRAILER : 0;
+        size_t header = z->codec == MTAR_COMPRESS_GZIP ? GZIP_TABLE_HEADER : 8;
+        unsigned char *entries;
+        uint64_t start, sum = 0;
+        frame_t *grown;
+        if (end < TABLE_FOOTER + trailer + header ||
+            read_at(z->file, end - TABLE_FOOTER - trailer, foot, TABLE_FOOTER + trailer) ||
+            get32(foot + 5) != SEEKABLE_MAGIC ||
+            (trailer && (foot[TABLE_FOOTER] != 3 || foot[TABLE_FOOTER + 1] != 0))) {
+            break;
+        }
+        n = get32(foot);
+        entry = (foot[4] & SEEKABLE_CHECKSUM) ? 12 : 8;
+        if ((uint64_t) n * entry + TABLE_FOOTER + trailer + header > end) {
+            break;
+        }
+        start = end - n * entry - TABLE_FOOTER - trailer - header;
+        if (read_at(z->file, start, head, header) ||
+            (trailer ? (head[0] != 0x1f || head[1] != 0x8b || head[12] != 'L' || head[13] != 'S')
+                     : get32(head) != SKIPPABLE_MAGIC)) {
+            break;
+        }
+        entries = malloc(n * entry + 1);
+        grown = realloc(frames, (nframes + n + 1) * sizeof(*frames));
+        if (!entries || !grown) {
+            free(entries);
+            break;
+        }
+        frames = grown;
+        if (read_at(z->file, start + header, entries, n * entry)) {
+            free(entries);
+            break;
+        }
+        /* Chunks are met last first */
+        memmove(frames + n, frames, nframes * sizeof(*frames));
+        for (i = 0; i < n; i++) {
+            frames[i].c_size = get32(entries + i * entry);
+            frames[i].u_size = get32(entries + i * entry + 4);
+            sum += frames[i].c_size;
+        }
+        free(entries);
+        nframes += n;
+        covered += sum;
+        end = start;
+        if (covered == end) {
+            break;
+        }
+        if (covered > end) {
+            nframes = 0;
+            break;
+        }
+    }
+    if (nframes == 0 || covered != end) {
+        free(frames);
+        return MTAR_ENOTFOUND;
+    }
+    z->block = 0;
+    for (i = 0; i < nframes; i++) {
+        frames[i].c_off = i ? frames[i - 1].c_off + frames[i - 1].c_size : 0;
+        frames[i].u_off = i ? frames[i - 1].u_off + frames[i - 1].u_size : 0;
+        if (frames[i].u_size > z->block) {
+            z->block = frames[i].u_size;
+        }
+    }
+    if (z->block == 0 || z->block > MAX_FRAME_SIZE) {
+        free(frames);
+        return MTAR_ENOTFOUND;
+    }
+    z->frames = frames;
+    z->nframes = nframes;
+    return MTAR_ESUCCESS;
+}
+
+
+static int decode_frame(ztar_t *z, const frame_t *f, char *out, void *codec, char **in, size_t *in_cap) {
+    if (f->c_size > *in_cap) {
+        char *p = realloc(*in, f->c_size);
+        if (!p) {
+            return MTAR_EFAILURE;
+        }
+        *in = p;
+        *in_cap = f->c_size;
+    }
+    if (read_at(z->file, f->c_off, *in, f->c_size)) {
+        return MTAR_EREADFAIL;
+    }
+#ifdef MTAR_HAVE_ZSTD
+    if (z->codec == MTAR_COMPRESS_ZSTD) {
+        size_t n = ZSTD_decompressDCtx(codec, out, f->u_size, *in, f->c_size);
+        return n == f->u_size ? MTAR_ESUCCESS : MTAR_EREADFAIL;
+    }
+#endif
+    {
+        z_stream *zs = codec;
+        if (inflateReset(zs) != Z_OK) {
+            return MTAR_EREADFAIL;
+        }
+        zs->next_in = (Bytef *) *in;
+        zs->avail_in = f->c_size;
+        zs->next_out = (Bytef *) out;
+        zs->avail_out = f->u_size;
+        return (inflate(zs, Z_FINISH) == Z_STREAM_END && zs->avail_out == 0)
+               ? MTAR_ESUCCESS : MTAR_EREADFAIL;
+    }
+}
+
+
+static void *frames_worker(void *arg) {
+    /* Seekable reader: takes the next frame whose slot is free */
+    ztar_t *z = arg;
+    ring_t *r = &z->ring;
+    char *in = NULL;
+    size_t in_cap = 0;
+    z_stream zs;
+    void *codec = &zs;
+    memset(&zs, 0, sizeof(zs));
+#ifdef MTAR_HAVE_ZSTD
+    if (z->codec == MTAR_COMPRESS_ZSTD) {
+        codec = ZSTD_createDCtx();
+    } else
+#endif
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        codec = NULL;
+    }
+    for (;;) {
+        size_t frame;
+        unsigned slot;
+        int err;
+        pthread_mutex_lock(&r->lock);
+        while (!r->stop && r->next_frame < z->nframes && r->next_frame >= r->head_frame + r->slots) {
+            pthread_cond_wait(&r->changed, &r->lock);
+        }
+        if (r->stop || r->next_frame >= z->nframes || !codec) {
+            if (!codec && !r->err) {
+                r->err = MTAR_EFAILURE;
+                pthread_cond_broadcast(&r->changed);
+            }
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        frame = r->next_frame++;
+        slot = (unsigned) (frame % r->slots);
+        pthread_mutex_unlock(&r->lock);
+
+        err = decode_frame(z, &z->frames[frame], r->slot[slot], codec, &in, &in_cap);
+
+        pthread_mutex_lock(&r->lock);
+        r->len[slot] = z->frames[frame].u_size;
+        r->ready[slot] = true;
+        if (err && !r->err) {
+            r->err = err;
+        }
+        pthread_cond_broadcast(&r->changed);
+        pthread_mutex_unlock(&r->lock);
+    }
+#ifdef MTAR_HAVE_ZSTD
+    if (z->codec == MTAR_COMPRESS_ZSTD) {
+        ZSTD_freeDCtx(codec);
+    } else
+#endif
+    inflateEnd(&zs);
+    free(in);
+    return NULL;
+}
+
+
+static void *compress_worker(void *arg) {
+    ztar_t *z = arg;
+    for (;;) {
+        const char *data;
+        size_t len;
+        int err = ring_peek(&z->ring, &data, &len);
+        if (err == MTAR_ENOTFOUND) {
+            err = z->seekable ? write_table(z) : codec_write(z, NULL, 0, true);
+            if (err) {
+                ring_stop(&z->ring, err);
+            }
+            break;
+        }
+        if (!err && z->seekable) {
+            /* Seekable: every slot becomes an independent frame */
+            uint64_t before = z->out_bytes;
+            err = codec_write(z, data, len, true);
+            if (!err) {
+                err = add_frame(z, z->out_bytes - before, len);
+            }
+            if (!err) {
+                err = codec_next_frame(z);
+            }
+        } else if (!err) {
+            err = codec_write(z, data, len, false);
+        }
+        if (err) {
+            ring_stop(&z->ring, err);
+            break;
+        }
+        ring_release(&z->ring);
+    }
+    return NULL;
+}
+
+
+static void *decompress_worker(void *arg) {
+    ztar_t *z = arg;
+    for (;;) {
+        size_t len;
+        int err;
+        char *slot = ring_acquire(&z->ring);
+        if (!slot) {
+            break;
+        }
+        err = codec_fill(z, slot, z->block, &len);
+        if (!err && len > 0) {
+            ring_publish(&z->ring, len);
+        }
+        if (err || len < z->block) {
+            ring_finish(&z->ring, err);
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+static int ztar_start(ztar_t *z, size_t frame) {
+    void *(*worker)(void *) = z->writing ? compress_worker : z->nframes ? frames_worker : decompress_worker;
+    unsigned threads = z->nframes && !z->writing ? z->threads : 1;
+    ring_reset(&z->ring, frame);
+    for (z->running = 0; z->running < threads; z->running++) {
+        if (pthread_create(&z->workers[z->running], NULL, worker, z) != 0) {
+            break;
+        }
+    }
+    return z->running ? MTAR_ESUCCESS : MTAR_EOPENFAIL;
+}
+
+
+static void ztar_join(ztar_t *z) {
+    while (z->running) {
+        pthread_join(z->workers[--z->running], NULL);
+    }
+}
+
+
+static void ztar_free(ztar_t *z) {
+    unsigned i;
+    codec_end(z);
+    for (i = 0; i < MAX_SLOTS; i++) {
+        free(z->ring.slot[i]);
+    }
+    free(z->frames);
+    pthread_mutex_destroy(&z->ring.lock);
+    pthread_cond_destroy(&z->ring.changed);
+    free(z->io);
+    free(z);
+}
+
+
+static int ztar_write(mtar_t *tar, const void *data, unsigned size) {
+    ztar_t *z = tar->stream;
+    const char *p = data;
+    if (!z->writing) {
+        return MTAR_EWRITEFAIL;
+    }
+    while (size > 0) {
+        size_t n;
+        if (!z->fill) {
+            z->fill = ring_acquire(&z->ring);
+            z->fill_len = 0;
+            if (!z->fill) {
+                return MTAR_EWRITEFAIL;
+            }
+        }
+        n = z->block - z->fill_len;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(z->fill + z->fill_len, p, n);
+        z->fill_len += n;
+        p += n;
+        size -= n;
+        if (z->fill_len == z->block) {
+            ring_publish(&z->ring, z->fill_len);
+            z->fill = NULL;
+        }
+    }
+    return ring_error(&z->ring) ? MTAR_EWRITEFAIL : MTAR_ESUCCESS;
+}
+
+
+static int frames_next_slot(ztar_t *z) {
+    ring_t *r = &z->ring;
+    int err = MTAR_ESUCCESS;
+    pthread_mutex_lock(&r->lock);
+    while (!z->cur || z->cur_off == z->cur_len) {
+        unsigned slot;
+        if (z->cur) {
+            r->ready[r->head_frame % r->slots] = false;
+            r->head_frame++;
+            z->cur_base += z->cur_len;
+            z->cur = NULL;
+            pthread_cond_broadcast(&r->changed);
+        }
+        if (r->head_frame >= z->nframes) {
+            err = MTAR_EREADFAIL;
+            break;
+        }
+        slot = (unsigned) (r->head_frame % r->slots);
+        while (!r->ready[slot] && !r->err) {
+            pthread_cond_wait(&r->changed, &r->lock);
+        }
+        if (r->err) {
+            err = r->err;
+            break;
+        }
+        z->cur = r->slot[slot];
+        z->cur_len = r->len[slot];
+        z->cur_off = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return err;
+}
+
+
+static int ztar_next_slot(ztar_t *z) {
+    /* Makes cur a slot with unread data in it */
+    if (z->nframes && !z->writing) {
+        return frames_next_slot(z);
+    }
+    while (!z->cur || z->cur_off == z->cur_len) {
+        int err;
+        if (z->cur) {
+            ring_release(&z->ring);
+            z->cur_base += z->cur_len;
+            z->cur = NULL;
+        }
+        err = ring_peek(&z->ring, &z->cur, &z->cur_len);
+        if (err) {
+            z->cur = NULL;
+            return MTAR_EREADFAIL;
+        }
+        z->cur_off = 0;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static int ztar_read(mtar_t *tar, void *data, unsigned size) {
+    ztar_t *z = tar->stream;
+    char *p = data;
+    if (z->writing) {
+        return MTAR_EREADFAIL;
+    }
+    while (size > 0) {
+        size_t n;
+        int err = ztar_next_slot(z);
+        if (err) {
+            return err;
+        }
+        n = z->cur_len - z->cur_off;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(p, z->cur + z->cur_off, n);
+        z->cur_off += n;
+        p += n;
+        size -= n;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static int64_t ztar_tell(mtar_t *tar) {
+    ztar_t *z = tar->stream;
+    if (z->writing) {
+        return (int64_t) tar->pos;
+    }
+    return (int64_t) (z->cur_base + (z->cur ? z->cur_off : 0));
+}
+
+
+static int ztar_seek(mtar_t *tar, int64_t offset, int mode) {
+    ztar_t *z = tar->stream;
+    int64_t pos = ztar_tell(tar);
+    uint64_t target;
+    if (mode == SEEK_CUR) {
+        offset += pos;
+    } else if (mode != SEEK_SET) {
+        return MTAR_ESEEKFAIL;
+    }
+    if (offset < 0) {
+        return MTAR_ESEEKFAIL;
+    }
+    target = (uint64_t) offset;
+    if (z->writing) {
+        /* Output is a stream, only the current position can be sought */
+        return target == (uint64_t) pos ? MTAR_ESUCCESS : MTAR_ESEEKFAIL;
+    }
+    if (z->nframes) {
+        /* Seekable: anything outside the frames in flight restarts the
+         * decoders at the frame holding the target */
+        size_t lo = 0, hi = z->nframes - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi + 1) / 2;
+            if (z->frames[mid].u_off <= target) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        if (lo < z->ring.head_frame || lo >= z->ring.head_frame + z->ring.slots) {
+            int err;
+            ring_stop(&z->ring, MTAR_ESUCCESS);
+            ztar_join(z);
+            z->cur = NULL;
+            z->cur_base = z->frames[lo].u_off;
+            err = ztar_start(z, lo);
+            if (err) {
+                return err;
+            }
+        }
+    } else if (target < z->cur_base) {
+        /* Behind anything still buffered: decode again from the start */
+        int err;
+        ring_stop(&z->ring, MTAR_ESUCCESS);
+        ztar_join(z);
+        z->cur = NULL;
+        z->cur_base = 0;
+        err = codec_restart(z);
+        if (!err) {
+            err = ztar_start(z, 0);
+        }
+        if (err) {
+            return err;
+        }
+    }
+    /* Forward by decoding and dropping whole slots */
+    for (;;) {
+        int err;
+        if (z->cur && target <= z->cur_base + z->cur_len) {
+            z->cur_off = (size_t) (target - z->cur_base);
+            return MTAR_ESUCCESS;
+        }
+        if (z->cur) {
+            z->cur_off = z->cur_len;
+        }
+        err = ztar_next_slot(z);
+        if (err) {
+            return MTAR_ESEEKFAIL;
+        }
+    }
+}
+
+
+static int ztar_close(mtar_t *tar) {
+    ztar_t *z = tar->stream;
+    int err = MTAR_ESUCCESS;
+    if (z->writing) {
+        if (z->fill && z->fill_len) {
+            ring_publish(&z->ring, z->fill_len);
+        }
+        ring_finish(&z->ring, MTAR_ESUCCESS);
+        ztar_join(z);
+        err = z->ring.err;
+    } else {
+        ring_stop(&z->ring, MTAR_ESUCCESS);
+        ztar_join(z);
+    }
+    if (fclose(z->file) != 0 && z->writing && !err) {
+        err = MTAR_EWRITEFAIL;
+    }
+    ztar_free(z);
+    return err;
+}
+
+
+static unsigned detect(FILE *file) {
+    unsigned char magic[4];
+    size_t n = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+    if (n >= sizeof(gzip_magic) && !memcmp(magic, gzip_magic, sizeof(gzip_magic))) {
+        return MTAR_COMPRESS_GZIP;
+    }
+    if (n >= sizeof(zstd_magic) && !memcmp(magic, zstd_magic, sizeof(zstd_magic))) {
+        return MTAR_COMPRESS_ZSTD;
+    }
+    return MTAR_COMPRESS_NONE;
+}
+
+#endif
+
+
+int mtar_detect_compression(const char *filename) {
+#ifdef MTAR_HAVE_CODECS
+    unsigned codec;
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return MTAR_EOPENFAIL;
+    }
+    codec = detect(file);
+    fclose(file);
+    return (int) codec;
+#else
+    (void) filename;
+    return MTAR_COMPRESS_NONE;
+#endif
+}
+
+
+int mtar_open_compressed(mtar_t *tar, const char *filename, const char *mode,
+                         const mtar_compress_opts_t *opts) {
+#ifdef MTAR_HAVE_CODECS
+    int err;
+    unsigned i;
+    mtar_header_t h;
+    ztar_t *z;
+    unsigned codec = opts ? opts->compress : MTAR_COMPRESS_NONE;
+
+    if (*mode == 'r') {
+        codec = MTAR_COMPRESS_NONE;
+        err = mtar_detect_compression(filename);
+        if (err < 0) {
+            return err;
+        }
+        codec = (unsigned) err;
+    }
+    if (*mode == 'a') {
+        /* What the file already holds counts, whatever the options say */
+        err = mtar_detect_compression(filename);
+        if (err > 0) {
+            codec = (unsigned) err;
+        }
+    }
+    if (codec == MTAR_COMPRESS_NONE) {
+        return mtar_open(tar, filename, mode);
+    }
+    if (*mode == 'a') {
+        /* Appending would mean recompressing everything before the trailer */
+        return MTAR_EUNSUPPORTED;
+    }
+#ifndef MTAR_HAVE_ZSTD
+    if (codec == MTAR_COMPRESS_ZSTD) {
+        return MTAR_EUNSUPPORTED;
+    }
+#endif
+
+    memset(tar, 0, sizeof(*tar));
+    z = calloc(1, sizeof(*z));
+    if (!z) {
+        return MTAR_EOPENFAIL;
+    }
+    pthread_mutex_init(&z->ring.lock, NULL);
+    pthread_cond_init(&z->ring.changed, NULL);
+    z->codec = codec;
+    z->level = opts ? opts->level : 0;
+    z->writing = *mode != 'r';
+    z->block = RING_BLOCK;
+    z->ring.slots = RING_SLOTS;
+    z->file = fopen(filename, z->writing ? "wb" : "rb");
+    if (!z->file) {
+        ztar_free(z);
+        return MTAR_EOPENFAIL;
+    }
+    if (z->writing && opts && opts->frame_size) {
+        /* One frame per slot, so frames hold whole records */
+        z->seekable = true;
+        z->block = opts->frame_size < MAX_FRAME_SIZE ? opts->frame_size : MAX_FRAME_SIZE;
+        z->block = (z->block + 511) / 512 * 512;
+    } else if (!z->writing && load_table(z) == MTAR_ESUCCESS) {
+        z->seekable = true;
+        z->threads = (opts && opts->threads) ? opts->threads : 1;
+        if (z->threads > MAX_SLOTS / 2) {
+            z->threads = MAX_SLOTS / 2;
+        }
+        if (z->ring.slots < 2 * z->threads) {
+            z->ring.slots = 2 * z->threads;
+        }
+    }
+    rewind(z->file);
+    z->io = malloc(CODEC_BUFFER);
+    for (i = 0; i < z->ring.slots; i++) {
+        z->ring.slot[i] = malloc(z->block);
+        if (!z->ring.slot[i]) {
+            break;
+        }
+    }
+    if (!z->io || i < z->ring.slots) {
+        fclose(z->file);
+        ztar_free(z);
+        return MTAR_EOPENFAIL;
+    }
+    err = codec_init(z);
+    if (!err) {
+        err = ztar_start(z, 0);
+    }
+    if (err) {
+        fclose(z->file);
+        ztar_free(z);
+        return err;
+    }
+
+    tar->write = ztar_write;
+    tar->read = ztar_read;
+    tar->seek = ztar_seek;
+    tar->tell = ztar_tell;
+    tar->close = ztar_close;
+    tar->stream = z;
+    if (z->writing) {
+        /* Forward-only output, nothing written can be revisited */
+        tar->flags = MTAR_FSTREAM;
+        return MTAR_ESUCCESS;
+    }
+    /* The trailer check of mtar_open() would decode the whole archive */
+    err = mtar_read_header(tar, &h);
+    if (err) {
+        mtar_close(tar);
+        return err;
+    }
+    return mtar_seek(tar, 0);
+#else
+    return (opts && opts->compress != MTAR_COMPRESS_NONE) ? MTAR_EUNSUPPORTED
+                                                          : mtar_open(tar, filename, mode);
+#endif
+}
@@ -0,0 +1,1166 @@
+// Copyright (c) 2017-2022, Mudita Sp. z.o.o. All rights reserved.
+// For licensing, see https://github.com/mudita/MuditaOS/LICENSE.md
+
+#define _FILE_OFFSET_BITS 64
+
+#include "microtar.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+/* Builds define MTAR_HAVE_THREADS where pthreads are available */
+#if defined(MTAR_HAVE_THREADS) && !(defined(__unix__) || defined(__APPLE__))
+#undef MTAR_HAVE_THREADS
+#endif
+
+#ifdef MTAR_HAVE_THREADS
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MTAR_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#ifdef MTAR_HAVE_THREADS
+
+/* Per-worker copy buffer, and the size of one queued transfer */
+#define COPY_CHUNK_SIZE (256 * 1024)
+
+/* Upper bound on transfers kept in flight through io_uring */
+#define MAX_QUEUE_DEPTH 256
+
+typedef struct {
+    size_t next;
+    size_t count;
+    int err;
+    pthread_mutex_t lock;
+} pool_t;
+
+typedef struct {
+    char *path;
+    char *link;
+    uint64_t header_pos;
+    uint64_t data_pos;
+    uint64_t size;
+    unsigned mode;
+    unsigned type;
+    unsigned digests;
+    uint32_t crc32c;
+    unsigned char sha256[32];
+    bool sparse;
+    bool skip;
+} extract_entry_t;
+
+typedef struct {
+    pool_t pool;
+    extract_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    int fd;
+} extract_job_t;
+
+typedef struct {
+    pool_t pool;
+    const mtar_create_entry_t *entries;
+    uint64_t *data_pos;
+    int fd;
+} create_job_t;
+
+
+static bool pool_take(pool_t *pool, size_t *i) {
+    /* Hands out the next work item, or nothing once an item failed */
+    bool ok;
+    pthread_mutex_lock(&pool->lock);
+    ok = !pool->err && pool->next < pool->count;
+    if (ok) {
+        *i = pool->next++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+
+static void pool_fail(pool_t *pool, int err) {
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->err) {
+        pool->err = err;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+static int pool_run(pool_t *pool, unsigned threads, void *(*worker)(void *), void *job) {
+    unsigned i, started = 0;
+    pthread_t *tids = NULL;
+    if (threads > 1) {
+        tids = malloc(threads * sizeof(*tids));
+    }
+    for (i = 0; tids && i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, worker, job) != 0) {
+            break;
+        }
+        started++;
+    }
+    /* Single-threaded runs, or no thread could be started: work here */
+    if (started == 0) {
+        worker(job);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    return pool->err;
+}
+
+
+#ifdef MTAR_HAVE_URING
+
+/* Payload copies through io_uring: many chunk reads and writes in flight
+ * from one thread. The ring is driven with raw system calls, there is no
+ * liburing dependency */
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned to_submit;
+} uring_t;
+
+typedef struct {
+    int in;
+    int out;
+    uint64_t in_off;
+    uint64_t out_off;
+    uint64_t size;
+    uint64_t next;
+    unsigned pending;
+    mtar_digest_t *digest;
+    bool used;
+} uring_file_t;
+
+typedef struct {
+    char *buf;
+    struct iovec iov;
+    uring_file_t *file;
+    uint64_t off;
+    size_t len;
+    size_t done;
+    bool writing;
+} uring_slot_t;
+
+/* Opens both sides of item i; returns 1 for items without payload */
+typedef int (*uring_open_fn)(void *job, size_t i, uring_file_t *f);
+typedef int (*uring_close_fn)(void *job, uring_file_t *f);
+
+
+static int uring_setup(uring_t *r, unsigned depth) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = (int) syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0) {
+        /* Old kernel, or io_uring disabled by policy */
+        return MTAR_EUNSUPPORTED;
+    }
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = r->sq_ptr;
+    if (r->sq_ptr != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if (r->sqes != MAP_FAILED) {
+            munmap(r->sqes, r->sqes_len);
+        }
+        if (r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+            munmap(r->cq_ptr, r->cq_len);
+        }
+        if (r->sq_ptr != MAP_FAILED) {
+            munmap(r->sq_ptr, r->sq_len);
+        }
+        close(r->fd);
+        return MTAR_EUNSUPPORTED;
+    }
+    r->sq_head = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+    return MTAR_ESUCCESS;
+}
+
+
+static void uring_free(uring_t *r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+
+static void uring_queue(uring_t *r, uring_slot_t *slot) {
+    /* (Re)queues the slot's transfer; only this thread produces entries */
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    uring_file_t *f = slot->file;
+    memset(sqe, 0, sizeof(*sqe));
+    slot->iov.iov_base = slot->buf + slot->done;
+    slot->iov.iov_len = slot->len - slot->done;
+    if (slot->writing) {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = f->out;
+        sqe->off = f->out_off + slot->off + slot->done;
+    } else {
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = f->in;
+        sqe->off = f->in_off + slot->off + slot->done;
+    }
+    sqe->addr = (uint64_t) (uintptr_t) &slot->iov;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t) (uintptr_t) slot;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+}
+
+
+static int uring_wait(uring_t *r) {
+    /* Submits whatever is queued and waits for at least one completion */
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0) {
+            r->to_submit -= (unsigned) n;
+            return MTAR_ESUCCESS;
+        }
+        if (errno != EINTR) {
+            return MTAR_EFAILURE;
+        }
+    }
+}
+
+
+static void uring_cancel(uring_t *r, uring_slot_t *slot) {
+    /* Queues a cancel of the slot's transfer; the cancel completes too,
+     * with a user_data of 0 */
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) slot;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+}
+
+
+static int uring_drain(uring_t *r, uring_slot_t *slots, unsigned depth) {
+    /* After a failed wait: takes back the entries the kernel never
+     * consumed, cancels the rest and reaps every completion, so nothing
+     * in flight still points into the buffers. Busy slots have a file */
+    unsigned i, pending = 0;
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail;
+    for (; head != tail; head++) {
+        struct io_uring_sqe *sqe = &r->sqes[r->sq_array[head & *r->sq_mask]];
+        ((uring_slot_t *) (uintptr_t) sqe->user_data)->file = NULL;
+    }
+    __atomic_store_n(r->sq_tail, *r->sq_head, __ATOMIC_RELEASE);
+    r->to_submit = 0;
+    for (i = 0; i < depth; i++) {
+        if (slots[i].file) {
+            uring_cancel(r, &slots[i]);
+            pending += 2;
+        }
+    }
+    while (pending > 0) {
+        if (uring_wait(r)) {
+            return MTAR_EFAILURE;
+        }
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            uring_slot_t *slot = (uring_slot_t *) (uintptr_t) r->cqes[head & *r->cq_mask].user_data;
+            if (slot) {
+                slot->file = NULL;
+            }
+            pending--;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static uring_file_t *uring_ready_file(uring_file_t *files, unsigned count) {
+    /* A file with digests whose last chunk is in, and which has more */
+    unsigned i;
+    for (i = 0; i < count; i++) {
+        if (files[i].used && files[i].digest && files[i].pending == 0 && files[i].next < files[i].size) {
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+
+static uring_file_t *uring_take_file(uring_file_t *files, unsigned count) {
+    unsigned i;
+    for (i = 0; i < count; i++) {
+        if (!files[i].used) {
+            memset(&files[i], 0, sizeof(files[i]));
+            files[i].used = true;
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+
+static int uring_copy(unsigned depth, size_t count, uring_open_fn open_item, uring_close_fn close_item,
+                      void *job) {
+    int err = MTAR_ESUCCESS, res;
+    unsigned i, inflight = 0, nfree = 0;
+    size_t item = 0;
+    uring_t r;
+    uring_slot_t *slots, **free_slots;
+    uring_file_t *files, *cur = NULL;
+    char *bufs;
+
+    if (depth > MAX_QUEUE_DEPTH) {
+        depth = MAX_QUEUE_DEPTH;
+    }
+    err = uring_setup(&r, depth);
+    if (err) {
+        return err;
+    }
+    /* One buffer per slot; a file is open while it has chunks in flight,
+     * plus the one currently being split into chunks */
+    slots = calloc(depth, sizeof(*slots));
+    free_slots = malloc(depth * sizeof(*free_slots));
+    files = calloc(depth + 1, sizeof(*files));
+    bufs = malloc((size_t) depth * COPY_CHUNK_SIZE);
+    if (!slots || !free_slots || !files || !bufs) {
+        err = MTAR_EFAILURE;
+        goto done;
+    }
+    for (i = 0; i < depth; i++) {
+        slots[i].buf = bufs + (size_t) i * COPY_CHUNK_SIZE;
+        free_slots[nfree++] = &slots[i];
+    }
+
+    for (;;) {
+        /* Hand out chunks until every slot is busy. Files with digests
+         * are hashed as their chunks come in, so they have one chunk in
+         * flight at a time while other files go on */
+        while (!err && nfree > 0) {
+            uring_slot_t *slot;
+            uring_file_t *f = cur ? cur : uring_ready_file(files, depth + 1);
+            if (!f) {
+                if (item == count) {
+                    break;
+                }
+                f = uring_take_file(files, depth + 1);
+                if (!f) {
+                    break;
+                }
+                res = open_item(job, item++, f);
+                if (res != MTAR_ESUCCESS || f->size == 0) {
+                    if (res == MTAR_ESUCCESS) {
+                        res = close_item(job, f);
+                    }
+                    err = res < 0 ? res : MTAR_ESUCCESS;
+                    f->used = false;
+                    continue;
+                }
+            }
+            slot = free_slots[--nfree];
+            slot->file = f;
+            slot->off = f->next;
+            slot->len = f->size - f->next < COPY_CHUNK_SIZE ? (size_t) (f->size - f->next)
+                                                             : COPY_CHUNK_SIZE;
+            slot->done = 0;
+            slot->writing = false;
+            f->next += slot->len;
+            f->pending++;
+            cur = (f->next == f->size || f->digest) ? NULL : f;
+            uring_queue(&r, slot);
+            inflight++;
+        }
+        if (inflight == 0) {
+            break;
+        }
+        if (uring_wait(&r)) {
+            /* Once the ring is drained the caller redoes the copy through
+             * the thread pool. If it cannot be drained, transfers may still
+             * be in flight, so their buffers are leaked rather than freed */
+            if (uring_drain(&r, slots, depth) != MTAR_ESUCCESS) {
+                err = MTAR_EFAILURE;
+                bufs = NULL;
+                slots = NULL;
+            } else if (!err) {
+                err = MTAR_EUNSUPPORTED;
+            }
+            break;
+        }
+
+        /* Reap completions: reads turn into writes, finished writes free
+         * their slot and close the file after its last chunk */
+        unsigned head = *r.cq_head;
+        unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+            uring_slot_t *slot = (uring_slot_t *) (uintptr_t) cqe->user_data;
+            uring_file_t *f = slot->file;
+            res = cqe->res;
+            if (res == -EINTR || res == -EAGAIN) {
+                uring_queue(&r, slot);
+                continue;
+            }
+            if (res <= 0 && !err) {
+                /* A zero-length read means the source ended early */
+                err = slot->writing ? MTAR_EWRITEFAIL : MTAR_EREADFAIL;
+            }
+            if (res > 0 && !err) {
+                slot->done += (size_t) res;
+                if (slot->done < slot->len) {
+                    uring_queue(&r, slot);
+                    continue;
+                }
+                if (!slot->writing) {
+                    mtar_digest_update(f->digest, slot->buf, slot->len);
+                    slot->writing = true;
+                    slot->done = 0;
+                    uring_queue(&r, slot);
+                    continue;
+                }
+            }
+            /* The chunk is done, or abandoned after an error */
+            inflight--;
+            slot->file = NULL;
+            free_slots[nfree++] = slot;
+            if (--f->pending == 0 && f->next == f->size) {
+                res = close_item(job, f);
+                if (res && !err) {
+                    err = res;
+                }
+                f->used = false;
+            }
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+    /* Files left part way by an error or a failed wait */
+    for (i = 0; i <= depth; i++) {
+        if (files[i].used) {
+            close_item(job, &files[i]);
+        }
+    }
+
+    done:
+    uring_free(&r);
+    free(bufs);
+    free(files);
+    free(free_slots);
+    free(slots);
+    return err;
+}
+
+#endif
+
+
+static int make_dirs(char *path, bool last) {
+    /* mkdir -p; the final component is only created when `last` is set */
+    char *p;
+    for (p = path + 1; *p; p++) {
+        if (*p != '/') {
+            continue;
+        }
+        *p = '\0';
+        if (mkdir(path, 0775) != 0 && errno != EEXIST) {
+            *p = '/';
+            return MTAR_EWRITEFAIL;
+        }
+        *p = '/';
+    }
+    if (last && mkdir(path, 0775) != 0 && errno != EEXIST) {
+        return MTAR_EWRITEFAIL;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static bool safe_name(const char *name) {
+    /* Names must stay below the destination: no absolute paths, no ".." */
+    const char *p = name;
+    if (*name == '/') {
+        return false;
+    }
+    while (*p) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return false;
+        }
+        p += len;
+        p += *p == '/';
+    }
+    return true;
+}
+
+
+static char *join_path(const char *dest, const char *name) {
+    size_t dest_len = strlen(dest), name_len;
+    char *path;
+    if (!strncmp(name, "./", 2)) {
+        name += 2;
+    }
+    name_len = strlen(name);
+    path = malloc(dest_len + name_len + 2);
+    if (!path) {
+        return NULL;
+    }
+    memcpy(path, dest, dest_len);
+    path[dest_len] = '/';
+    memcpy(path + dest_len + 1, name, name_len + 1);
+    return path;
+}
+
+
+static int add_entry(extract_job_t *job, const char *dest, const mtar_cursor_t *c) {
+    extract_entry_t *e;
+    if (job->count == job->capacity) {
+        size_t capacity = job->capacity ? job->capacity * 2 : 64;
+        void *p = realloc(job->entries, capacity * sizeof(*job->entries));
+        if (!p) {
+            return MTAR_EFAILURE;
+        }
+        job->entries = p;
+        job->capacity = capacity;
+    }
+    if (!safe_name(c->header.name)) {
+        return MTAR_EBADNAME;
+    }
+    e = &job->entries[job->count];
+    e->path = join_path(dest, c->header.name);
+    if (!e->path) {
+        return MTAR_EFAILURE;
+    }
+    e->link = NULL;
+    if (c->header.type == MTAR_TLNK) {
+        if (!safe_name(c->header.linkname)) {
+            free(e->path);
+            return MTAR_EBADNAME;
+        }
+        e->link = join_path(dest, c->header.linkname);
+        if (!e->link) {
+            free(e->path);
+            return MTAR_EFAILURE;
+        }
+    }
+    e->header_pos = c->header_pos;
+    e->data_pos = c->data_pos;
+    e->size = c->header.size;
+    e->mode = c->header.mode;
+    e->type = c->header.type;
+    e->digests = c->header.digests;
+    e->crc32c = c->header.crc32c;
+    memcpy(e->sha256, c->header.sha256, sizeof(e->sha256));
+    e->sparse = c->header.sparse != 0;
+    e->skip = false;
+    job->count++;
+    return MTAR_ESUCCESS;
+}
+
+
+static int scan_archive(extract_job_t *job, const char *filename, const char *dest) {
+    int err;
+    mtar_t tar;
+    mtar_cursor_t c;
+    err = mtar_open(&tar, filename, "r");
+    if (err) {
+        return err;
+    }
+    mtar_cursor_init(&c, &tar);
+    while ((err = mtar_cursor_next(&c)) == MTAR_ESUCCESS) {
+        if (c.header.type != MTAR_TREG && c.header.type != MTAR_TDIR && c.header.type != MTAR_TLNK &&
+            c.header.type != MTAR_TDELETED) {
+            continue;
+        }
+        err = add_entry(job, dest, &c);
+        if (err) {
+            break;
+        }
+    }
+    mtar_close(&tar);
+    return err == MTAR_ENULLRECORD ? MTAR_ESUCCESS : err;
+}
+
+
+static int compare_entries(const void *a, const void *b) {
+    const extract_entry_t *x = *(extract_entry_t *const *) a;
+    const extract_entry_t *y = *(extract_entry_t *const *) b;
+    int res = strcmp(x->path, y->path);
+    /* Equal paths keep archive order */
+    return res ? res : (x < y ? -1 : 1);
+}
+
+
+static int skip_duplicates(extract_job_t *job) {
+    /* Files are written concurrently, so when a path occurs more than once
+     * only its last occurrence is extracted, as a sequential unpack would */
+    size_t i;
+    extract_entry_t **sorted = malloc(job->count * sizeof(*sorted));
+    if (!sorted) {
+        return MTAR_EFAILURE;
+    }
+    for (i = 0; i < job->count; i++) {
+        sorted[i] = &job->entries[i];
+    }
+    qsort(sorted, job->count, sizeof(*sorted), compare_entries);
+    for (i = 0; i + 1 < job->count; i++) {
+        if (!strcmp(sorted[i]->path, sorted[i + 1]->path)) {
+            sorted[i]->skip = true;
+        }
+    }
+    free(sorted);
+    return MTAR_ESUCCESS;
+}
+
+
+static int create_dirs(extract_job_t *job) {
+    int err;
+    size_t i;
+    for (i = 0; i < job->count; i++) {
+        extract_entry_t *e = &job->entries[i];
+        if (e->skip) {
+            continue;
+        }
+        /* A name deleted by an incremental backup, and not added back
+         * since, is removed from the destination if it is there */
+        if (e->type == MTAR_TDELETED) {
+            if (remove(e->path) != 0 && errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST) {
+                return MTAR_EWRITEFAIL;
+            }
+            continue;
+        }
+        err = make_dirs(e->path, e->type == MTAR_TDIR);
+        if (err) {
+            return err;
+        }
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static int extract_sparse_files(extract_job_t *job, const char *filename) {
+    int err = MTAR_ESUCCESS;
+    size_t i;
+    mtar_t tar;
+    bool opened = false;
+    /* Sparse files take the sequential path, which seeks over their holes */
+    for (i = 0; i < job->count && !err; i++) {
+        extract_entry_t *e = &job->entries[i];
+        unsigned mode = e->mode & 07777;
+        if (!e->sparse || e->skip) {
+            continue;
+        }
+        if (!opened) {
+            err = mtar_open(&tar, filename, "r");
+            if (err) {
+                return err;
+            }
+            opened = true;
+        }
+        err = mtar_seek(&tar, e->header_pos);
+        if (!err) {
+            err = mtar_extract_file(&tar, e->path);
+        }
+        if (!err && chmod(e->path, mode ? mode : 0664) != 0) {
+            err = MTAR_EWRITEFAIL;
+        }
+    }
+    if (opened) {
+        mtar_close(&tar);
+    }
+    return err;
+}
+
+
+static int compare_paths(const void *key, const void *elem) {
+    return strcmp(key, (*(extract_entry_t *const *) elem)->path);
+}
+
+
+static const extract_entry_t *link_source(extract_entry_t **sorted, size_t count, const extract_entry_t *e) {
+    /* The copy of the link's target that came last before the link itself */
+    extract_entry_t **at = bsearch(e->link, sorted, count, sizeof(*sorted), compare_paths);
+    const extract_entry_t *found = NULL;
+    if (!at) {
+        return NULL;
+    }
+    while (at > sorted && !strcmp(at[-1]->path, e->link)) {
+        at--;
+    }
+    for (; at < sorted + count && !strcmp((*at)->path, e->link) && *at < e; at++) {
+        found = *at;
+    }
+    return found;
+}
+
+
+static int make_links(extract_job_t *job, const char *filename) {
+    int err = MTAR_ESUCCESS;
+    size_t i, hops;
+    mtar_t tar;
+    bool opened = false;
+    extract_entry_t **sorted = malloc((job->count ? job->count : 1) * sizeof(*sorted));
+    if (!sorted) {
+        return MTAR_EFAILURE;
+    }
+    for (i = 0; i < job->count; i++) {
+        sorted[i] = &job->entries[i];
+    }
+    qsort(sorted, job->count, sizeof(*sorted), compare_entries);
+    /* Hard links go last, once the files they point at are complete. A
+     * link stands for its target as it was at the link's place in the
+     * archive, which may since have been rewritten or deleted */
+    for (i = 0; i < job->count && !err; i++) {
+        extract_entry_t *e = &job->entries[i];
+        const extract_entry_t *src = e;
+        if (e->type != MTAR_TLNK || e->skip) {
+            continue;
+        }
+        for (hops = 0; src && src->type == MTAR_TLNK && hops < job->count; hops++) {
+            src = link_source(sorted, job->count, src);
+        }
+        if (!src || src->type == MTAR_TLNK || src->type == MTAR_TDELETED) {
+            err = MTAR_ENOTFOUND;
+            break;
+        }
+        if (unlink(e->path) != 0 && errno != ENOENT) {
+            err = MTAR_EWRITEFAIL;
+            break;
+        }
+        if (!src->skip) {
+            /* The target is extracted as it was, link to it */
+            if (link(src->path, e->path) != 0) {
+                err = MTAR_EWRITEFAIL;
+            }
+            continue;
+        }
+        /* Otherwise the link gets the earlier copy's data of its own */
+        if (!opened) {
+            err = mtar_open(&tar, filename, "r");
+            if (err) {
+                break;
+            }
+            tar.flags |= MTAR_FCRC32C | MTAR_FSHA256;
+            opened = true;
+        }
+        err = mtar_seek(&tar, src->header_pos);
+        if (!err) {
+            err = mtar_extract_file(&tar, e->path);
+        }
+        if (!err && chmod(e->path, (src->mode & 07777) ? (src->mode & 07777) : 0664) != 0) {
+            err = MTAR_EWRITEFAIL;
+        }
+    }
+    if (opened) {
+        mtar_close(&tar);
+    }
+    free(sorted);
+    return err;
+}
+
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return MTAR_EWRITEFAIL;
+        }
+        data += n;
+        size -= (size_t) n;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static int digest_begin(mtar_digest_t **d, const extract_entry_t *e) {
+    mtar_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.digests = e->digests;
+    h.crc32c = e->crc32c;
+    memcpy(h.sha256, e->sha256, sizeof(h.sha256));
+    return mtar_digest_begin(d, &h);
+}
+
+
+static int extract_file(int archive, const extract_entry_t *e, char *buf) {
+    int err, check_err, fd;
+    uint64_t done = 0;
+    unsigned mode = e->mode & 07777;
+    mtar_digest_t *digest;
+    /* Recorded digests are checked in the same pass that copies the data */
+    err = digest_begin(&digest, e);
+    if (err) {
+        return err;
+    }
+    fd = open(e->path, O_WRONLY | O_CREAT | O_TRUNC, mode ? mode : 0664);
+    if (fd < 0) {
+        mtar_digest_end(digest);
+        return MTAR_EOPENFAIL;
+    }
+    while (done < e->size) {
+        size_t chunk = e->size - done < COPY_CHUNK_SIZE ? (size_t) (e->size - done) : COPY_CHUNK_SIZE;
+        ssize_t n = pread(archive, buf, chunk, (off_t) (e->data_pos + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            err = MTAR_EREADFAIL;
+            break;
+        }
+        mtar_digest_update(digest, buf, (size_t) n);
+        err = write_all(fd, buf, (size_t) n);
+        if (err) {
+            break;
+        }
+        done += (uint64_t) n;
+    }
+    if (close(fd) != 0 && !err) {
+        err = MTAR_EWRITEFAIL;
+    }
+    /* A mismatch leaves the file in place, like mtar_extract_file */
+    check_err = mtar_digest_end(digest);
+    return err ? err : check_err;
+}
+
+
+static void *extract_worker(void *arg) {
+    extract_job_t *job = arg;
+    char *buf = malloc(COPY_CHUNK_SIZE);
+    int err;
+    size_t i;
+    if (!buf) {
+        pool_fail(&job->pool, MTAR_EFAILURE);
+        return NULL;
+    }
+    while (pool_take(&job->pool, &i)) {
+        if (job->entries[i].type != MTAR_TREG || job->entries[i].sparse || job->entries[i].skip) {
+            continue;
+        }
+        err = extract_file(job->fd, &job->entries[i], buf);
+        if (err) {
+            pool_fail(&job->pool, err);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+
+static int fill_payload(int archive, const mtar_create_entry_t *e, uint64_t data_pos, char *buf) {
+    int err = MTAR_ESUCCESS, fd;
+    uint64_t done = 0;
+    fd = open(e->path, O_RDONLY);
+    if (fd < 0) {
+        return MTAR_EOPENFAIL;
+    }
+    while (done < e->size) {
+        size_t chunk = e->size - done < COPY_CHUNK_SIZE ? (size_t) (e->size - done) : COPY_CHUNK_SIZE;
+        ssize_t n = read(fd, buf, chunk);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        /* The file shrank since its size was taken */
+        if (n <= 0) {
+            err = MTAR_EREADFAIL;
+            break;
+        }
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = pwrite(archive, buf + off, (size_t) (n - off), (off_t) (data_pos + done));
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                err = MTAR_EWRITEFAIL;
+                break;
+            }
+            off += w;
+            done += (uint64_t) w;
+        }
+        if (err) {
+            break;
+        }
+    }
+    close(fd);
+    return err;
+}
+
+
+static void *create_worker(void *arg) {
+    create_job_t *job = arg;
+    char *buf = malloc(COPY_CHUNK_SIZE);
+    int err;
+    size_t i;
+    if (!buf) {
+        pool_fail(&job->pool, MTAR_EFAILURE);
+        return NULL;
+    }
+    while (pool_take(&job->pool, &i)) {
+        if (job->entries[i].type == MTAR_TDIR || job->entries[i].size == 0) {
+            continue;
+        }
+        err = fill_payload(job->fd, &job->entries[i], job->data_pos[i], buf);
+        if (err) {
+            pool_fail(&job->pool, err);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+
+#ifdef MTAR_HAVE_URING
+static int extract_open(void *arg, size_t i, uring_file_t *f) {
+    extract_job_t *job = arg;
+    const extract_entry_t *e = &job->entries[i];
+    unsigned mode = e->mode & 07777;
+    if (e->type != MTAR_TREG || e->sparse || e->skip) {
+        return 1;
+    }
+    if (digest_begin(&f->digest, e) != MTAR_ESUCCESS) {
+        return MTAR_EFAILURE;
+    }
+    f->out = open(e->path, O_WRONLY | O_CREAT | O_TRUNC, mode ? mode : 0664);
+    if (f->out < 0) {
+        mtar_digest_end(f->digest);
+        return MTAR_EOPENFAIL;
+    }
+    f->in = job->fd;
+    f->in_off = e->data_pos;
+    f->size = e->size;
+    return MTAR_ESUCCESS;
+}
+
+
+static int extract_close(void *arg, uring_file_t *f) {
+    int err = close(f->out) != 0 ? MTAR_EWRITEFAIL : MTAR_ESUCCESS;
+    int check_err = mtar_digest_end(f->digest);
+    (void) arg;
+    f->digest = NULL;
+    return err ? err : check_err;
+}
+
+
+static int create_open(void *arg, size_t i, uring_file_t *f) {
+    create_job_t *job = arg;
+    const mtar_create_entry_t *e = &job->entries[i];
+    if (e->type == MTAR_TDIR || e->size == 0) {
+        return 1;
+    }
+    f->in = open(e->path, O_RDONLY);
+    if (f->in < 0) {
+        return MTAR_EOPENFAIL;
+    }
+    f->out = job->fd;
+    f->out_off = job->data_pos[i];
+    f->size = e->size;
+    return MTAR_ESUCCESS;
+}
+
+
+static int create_close(void *arg, uring_file_t *f) {
+    (void) arg;
+    close(f->in);
+    return MTAR_ESUCCESS;
+}
+#endif
+
+
+static int write_layout(const char *filename, const mtar_create_entry_t *entries, size_t count,
+                        uint64_t *data_pos) {
+    /* Writes every header and the trailer, leaving each payload as a hole
+     * of its padded size; holes read back as the zero padding would */
+    int err = MTAR_ESUCCESS;
+    size_t i;
+    mtar_t tar;
+    err = mtar_open(&tar, filename, "w");
+    if (err) {
+        return err;
+    }
+    for (i = 0; i < count && !err; i++) {
+        const mtar_create_entry_t *e = &entries[i];
+        if (strlen(e->name) >= sizeof(((mtar_header_t *) 0)->name)) {
+            err = MTAR_EFAILURE;
+        } else if (e->type == MTAR_TDIR) {
+            err = mtar_write_dir_header(&tar, e->name);
+        } else {
+            err = mtar_write_file_header(&tar, e->name, e->size);
+        }
+        data_pos[i] = tar.pos;
+        if (!err && e->type != MTAR_TDIR && e->size > 0) {
+            tar.remaining_data = 0;
+            err = mtar_seek(&tar, tar.pos + (e->size + 511) / 512 * 512);
+        }
+    }
+    if (!err) {
+        err = mtar_finalize(&tar);
+    }
+    if (mtar_close(&tar) && !err) {
+        err = MTAR_EWRITEFAIL;
+    }
+    return err;
+}
+
+#endif
+
+
+int mtar_extract(const char *filename, const char *dest, const mtar_extract_opts_t *opts) {
+#ifdef MTAR_HAVE_THREADS
+    int err;
+    size_t i;
+    extract_job_t job;
+    unsigned threads = opts ? opts->threads : 1;
+    unsigned depth = opts ? opts->queue_depth : 0;
+
+    memset(&job, 0, sizeof(job));
+    job.fd = -1;
+    pthread_mutex_init(&job.pool.lock, NULL);
+
+    /* One pass over the headers, then directories, then file payloads */
+    err = scan_archive(&job, filename, dest);
+    if (!err) {
+        err = skip_duplicates(&job);
+    }
+    if (!err) {
+        err = create_dirs(&job);
+    }
+    if (!err) {
+        job.fd = open(filename, O_RDONLY);
+        job.pool.count = job.count;
+        err = job.fd < 0 ? MTAR_EOPENFAIL : MTAR_EUNSUPPORTED;
+#ifdef MTAR_HAVE_URING
+        if (err == MTAR_EUNSUPPORTED && depth > 0) {
+            err = uring_copy(depth, job.count, extract_open, extract_close, &job);
+        }
+#endif
+        /* Without io_uring, payloads go through the thread pool */
+        if (err == MTAR_EUNSUPPORTED) {
+            err = pool_run(&job.pool, threads, extract_worker, &job);
+        }
+    }
+    if (!err) {
+        err = extract_sparse_files(&job, filename);
+    }
+    if (!err) {
+        err = make_links(&job, filename);
+    }
+
+    if (job.fd >= 0) {
+        close(job.fd);
+    }
+    for (i = 0; i < job.count; i++) {
+        free(job.entries[i].path);
+        free(job.entries[i].link);
+    }
+    free(job.entries);
+    pthread_mutex_destroy(&job.pool.lock);
+    return err;
+#else
+    (void) filename;
+    (void) dest;
+    (void) opts;
+    return MTAR_EUNSUPPORTED;
+#endif
+}
+
+
+int mtar_create(const char *filename, const mtar_create_entry_t *entries, size_t count,
+                const mtar_create_opts_t *opts) {
+#ifdef MTAR_HAVE_THREADS
+    int err;
+    create_job_t job;
+    unsigned threads = opts ? opts->threads : 1;
+    unsigned depth = opts ? opts->queue_depth : 0;
+
+    memset(&job, 0, sizeof(job));
+    job.entries = entries;
+    job.fd = -1;
+    job.data_pos = malloc((count ? count : 1) * sizeof(*job.data_pos));
+    if (!job.data_pos) {
+        return MTAR_EFAILURE;
+    }
+    pthread_mutex_init(&job.pool.lock, NULL);
+
+    /* Headers are laid out first, payloads then go to known offsets */
+    err = write_layout(filename, entries, count, job.data_pos);
+    if (!err) {
+        job.fd = open(filename, O_WRONLY);
+        job.pool.count = count;
+        err = job.fd < 0 ? MTAR_EOPENFAIL : MTAR_EUNSUPPORTED;
+#ifdef MTAR_HAVE_URING
+        if (err == MTAR_EUNSUPPORTED && depth > 0) {
+            err = uring_copy(depth, count, create_open, create_close, &job);
+        }
+#endif
+        if (err == MTAR_EUNSUPPORTED) {
+            err = pool_run(&job.pool, threads, create_worker, &job);
+        }
+    }
+    if (job.fd >= 0 && close(job.fd) != 0 && !err) {
+        err = MTAR_EWRITEFAIL;
+    }
+
+    free(job.data_pos);
+    pthread_mutex_destroy(&job.pool.lock);
+    return err;
+#else
+    (void) filename;
+    (void) entries;
+    (void) count;
+    (void) opts;
+    return MTAR_EUNSUPPORTED;
+#endif
+}
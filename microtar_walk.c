@@ -0,0 +1,235 @@
+// Copyright (c) 2017-2022, Mudita Sp. z.o.o. All rights reserved.
+// For licensing, see https://github.com/mudita/MuditaOS/LICENSE.md
+
+#define _FILE_OFFSET_BITS 64
+
+#include "microtar.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MTAR_HAVE_WALK
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef MTAR_HAVE_WALK
+
+typedef struct {
+    const mtar_walk_opts_t *opts;
+    mtar_walk_fn fn;
+    void *arg;
+    char *path;
+    size_t path_len;
+    size_t path_cap;
+    size_t name_off;
+} walker_t;
+
+/* A directory on the path being walked, to spot symlinks leading back up */
+typedef struct walk_dir_id {
+    dev_t dev;
+    ino_t ino;
+    const struct walk_dir_id *up;
+} walk_dir_id_t;
+
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+
+static int push_name(walker_t *w, const char *name) {
+    size_t len = strlen(name);
+    if (w->path_len + len + 2 > w->path_cap) {
+        size_t cap = w->path_cap * 2;
+        char *p;
+        while (w->path_len + len + 2 > cap) {
+            cap *= 2;
+        }
+        p = realloc(w->path, cap);
+        if (!p) {
+            return MTAR_EFAILURE;
+        }
+        w->path = p;
+        w->path_cap = cap;
+    }
+    w->path[w->path_len++] = '/';
+    memcpy(w->path + w->path_len, name, len + 1);
+    w->path_len += len;
+    return MTAR_ESUCCESS;
+}
+
+
+static void pop_name(walker_t *w, size_t len) {
+    w->path_len = len;
+    w->path[len] = '\0';
+}
+
+
+static int read_names(DIR *dir, char ***names, size_t *count) {
+    /* Reads the whole directory up front, so it can be sorted */
+    size_t cap = 0;
+    struct dirent *de;
+    *names = NULL;
+    *count = 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if (*count == cap) {
+            void *p;
+            cap = cap ? cap * 2 : 32;
+            p = realloc(*names, cap * sizeof(**names));
+            if (!p) {
+                return MTAR_EFAILURE;
+            }
+            *names = p;
+        }
+        (*names)[*count] = strdup(de->d_name);
+        if (!(*names)[*count]) {
+            return MTAR_EFAILURE;
+        }
+        (*count)++;
+    }
+    return MTAR_ESUCCESS;
+}
+
+
+static bool on_path(const walk_dir_id_t *id, const struct stat *st) {
+    for (; id; id = id->up) {
+        if (id->dev == st->st_dev && id->ino == st->st_ino) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static int walk_dir(walker_t *w, int fd, const walk_dir_id_t *up) {
+    int err;
+    size_t i, count = 0, len = w->path_len;
+    char **names = NULL;
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return MTAR_EOPENFAIL;
+    }
+    err = read_names(dir, &names, &count);
+    if (!err && count > 1 && w->opts && w->opts->sorted) {
+        qsort(names, count, sizeof(*names), compare_names);
+    }
+    for (i = 0; i < count && !err; i++) {
+        struct stat st;
+        mtar_walk_entry_t e;
+        /* Follows symlinks, like lfs.attributes. Links leading nowhere are
+         * skipped, as are FIFOs, sockets and devices, which have no
+         * contents to store and could block when opened */
+        if (fstatat(dirfd(dir), names[i], &st, 0) != 0) {
+            if ((errno == ENOENT || errno == ELOOP) &&
+                fstatat(dirfd(dir), names[i], &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode)) {
+                continue;
+            }
+            err = MTAR_EREADFAIL;
+            break;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        err = push_name(w, names[i]);
+        if (err) {
+            break;
+        }
+        e.path = w->path;
+        e.name = w->path + w->name_off;
+        e.type = S_ISDIR(st.st_mode) ? MTAR_TDIR : MTAR_TREG;
+        e.mode = st.st_mode & 07777;
+        e.size = S_ISDIR(st.st_mode) ? 0 : (uint64_t) st.st_size;
+        e.mtime = (unsigned) st.st_mtime;
+        /* The pattern only filters what is reported, never the descent */
+        if (!w->opts || !w->opts->glob || fnmatch(w->opts->glob, e.name, 0) == 0) {
+            err = w->fn(&e, w->arg);
+        }
+        /* A directory already on the path is reached through a symlink
+         * loop; it is reported, but not descended into again */
+        if (!err && S_ISDIR(st.st_mode) && !on_path(up, &st)) {
+            walk_dir_id_t id = { st.st_dev, st.st_ino, up };
+            int child = openat(dirfd(dir), names[i], O_RDONLY | O_DIRECTORY);
+            err = child < 0 ? MTAR_EOPENFAIL : walk_dir(w, child, &id);
+        }
+        pop_name(w, len);
+    }
+    for (i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    closedir(dir);
+    return err;
+}
+
+
+static int write_walk_entry(const mtar_walk_entry_t *e, void *arg) {
+    mtar_t *tar = arg;
+    if (e->type == MTAR_TDIR) {
+        return mtar_write_dir_header(tar, e->name);
+    }
+    return mtar_write_file(tar, e->path, e->name);
+}
+
+#endif
+
+
+int mtar_walk(const char *root, const mtar_walk_opts_t *opts, mtar_walk_fn fn, void *arg) {
+#ifdef MTAR_HAVE_WALK
+    int err, fd;
+    walker_t w;
+    struct stat st;
+    size_t len = strlen(root);
+    /* Names are relative to the root, which is kept without a trailing
+     * slash so that paths come out as root/name */
+    while (len > 1 && root[len - 1] == '/') {
+        len--;
+    }
+    memset(&w, 0, sizeof(w));
+    w.opts = opts;
+    w.fn = fn;
+    w.arg = arg;
+    w.path_cap = len + 256;
+    w.path = malloc(w.path_cap);
+    if (!w.path) {
+        return MTAR_EFAILURE;
+    }
+    memcpy(w.path, root, len);
+    w.path[len] = '\0';
+    w.path_len = len;
+    w.name_off = (opts && opts->keep_root) ? 0 : len + 1;
+
+    fd = open(w.path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        err = MTAR_EOPENFAIL;
+    } else if (fstat(fd, &st) != 0) {
+        close(fd);
+        err = MTAR_EREADFAIL;
+    } else {
+        walk_dir_id_t id = { st.st_dev, st.st_ino, NULL };
+        err = walk_dir(&w, fd, &id);
+    }
+    free(w.path);
+    return err;
+#else
+    return MTAR_EUNSUPPORTED;
+#endif
+}
+
+
+int mtar_write_tree(mtar_t *tar, const char *root, const mtar_walk_opts_t *opts) {
+#ifdef MTAR_HAVE_WALK
+    return mtar_walk(root, opts, write_walk_entry, tar);
+#else
+    return MTAR_EUNSUPPORTED;
+#endif
+}
@@ -22,6 +22,12 @@ function capture(cmd, raw)
     return s
 end
 
+local function write_file(path, data)
+    local f = io.open(path, "wb")
+    f:write(data)
+    f:close()
+end
+
 --- Test case: Unpack sample.tar and then pack the content. Compare it with the original sample and its content.
 
 os.execute("mkdir sample")
@@ -37,9 +43,302 @@ assert(sample_file_size == test_file_size, string.format("size: %u, should be: %
 --Compare the contents of original directory and the generated one after up-packing. They should be identical.
 assert(capture("diff -qrN sample/lua lua") == '', "Directories content is not identical")
 
+--- Test case: Pack the same content using several threads. The result must be byte-identical to the sequential one.
+
+tar.create_from_path("lua", "test_parallel.tar", { threads = 4 })
+assert(capture("cmp test.tar test_parallel.tar") == '', "Parallel archive differs from the sequential one")
+os.remove("test_parallel.tar")
+
+--- Test case: Pack and unpack with io_uring, and with the thread pool it falls back to. Both must give the same output.
+
+tar.create_from_path("lua", "test_uring.tar", { queue_depth = 8 })
+tar.create_from_path("lua", "test_pooled.tar", { queue_depth = 0, threads = 2 })
+assert(capture("cmp test.tar test_uring.tar") == '', "Archive written through io_uring differs from the sequential one")
+assert(capture("cmp test.tar test_pooled.tar") == '', "Archive written by the fallback differs from the sequential one")
+os.remove("test_uring.tar")
+os.remove("test_pooled.tar")
+tar.unpack("test.tar", "uring", { queue_depth = 8 })
+tar.unpack("test.tar", "pooled", { queue_depth = 0, threads = 2 })
+assert(capture("diff -qrN lua uring") == '', "Unpacking through io_uring differs from the original")
+assert(capture("diff -qrN uring pooled") == '', "Unpacking through io_uring differs from the fallback")
+delete_dir("uring")
+delete_dir("pooled")
+
+--- Test case: Pack the same content into a string. It must match the archive written to disk.
+
+local microtar = require("lmicrotar")
+local writer = microtar.open_string()
+writer:add_tree("lua")
+local archive = writer:close()
+local fd = io.open("test.tar", "rb")
+assert(archive == fd:read("*a"), "In-memory archive differs from the one on disk")
+fd:close()
+local reader = microtar.open_string(archive)
+assert(reader:read_header(), "In-memory archive cannot be read back")
+reader:close()
+
+--- Test case: Write the same content through a pipe, then read it back through another. Pipes cannot seek.
+
+local pipe = io.popen("cat > test_stream.tar", "w")
+writer = microtar.open_stream(pipe, "w")
+writer:add_tree("lua")
+writer:close()
+pipe:close()
+assert(capture("cmp test.tar test_stream.tar") == '', "Archive written to a pipe differs from the one on disk")
+os.remove("test_stream.tar")
+
+pipe = io.popen("cat test.tar", "r")
+reader = microtar.open_stream(pipe, "r")
+local streamed = 0
+for header in reader:entries() do
+    streamed = streamed + 1
+    if header.type == microtar.TREG and header.size > 0 then
+        fd = io.open("lua/" .. header.name, "rb")
+        assert(reader:read_data(header.size) == fd:read("*a"), "Data read from a pipe differs from the file")
+        fd:close()
+    end
+end
+reader:close()
+pipe:close()
+assert(streamed == select(2, tar.list("test.tar")), "Entries read from a pipe differ from the archive")
+
+--- Test case: Read past malformed extended headers. Bad records must be ignored, not read beyond.
+
+local function ustar_header(name, size, typeflag, linkname)
+    linkname = linkname or ""
+    local h = name .. string.rep("\0", 100 - #name) .. "0000644\0" .. "0000000\0" .. "0000000\0"
+        .. string.format("%011o\0", size) .. "00000000000\0" .. "        " .. typeflag
+    h = h .. linkname .. string.rep("\0", 100 - #linkname) .. "ustar\0" .. "00"
+    h = h .. string.rep("\0", 512 - #h)
+    local sum = 0
+    for i = 1, #h do
+        sum = sum + h:byte(i)
+    end
+    return h:sub(1, 148) .. string.format("%06o\0 ", sum) .. h:sub(157)
+end
+
+for _, record in ipairs({ "1 x", "2 =", "3 \n", "4 a=", "30 path=short\n" }) do
+    local malformed = ustar_header("pax", #record, "x") .. record .. string.rep("\0", 512 - #record)
+        .. ustar_header("after", 0, "0") .. string.rep("\0", 1024)
+    reader = microtar.open_string(malformed)
+    local header = reader:read_header()
+    assert(header and header.name == "after" and header.size == 0, "Malformed extended header broke the next entry")
+    reader:close()
+end
+
+--- Test case: Sizes past the 8 GiB octal limit. Headers must carry them as base-256 and as PAX records.
+
+local huge = 0x200000000
+writer = microtar.open_string()
+writer:write_file_header("huge", huge)
+reader = microtar.open_string(writer:close())
+assert(reader:read_header().size == huge, "Base-256 size did not survive a round trip")
+reader:close()
+local record = "19 size=" .. string.format("%d", huge) .. "\n"
+reader = microtar.open_string(ustar_header("pax", #record, "x") .. record .. string.rep("\0", 512 - #record)
+    .. ustar_header("huge", 0, "0") .. string.rep("\0", 1024))
+assert(reader:read_header().size == huge, "PAX size record was not applied")
+reader:close()
+writer = microtar.open("test_pax.tar", "w", { pax = true })
+writer:write_file_header("huge", huge)
+writer:close()
+fd = io.open("test_pax.tar", "rb")
+assert(fd:read("*a"):find("19 size=8589934592\n", 1, true), "pax option did not record the size")
+fd:close()
+os.remove("test_pax.tar")
+writer = microtar.open_string()
+writer:write_file_header("short", 5)
+assert(not pcall(writer.write_data, writer, "abc", 5), "Data was read past the end of its string")
+writer:close()
+
+--- Test case: Pack with a table of contents. Lookups must return the same data as the files on disk.
+
+tar.create_from_path("lua", "test_toc.tar", { toc = true })
+fd = io.open("lua/CMakeFiles/lua.dir/src/lfunc.c.o", "rb")
+assert(tar.find("test_toc.tar", "CMakeFiles/lua.dir/src/lfunc.c.o") == fd:read("*a"), "Lookup through the table of contents failed")
+fd:close()
+os.remove("test_toc.tar")
+
+--- Test case: Look up every file through the index of one handle, last to first. Each must return the data on disk.
+
+local members = {}
+for name in capture("tar tf test.tar"):gmatch("[^\n]+") do
+    if lfs.attributes("lua/" .. name, "mode") == "file" then
+        table.insert(members, name)
+    end
+end
+reader = microtar.open("test.tar")
+for i = #members, 1, -1 do
+    local header = reader:find(members[i])
+    assert(header and header.name == members[i], "Indexed lookup missed " .. members[i])
+    fd = io.open("lua/" .. members[i], "rb")
+    assert(reader:read_data(header.size) == fd:read("*a"), "Indexed lookup returned wrong data for " .. members[i])
+    fd:close()
+end
+local _, missing_code = reader:find("not/in/archive")
+assert(missing_code == microtar.ENOTFOUND, "Indexed lookup found a missing name")
+reader:close()
+
+--- Test case: Read the archive through a memory mapping, in two views per file. Data must match the files on disk.
+
+reader = microtar.open_mmap("test.tar")
+local mapped = 0
+for header in reader:entries() do
+    mapped = mapped + 1
+    if header.type == microtar.TREG and header.size > 0 then
+        local half = math.floor(header.size / 2)
+        local data = half > 0 and reader:read_data(half) or ""
+        data = data .. reader:read_data(header.size - half)
+        fd = io.open("lua/" .. header.name, "rb")
+        assert(data == fd:read("*a"), "Mapped data differs from " .. header.name)
+        fd:close()
+    end
+end
+assert(mapped == select(2, tar.list("test.tar")), "Entries read through a mapping differ from the archive")
+local header = reader:find(members[1])
+fd = io.open("lua/" .. members[1], "rb")
+assert(header and reader:read_data(header.size) == fd:read("*a"), "Mapped lookup returned wrong data")
+fd:close()
+reader:close()
+local _, mmap_code = microtar.open_mmap("not_there.tar")
+assert(mmap_code == microtar.EOPENFAIL, "Mapping a missing file did not fail")
+
+--- Test case: Pack with gzip, and with zstd where it is built in. Unpacking must give the same content.
+
+tar.create_from_path("lua", "test_gzip.tar", { compress = "gzip" })
+assert(microtar.compression("test_gzip.tar") == "gzip", "gzip archive not recognised")
+assert(capture("gzip -dc test_gzip.tar | cmp - test.tar") == '', "gzip archive does not decompress to the plain one")
+tar.unpack("test_gzip.tar", "compressed")
+assert(capture("diff -qrN lua compressed") == '', "gzip archive unpacked to different content")
+delete_dir("compressed")
+--Appending would mean recompressing the archive, it is refused whatever the options say
+local _, append_code = microtar.open("test_gzip.tar", "a")
+assert(append_code == microtar.EUNSUPPORTED, "Append to a compressed archive was not refused")
+os.remove("test_gzip.tar")
+
+local zstd, zstd_code = microtar.open("test_zstd.tar", "w", { compress = "zstd" })
+if zstd then
+    zstd:add_tree("lua")
+    zstd:close()
+    assert(microtar.compression("test_zstd.tar") == "zstd", "zstd archive not recognised")
+    tar.unpack("test_zstd.tar", "compressed")
+    assert(capture("diff -qrN lua compressed") == '', "zstd archive unpacked to different content")
+    delete_dir("compressed")
+    os.remove("test_zstd.tar")
+else
+    assert(zstd_code == microtar.EUNSUPPORTED, "zstd archive could not be created")
+end
+
+--- Test case: Pack seekable gzip in small frames. Lookups decoding on several threads must find entries in any order.
+
+tar.create_from_path("lua", "test_seekable.tar", { compress = "gzip", seekable = 64 * 1024 })
+assert(capture("gzip -dc test_seekable.tar | cmp - test.tar") == '', "Seekable archive does not decompress to the plain one")
+local files = {}
+for header in tar.iter_by_path("test.tar") do
+    if header.type == microtar.TREG and header.size > 0 then
+        files[#files + 1] = header.name
+    end
+end
+local seekable = microtar.open("test_seekable.tar", "r", { threads = 4 })
+--Last file first, then back to the first one and to one in the middle
+for _, name in ipairs({ files[#files], files[1], files[math.floor(#files / 2) + 1] }) do
+    local header = seekable:find(name)
+    fd = io.open("lua/" .. name, "rb")
+    assert(header and seekable:read_data(header.size) == fd:read("*a"), "Seekable lookup returned wrong data: " .. name)
+    fd:close()
+end
+seekable:close()
+tar.unpack("test_seekable.tar", "compressed", { threads = 4 })
+assert(capture("diff -qrN lua compressed") == '', "Seekable archive unpacked to different content")
+delete_dir("compressed")
+os.remove("test_seekable.tar")
+
+--- Test case: List a subtree in one call. It must return the same entries as iterating over the archive.
+
+local listed, count = tar.list("sample.tar", { fields = { "name", "size" }, filter = "lua/CMakeFiles/" })
+local expected = 0
+for header in tar.iter_by_path("sample.tar") do
+    if header.name:sub(1, 15) == "lua/CMakeFiles/" then
+        expected = expected + 1
+        assert(listed.name[expected] == header.name and listed.size[expected] == header.size, "Listing differs from iteration")
+    end
+end
+assert(count == expected and expected > 0, "Listing returned a different number of entries")
+
+--- Test case: Unpack a subtree only. It must match the same subtree of the original sample.
+
+tar.unpack_subtree("sample.tar", "lua/CMakeFiles/", "subtree")
+assert(capture("diff -qrN sample/lua/CMakeFiles subtree/lua/CMakeFiles") == '', "Unpacked subtree differs from the sample")
+assert(lfs.attributes("subtree/lua/liblua.a") == nil, "Entries outside the subtree were unpacked")
+delete_dir("subtree")
+
+--Members stored as "./dir/..." are matched without the leading "./", as unpack names them.
+os.execute("mkdir -p dotted/sub && echo data > dotted/sub/file && echo other > dotted/other")
+os.execute("tar cf test_dotted.tar -C dotted .")
+tar.unpack_subtree("test_dotted.tar", "sub/", "subtree")
+assert(capture("diff -qrN dotted/sub subtree/sub") == '', "Subtree stored under ./ was not unpacked")
+assert(lfs.attributes("subtree/other") == nil, "Entries outside the subtree were unpacked")
+os.remove("test_dotted.tar")
+delete_dir("dotted")
+delete_dir("subtree")
+
 delete_dir("sample")
 delete_dir("lua")
 
+--- Test case: Unpack members named outside the destination. Both extractors must refuse them and write nothing.
+
+for _, name in ipairs({ "../escape", "sub/../../escape", "/escape" }) do
+    fd = io.open("test_escape.tar", "wb")
+    fd:write(ustar_header(name, 5, "0") .. "hello" .. string.rep("\0", 507 + 1024))
+    fd:close()
+    os.execute("gzip -c test_escape.tar > test_escape.tar.gz")
+    for _, archive in ipairs({ "test_escape.tar", "test_escape.tar.gz" }) do
+        os.execute("mkdir -p escape_out")
+        assert(not pcall(tar.unpack, archive, "escape_out"), "Unsafe name " .. name .. " was unpacked")
+        assert(lfs.attributes("escape") == nil, "Unpacking " .. name .. " wrote outside the destination")
+        delete_dir("escape_out")
+    end
+end
+local _, escape_code = microtar.extract("test_escape.tar", "escape_out")
+assert(escape_code == microtar.EBADNAME, "Unsafe name was not reported")
+write_file("secret.txt", "secret")
+for _, target in ipairs({ "../secret.txt", "sub/../../secret.txt", "/secret.txt" }) do
+    write_file("test_escape.tar", ustar_header("stolen", 0, "1", target) .. string.rep("\0", 1024))
+    os.execute("gzip -c test_escape.tar > test_escape.tar.gz")
+    for _, archive in ipairs({ "test_escape.tar", "test_escape.tar.gz" }) do
+        os.execute("mkdir -p escape_out")
+        assert(not pcall(tar.unpack, archive, "escape_out"), "Link to " .. target .. " was unpacked")
+        assert(lfs.attributes("escape_out/stolen") == nil, "Link to " .. target .. " was made")
+        delete_dir("escape_out")
+    end
+end
+os.remove("secret.txt")
+os.remove("test_escape.tar")
+os.remove("test_escape.tar.gz")
+
+--- Test case: Pack a tree with a symlink to its own ancestor. The walk must stop at the loop instead of following it.
+
+os.execute("mkdir -p loop/sub && echo data > loop/sub/file && ln -s .. loop/sub/up")
+tar.create_from_path("loop", "test_loop.tar", { sorted = true })
+assert(capture("tar tf test_loop.tar 2>&1") == "sub\nsub/file\nsub/up\n", "Symlink loop was followed")
+os.remove("test_loop.tar")
+os.remove("loop/sub/up")
+delete_dir("loop")
+
+--- Test case: Pack a tree holding a FIFO and a dangling symlink. Both must be skipped, without blocking or failing.
+
+os.execute("mkdir -p special && echo data > special/file && mkfifo special/fifo && ln -s nowhere special/dangling")
+for _, opts in ipairs({ { sorted = true }, { sorted = true, threads = 2 } }) do
+    tar.create_from_path("special", "test_special.tar", opts)
+    assert(capture("tar tf test_special.tar 2>&1") == "file\n", "Special files were not skipped")
+end
+tar.create_from_path_regex("special", "test_special.tar", ".*")
+assert(capture("tar tf test_special.tar 2>&1") == "file\n", "Special files were not skipped by the regex walk")
+os.remove("test_special.tar")
+os.remove("special/fifo")
+os.remove("special/dangling")
+delete_dir("special")
+
 --- Test case: Append directory and compare it with the original sample and its content.
 
 os.execute("tar xf sample_to_append.tar")
@@ -53,13 +352,194 @@ tar.unpack("test.tar", "appended")
 os.execute("mkdir sample_appended")
 os.execute("tar xf sample_appended.tar -C sample_appended")
 --Compare the contents of original directory and the generated one after up-packing. They should be identical.
-assert(capture("diff -qrN appended sample_appended") == '', "Directories content is not identical")
+--The fixture keeps the first tree under lua/, while create_from_path stores names relative to it.
+assert(capture("diff -qrN -x lualibs appended sample_appended/lua") == '', "Directories content is not identical")
+assert(capture("diff -qrN appended/lualibs sample_appended/lualibs") == '', "Directories content is not identical")
 
 os.remove("test.tar")
 delete_dir("lualibs")
 delete_dir("appended")
 delete_dir("sample_appended")
 
+--- Test case: Append through one handle, committing after each file. The archive must be complete after every commit.
+
+os.execute("mkdir -p appends && echo first > appends/a && echo second > appends/b")
+microtar.open("test_append.tar", "w"):close()
+local appender = microtar.open("test_append.tar", "a")
+appender:add_file("appends/a", "a")
+assert(appender:commit(), "Commit failed")
+assert(capture("tar tf test_append.tar 2>&1") == "a\n", "Archive incomplete after the first commit")
+appender:add_file("appends/b", "b")
+assert(appender:commit(), "Commit failed")
+assert(capture("tar tf test_append.tar 2>&1") == "a\nb\n", "Archive incomplete after the second commit")
+appender:close()
+tar.append_files({ "appends/a", "appends/b" }, "test_append.tar")
+assert(capture("tar tf test_append.tar 2>&1") == "a\nb\na\nb\n", "Appended files or trailer damaged")
+tar.unpack("test_append.tar", "appended")
+assert(capture("diff -qrN appends appended") == '', "Appended files differ after unpacking")
+
+os.remove("test_append.tar")
+delete_dir("appends")
+delete_dir("appended")
+
+--- Test case: Back up a directory, change it and back it up again. Unpacking must give its latest state.
+
+os.execute("mkdir -p backup/sub")
+write_file("backup/kept", "kept")
+write_file("backup/sub/gone", "gone")
+tar.backup("backup", "test_backup.tar")
+os.remove("backup/sub/gone")
+write_file("backup/sub/new", "new")
+write_file("backup/kept", "changed")
+tar.backup("backup", "test_backup.tar")
+tar.unpack("test_backup.tar", "restored")
+assert(capture("diff -qrN backup restored") == '', "Restored backup differs from the directory")
+--Lookups must agree with unpacking: the latest copy of a file, nothing of a deleted one.
+assert(tar.find("test_backup.tar", "kept") == "changed", "Lookup returned a stale copy")
+assert(tar.find("test_backup.tar", "sub/gone") == nil, "Lookup returned a deleted file")
+local backup_handle = microtar.open("test_backup.tar")
+local under_sub = backup_handle:find_prefix("sub/")
+assert(#under_sub == 1 and under_sub[1].name == "sub/new", "Prefix lookup returned a deleted file")
+backup_handle:close()
+
+os.remove("test_backup.tar")
+delete_dir("backup")
+delete_dir("restored")
+
+--- Test case: Pack two copies of a file with dedup. The second must be stored as a link and unpacked as the same data.
+
+os.execute("mkdir -p dedup")
+write_file("dedup/first", string.rep("payload", 1000))
+write_file("dedup/second", string.rep("payload", 1000))
+tar.create_from_path("dedup", "test_dedup.tar", { dedup = true })
+assert(lfs.attributes("test_dedup.tar").size == 512 + 7168 + 512 + 1024, "Duplicate payload was stored twice")
+tar.unpack("test_dedup.tar", "dedup_restored")
+assert(capture("diff -qrN dedup dedup_restored") == '', "Deduplicated files differ after unpacking")
+
+os.remove("test_dedup.tar")
+delete_dir("dedup")
+delete_dir("dedup_restored")
+
+--- Test case: Change a file after adding it with dedup. Later files must match what was stored, not the changed file.
+
+os.execute("mkdir -p rehash")
+write_file("rehash/a", "stored")
+writer = microtar.open("test_rehash.tar", "w", { dedup = true })
+writer:add_file("rehash/a", "a")
+write_file("rehash/a", "change")
+write_file("rehash/b", "change")
+write_file("rehash/c", "stored")
+writer:add_file("rehash/b", "b")
+writer:add_file("rehash/c", "c")
+writer:close()
+local linked = {}
+for header in tar.iter_by_path("test_rehash.tar") do
+    linked[header.name] = header.type == microtar.TLNK and header.linkname or false
+end
+assert(linked.b == false, "File was linked to content that is not in the archive")
+assert(linked.c == "a", "File was not linked to the stored copy of its content")
+tar.unpack("test_rehash.tar", "rehash_restored")
+assert(capture("cat rehash_restored/a rehash_restored/b rehash_restored/c") == "storedchangestored", "Deduplicated files unpacked wrong")
+os.remove("test_rehash.tar")
+delete_dir("rehash")
+delete_dir("rehash_restored")
+
+--- Test case: Change the target of a deduplicated link in a later append. The link must keep the data it was written against.
+
+os.execute("mkdir -p relinked")
+write_file("relinked/a", "old data")
+write_file("relinked/b", "old data")
+tar.create_from_path("relinked", "test_relinked.tar", { dedup = true, sorted = true })
+write_file("relinked/a", "new data")
+tar.append_files({ "relinked/a" }, "test_relinked.tar")
+os.execute("gzip -c test_relinked.tar > test_relinked.tar.gz")
+for _, archive in ipairs({ "test_relinked.tar", "test_relinked.tar.gz" }) do
+    tar.unpack(archive, "relinked_restored")
+    fd = io.open("relinked_restored/a", "rb")
+    assert(fd:read("*a") == "new data", "Rewritten target lost its new data")
+    fd:close()
+    fd = io.open("relinked_restored/b", "rb")
+    assert(fd:read("*a") == "old data", "Link followed a copy written after it")
+    fd:close()
+    delete_dir("relinked_restored")
+end
+
+os.remove("test_relinked.tar")
+os.remove("test_relinked.tar.gz")
+delete_dir("relinked")
+
+--- Test case: Pack a file with holes as sparse. Unpacking must restore its data and its length.
+
+os.execute("mkdir -p sparse && truncate -s 1048576 sparse/holes && echo data >> sparse/holes")
+tar.create_from_path("sparse", "test_sparse.tar", { sparse = true })
+tar.unpack("test_sparse.tar", "sparse_restored")
+assert(capture("cmp sparse/holes sparse_restored/holes") == '', "Sparse file differs after unpacking")
+
+os.remove("test_sparse.tar")
+delete_dir("sparse")
+delete_dir("sparse_restored")
+
+--- Test case: Pack with both payload digests, then corrupt one byte of a file. Verification must name that file.
+
+os.execute("mkdir -p verify")
+write_file("verify/first", "first file")
+write_file("verify/second", "second file, checked")
+write_file("verify/third", string.rep("0123456789abcdef", 65536))
+tar.create_from_path("verify", "test_verify.tar", { checksum = "both" })
+assert(tar.verify("test_verify.tar"), "Intact archive failed verification")
+for _, opts in ipairs({ { threads = 2 }, { queue_depth = 8 } }) do
+    tar.unpack("test_verify.tar", "verify_out", opts)
+    assert(capture("diff -qrN verify verify_out") == '', "Archive with digests unpacked wrong")
+    delete_dir("verify_out")
+end
+fd = io.open("test_verify.tar", "rb")
+local image = fd:read("*a")
+fd:close()
+local at = image:find("checked", 1, true)
+write_file("test_verify.tar", image:sub(1, at - 1) .. "C" .. image:sub(at + 1))
+local verified, verify_code, _, bad = tar.verify("test_verify.tar")
+assert(not verified and verify_code == microtar.EBADCHKSUM and bad == "second", "Corrupted entry was not reported")
+for _, opts in ipairs({ { threads = 2 }, { queue_depth = 8 } }) do
+    local _, extract_code = microtar.extract("test_verify.tar", "verify_out", opts)
+    assert(extract_code == microtar.EBADCHKSUM, "Corrupted entry was unpacked without an error")
+    delete_dir("verify_out")
+end
+
+os.remove("test_verify.tar")
+delete_dir("verify")
+
+--- Test case: Count the work of a known read. Every header parsed and every byte read must show in the statistics.
+
+writer = microtar.open("test_stats.tar", "w")
+writer:write_file_header("a", 5)
+writer:write_data("hello", 5)
+writer:write_file_header("b", 3)
+writer:write_data("abc", 3)
+writer:close()
+reader = microtar.open("test_stats.tar", "r", { stats = true })
+assert(reader:read_data(reader:read_header().size) == "hello", "Counted read returned wrong data")
+reader:next()
+assert(reader:read_data(reader:read_header().size) == "abc", "Counted read returned wrong data")
+local stats = reader:stats()
+reader:close()
+-- read_header, read_data and next each parse the header they start at
+assert(stats.headers == 5, "Parsed headers miscounted")
+assert(stats.bytes_read == 5 * 512 + 5 + 3, "Bytes read miscounted")
+assert(stats.checksum_failures == 0, "Intact archive counted checksum failures")
+fd = io.open("test_stats.tar", "rb")
+image = fd:read("*a")
+fd:close()
+write_file("test_stats.tar", image:sub(1, 1024) .. "c" .. image:sub(1026))
+reader = microtar.open("test_stats.tar", "r", { stats = true })
+reader:next()
+local _, stats_code = reader:read_header()
+assert(stats_code == microtar.EBADCHKSUM, "Corrupted header was read")
+stats = reader:stats()
+reader:close()
+assert(stats.headers == 1 and stats.checksum_failures == 1, "Bad header checksum was not counted")
+
+os.remove("test_stats.tar")
+
 
 --
 --local handle = tar.create("create.tar")